@@ -0,0 +1,229 @@
+﻿#include "buildcache.hpp"
+#include <jofilelib.hpp>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+
+const uint32 BuildCache::VERSION;
+
+static bool ReadFile( const std::string& _name, std::vector<char>& _data )
+{
+	std::ifstream file( _name, std::ifstream::binary | std::ifstream::ate );
+	if( !file.is_open() )
+		return false;
+	_data.resize( (size_t)file.tellg() );
+	file.seekg( 0 );
+	file.read( _data.data(), _data.size() );
+	return file.good();
+}
+
+// Split the content of a scene file into its named arrays. Returns false for
+// truncated files.
+static bool ReadSections( const std::vector<char>& _data, std::vector<const FileDecl::NamedArray*>& _sections )
+{
+	size_t offset = 0;
+	while( offset < _data.size() )
+	{
+		if( _data.size() - offset < sizeof(FileDecl::NamedArray) )
+			return false;
+		const FileDecl::NamedArray* header = reinterpret_cast<const FileDecl::NamedArray*>(_data.data() + offset);
+		size_t size = size_t(header->elementSize) * header->numElements;
+		offset += sizeof(FileDecl::NamedArray);
+		if( _data.size() - offset < size )
+			return false;
+		offset += size;
+		_sections.push_back( header );
+	}
+	return true;
+}
+
+static const FileDecl::NamedArray* FindSection( const std::vector<const FileDecl::NamedArray*>& _sections, const char* _name, size_t _elementSize )
+{
+	for( auto header : _sections )
+		if( strncmp( header->name, _name, sizeof(header->name) ) == 0 )
+			return header->elementSize == _elementSize ? header : nullptr;
+	return nullptr;
+}
+
+template<typename T>
+static void CopySection( const FileDecl::NamedArray* _header, std::vector<T>& _target )
+{
+	const char* data = reinterpret_cast<const char*>(_header + 1);
+	_target.resize( size_t(_header->elementSize) * _header->numElements / sizeof(T) );
+	memcpy( _target.data(), data, size_t(_header->elementSize) * _header->numElements );
+}
+
+uint64 BuildCache::Hash( const void* _data, size_t _size, uint64 _hash )
+{
+	const unsigned char* bytes = static_cast<const unsigned char*>(_data);
+	for( size_t i = 0; i < _size; ++i )
+		_hash = (_hash ^ bytes[i]) * 0x100000001b3ull;
+	return _hash;
+}
+
+BuildCache::BuildCache( const std::string& _directory ) :
+	m_directory(_directory),
+	m_key(0)
+{
+}
+
+bool BuildCache::ComputeKey( const std::string& _sceneFile, const std::string& _parameters )
+{
+	std::ifstream file( _sceneFile, std::ifstream::binary );
+	if( !file.is_open() )
+		return false;
+
+	uint64 hash = Hash( &VERSION, sizeof(VERSION) );
+	hash = Hash( _parameters.data(), _parameters.size(), hash );
+	// Stream the file, scenes can be larger than the memory we want to spend.
+	std::vector<char> chunk( 1 << 20 );
+	while( file )
+	{
+		file.read( chunk.data(), chunk.size() );
+		hash = Hash( chunk.data(), (size_t)file.gcount(), hash );
+	}
+	m_key = hash;
+	return true;
+}
+
+std::string BuildCache::GetEntryName( uint64 _key, const char* _extension ) const
+{
+	char name[17];
+	std::snprintf( name, sizeof(name), "%016llx", (unsigned long long)_key );
+	return m_directory + '/' + name + _extension;
+}
+
+bool BuildCache::Export( ExportBuffer& _file, const std::vector<FileDecl::Material>& _materialTable ) const
+{
+	// Collect the sections and validate the entry before anything is written
+	std::string entryName = GetEntryName( m_key, ".bim" );
+	std::vector<char> entry;
+	std::vector<const FileDecl::NamedArray*> sections;
+	if( !ReadFile( entryName, entry ) || !ReadSections( entry, sections ) )
+		return false;
+	const FileDecl::NamedArray* cachedMaterials = FindSection( sections, "materialref", sizeof(FileDecl::Material) );
+	if( !cachedMaterials )
+		return false;
+
+	// Map the material indices of the cached build to the current table
+	const FileDecl::Material* oldMaterials = reinterpret_cast<const FileDecl::Material*>(cachedMaterials + 1);
+	std::vector<uint32> remap( cachedMaterials->numElements );
+	bool identity = cachedMaterials->numElements == _materialTable.size();
+	for( uint32 i = 0; i < cachedMaterials->numElements; ++i )
+	{
+		uint32 j = 0;
+		while( j < _materialTable.size() && strncmp( oldMaterials[i].material, _materialTable[j].material, sizeof(FileDecl::Material) ) != 0 )
+			++j;
+		if( j == _materialTable.size() )
+			return false;
+		remap[i] = j;
+		identity &= i == j;
+	}
+
+	for( auto header : sections )
+	{
+		const void* data = header + 1;
+		if( header == cachedMaterials )
+			_file.AddArray( "materialref", sizeof(FileDecl::Material), (uint32)_materialTable.size(), _materialTable.data() );
+		else if( !identity && (strncmp( header->name, "triangles", sizeof(header->name) ) == 0
+			|| strncmp( header->name, "leaf_triangles", sizeof(header->name) ) == 0) )
+		{
+			// The element is a triangle or a padded leaf of triangles
+			uint32 numTriangles = header->elementSize / sizeof(FileDecl::Triangle) * header->numElements;
+			FileDecl::Triangle* triangles = static_cast<FileDecl::Triangle*>(_file.AddArray( header->name, header->elementSize, header->numElements ));
+			memcpy( triangles, data, size_t(header->elementSize) * header->numElements );
+			for( uint32 i = 0; i < numTriangles; ++i )
+				if( triangles[i].material < remap.size() )
+					triangles[i].material = remap[triangles[i].material];
+		} else if( !identity && strncmp( header->name, "leaf_materials", sizeof(header->name) ) == 0 )
+		{
+			uint32* materials = static_cast<uint32*>(_file.AddArray( header->name, header->elementSize, header->numElements ));
+			memcpy( materials, data, size_t(header->elementSize) * header->numElements );
+			for( uint32 i = 0; i < header->numElements; ++i )
+				if( materials[i] < remap.size() )
+					materials[i] = remap[materials[i]];
+		} else if( !identity && strncmp( header->name, "leaves_compressed", sizeof(header->name) ) == 0 )
+		{
+			// Mixed materials are in "leaf_materials"
+			FileDecl::CompressedLeaf* leaves = static_cast<FileDecl::CompressedLeaf*>(_file.AddArray( header->name, header->elementSize, header->numElements ));
+			memcpy( leaves, data, size_t(header->elementSize) * header->numElements );
+			for( uint32 i = 0; i < header->numElements; ++i )
+				if( leaves[i].material < remap.size() )
+					leaves[i].material = remap[leaves[i].material];
+		} else
+			_file.AddArray( header->name, header->elementSize, header->numElements, data );
+	}
+
+	if( identity )
+		std::cerr << "Reusing cached build " << entryName << std::endl;
+	else
+		std::cerr << "Reusing cached build " << entryName << " with remapped materials" << std::endl;
+	return true;
+}
+
+template<typename F>
+void BuildCache::WriteEntry( const std::string& _entryName, F _write ) const
+{
+	if( !Jo::Files::Utils::Exists( m_directory ) )
+		Jo::Files::Utils::MakeDir( m_directory );
+
+	std::string tmpName = _entryName + ".tmp" + std::to_string( std::chrono::high_resolution_clock::now().time_since_epoch().count() );
+	{
+		std::ofstream entry( tmpName, std::ofstream::binary );
+		_write( entry );
+		if( !entry.good() )
+		{
+			std::cerr << "Cannot write the build cache entry " << _entryName << std::endl;
+			entry.close();
+			std::remove( tmpName.c_str() );
+			return;
+		}
+	}
+	std::remove( _entryName.c_str() );
+	if( std::rename( tmpName.c_str(), _entryName.c_str() ) != 0 )
+		std::remove( tmpName.c_str() );
+}
+
+void BuildCache::Store( const std::string& _sceneFile ) const
+{
+	std::vector<char> data;
+	if( !ReadFile( _sceneFile, data ) )
+	{
+		std::cerr << "Cannot read " << _sceneFile << " for the build cache." << std::endl;
+		return;
+	}
+	WriteEntry( GetEntryName( m_key, ".bim" ), [&](std::ofstream& _entry) {
+		_entry.write( data.data(), data.size() );
+	} );
+}
+
+bool BuildCache::LoadMesh( uint64 _key, size_t _boundingVolumeSize, BVHBuilder::MeshHierarchy& _mesh ) const
+{
+	std::vector<char> entry;
+	std::vector<const FileDecl::NamedArray*> sections;
+	if( !ReadFile( GetEntryName( _key, ".mesh" ), entry ) || !ReadSections( entry, sections ) )
+		return false;
+	const FileDecl::NamedArray* vertices = FindSection( sections, "vertices", sizeof(FileDecl::Vertex) );
+	const FileDecl::NamedArray* leaves = FindSection( sections, "leaves", sizeof(FileDecl::Leaf) );
+	const FileDecl::NamedArray* nodes = FindSection( sections, "nodes", sizeof(BVHBuilder::Node) );
+	const FileDecl::NamedArray* boundingVolumes = FindSection( sections, "bounding_volumes", _boundingVolumeSize );
+	if( !vertices || !leaves || !nodes || !boundingVolumes || nodes->numElements != boundingVolumes->numElements )
+		return false;
+
+	CopySection( vertices, _mesh.vertices );
+	CopySection( leaves, _mesh.leaves );
+	CopySection( nodes, _mesh.nodes );
+	CopySection( boundingVolumes, _mesh.boundingVolumes );
+	return true;
+}
+
+void BuildCache::StoreMesh( uint64 _key, const BVHBuilder::MeshHierarchy& _mesh ) const
+{
+	WriteEntry( GetEntryName( _key, ".mesh" ), [&](std::ofstream& _entry) {
+		ExportBuffer buffer( _entry );
+		buffer.AddArray( "vertices", sizeof(FileDecl::Vertex), (uint32)_mesh.vertices.size(), _mesh.vertices.data() );
+		buffer.AddArray( "leaves", sizeof(FileDecl::Leaf), (uint32)_mesh.leaves.size(), _mesh.leaves.data() );
+		buffer.AddArray( "nodes", sizeof(BVHBuilder::Node), (uint32)_mesh.nodes.size(), _mesh.nodes.data() );
+		buffer.AddArray( "bounding_volumes", (uint32)(_mesh.boundingVolumes.size() / _mesh.nodes.size()), (uint32)_mesh.nodes.size(), _mesh.boundingVolumes.data() );
+	} );
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "bvhmake.hpp"
+#include <string>
+#include <vector>
+
+/// \brief Content addressed store of previously exported scene files.
+/// \details An entry is keyed on a hash of the input file bytes and all
+///		parameters which change the binary output. The material json is not
+///		part of the key: its values never reach the binary file and only the
+///		order of the material names decides the triangle material indices.
+///		On a hit the material indices of the cached "triangles" are remapped
+///		to the current material table, so editing the json reuses the
+///		hierarchy.
+///
+///		Additionally single mesh hierarchies can be stored, such that
+///		scenes with few changed meshes rebuild only those.
+class BuildCache
+{
+public:
+	/// \brief Part of all keys. Increase if the layout of any exported array
+	///		or of the mesh entries changes.
+	static const uint32 VERSION = 2;
+
+	/// \param [in] _directory Directory for the cache entries. It is created
+	///		on the first Store().
+	explicit BuildCache( const std::string& _directory );
+
+	/// \brief Hash the scene file and the build parameters.
+	/// \param [in] _parameters Canonical string of all output affecting arguments.
+	/// \returns false if the scene file cannot be read.
+	bool ComputeKey( const std::string& _sceneFile, const std::string& _parameters );
+
+	/// \brief Export all sections of the cached entry.
+	/// \details "materialref" is replaced by _materialTable and the material
+	///		indices of the triangles are remapped by name.
+	/// \returns false if there is no usable entry. This includes entries
+	///		whose materials are missing in _materialTable (they must be
+	///		imported with Assimp). Nothing is written to _file in this case.
+	bool Export( ExportBuffer& _file, const std::vector<FileDecl::Material>& _materialTable ) const;
+
+	/// \brief Copy a finished scene file into the cache.
+	void Store( const std::string& _sceneFile ) const;
+
+	/// \brief Load the hierarchy of a single mesh.
+	/// \param [in] _key Hash of the mesh and its build parameters.
+	/// \param [in] _boundingVolumeSize Size of the bounding volumes of the
+	///		current fit method.
+	/// \returns false if there is no entry with the same volume size.
+	bool LoadMesh( uint64 _key, size_t _boundingVolumeSize, BVHBuilder::MeshHierarchy& _mesh ) const;
+
+	/// \brief Store the hierarchy of a single mesh.
+	void StoreMesh( uint64 _key, const BVHBuilder::MeshHierarchy& _mesh ) const;
+
+	/// \brief FNV-1a hash of a memory block.
+	/// \param [in] _hash Result of a previous call to hash multiple blocks.
+	static uint64 Hash( const void* _data, size_t _size, uint64 _hash = 0xcbf29ce484222325ull );
+
+private:
+	std::string m_directory;
+	uint64 m_key;
+
+	std::string GetEntryName( uint64 _key, const char* _extension ) const;
+
+	/// \brief Write an entry through a temporary file, such that concurrent
+	///		runs never see partial entries.
+	/// \param [in] _write Callable which writes the content to a std::ofstream&.
+	template<typename F>
+	void WriteEntry( const std::string& _entryName, F _write ) const;
+};
@@ -0,0 +1,250 @@
+﻿#include "binnedsah.hpp"
+#include "../parallel.hpp"
+#include "../../gpugi/utilities/assert.hpp"
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <future>
+
+using namespace ε;
+
+const uint32 NUM_BINS = 32;
+// Minimum number of triangles on each side of a split. This bounds the number
+// of leaves to n/MIN_LEAF_FILL.
+const uint32 MIN_LEAF_FILL = FileDecl::Leaf::NUM_PRIMITIVES / 2;
+// Subtrees with fewer triangles are built in the current task.
+const uint32 PARALLEL_BUILD_THRESHOLD = 4096;
+// Nodes with more triangles compute their bins with all threads.
+const uint32 PARALLEL_BINNING_THRESHOLD = 1 << 16;
+
+struct Bin
+{
+	Box bounds;
+	uint32 count;
+};
+
+// Bins for all three dimensions
+struct BinSet
+{
+	Bin bins[3][NUM_BINS];
+};
+
+static const Box EMPTY_BOX( Vec3(std::numeric_limits<float>::infinity()), Vec3(-std::numeric_limits<float>::infinity()) );
+
+// The cost of a child is proportional to the number of leaf blocks which
+// must be tested.
+static float LeafBlocks( uint32 _num )
+{
+	return float((_num + FileDecl::Leaf::NUM_PRIMITIVES - 1) / FileDecl::Leaf::NUM_PRIMITIVES);
+}
+
+uint32 BuildBinnedSAH::operator()() const
+{
+    std::cerr << "  Computing triangle bounds for binned SAH..." << std::endl;
+
+	uint32 n = m_manager->GetTriangleCount();
+	std::unique_ptr<Primitive[]> primitives(new Primitive[n]);
+	std::unique_ptr<uint32[]> ids(new uint32[n]);
+	ParallelFor(n, [&](uint32 i) {
+		ids[i] = i;
+		primitives[i].bounds = Box( m_manager->GetTriangle( i ) );
+		primitives[i].center = (primitives[i].bounds.min + primitives[i].bounds.max) * 0.5f;
+	});
+
+	// Spawn tasks in the upper levels only, such that there are a few more
+	// tasks than threads.
+	int parallelDepth = 2;
+	for( uint32 t = GetNumThreads(); t > 1; t >>= 1 ) ++parallelDepth;
+
+    std::cerr << "  Building tree via binned SAH on " << GetNumThreads() << " threads..." << std::endl;
+
+	uint32 root = Build(ids.get(), primitives.get(), 0, n-1, parallelDepth);
+	return m_manager->SortNodesPreorder( root );
+}
+
+uint32 BuildBinnedSAH::Build( uint32* _ids, const Primitive* _primitives, uint32 _min, uint32 _max, int _parallelDepth ) const
+{
+	auto fit = m_manager->GetFitMethod();
+
+	uint32 nodeIdx = m_manager->GetNewNode();
+	BVHBuilder::Node& node = m_manager->GetNode( nodeIdx );
+
+	// Create a leaf if less than NUM_PRIMITIVES elements remain.
+	Assert(_min <= _max, "Node without triangles!");
+	if( (_max - _min) < FileDecl::Leaf::NUM_PRIMITIVES )
+	{
+		// Allocate a new leaf
+		uint32 leafIdx = m_manager->GetNewLeaf();
+		FileDecl::Leaf& leaf = m_manager->GetLeaf( leafIdx );
+		// Fill it
+		FileDecl::Triangle* trianglesPtr = leaf.triangles;
+		for( uint i = _min; i <= _max; ++i )
+			*(trianglesPtr++) = m_manager->GetTriangleIdx( _ids[i] );
+		for( uint i = 0; i < FileDecl::Leaf::NUM_PRIMITIVES - (_max - _min + 1); ++i )
+			*(trianglesPtr++) = FileDecl::INVALID_TRIANGLE;
+
+		// Let new inner node pointing to this leaf
+		node.left = 0x80000000 | leafIdx;
+		node.right = 0;
+
+		// Compute a bounding volume for the new node
+		(*fit)( leaf.triangles, _max - _min + 1, nodeIdx );
+
+		return nodeIdx;
+	}
+
+	uint32 splitIndex = Split( _ids, _primitives, _min, _max );
+
+	if( _parallelDepth > 0 && (_max - _min) >= PARALLEL_BUILD_THRESHOLD )
+	{
+		// Build the left subtree in a new task and the right one in this.
+		auto left = std::async( std::launch::async, [=]() {
+			return Build( _ids, _primitives, _min, splitIndex, _parallelDepth - 1 );
+		} );
+		node.right = Build( _ids, _primitives, splitIndex + 1, _max, _parallelDepth - 1 );
+		node.left = left.get();
+	} else {
+		node.left = Build( _ids, _primitives, _min, splitIndex, 0 );
+		node.right = Build( _ids, _primitives, splitIndex + 1, _max, 0 );
+	}
+
+	(*fit)( node.left, node.right, nodeIdx );
+
+	return nodeIdx;
+}
+
+// Map a center coordinate to its bin. Must be the same during binning and
+// partitioning.
+static uint32 BinIndex( float _center, float _min, float _scale )
+{
+	return min(NUM_BINS - 1, uint32((_center - _min) * _scale));
+}
+
+uint32 BuildBinnedSAH::Split( uint32* _ids, const Primitive* _primitives, uint32 _min, uint32 _max )
+{
+	uint32 num = _max - _min + 1;
+	bool parallel = num >= PARALLEL_BINNING_THRESHOLD;
+
+	// Get the range of the centers to place the bins
+	Box centerBounds = EMPTY_BOX;
+	if( parallel )
+	{
+		std::vector<Box> threadBounds(GetNumThreads(), EMPTY_BOX);
+		ParallelRange(num, [&](uint32 _thread, uint32 _begin, uint32 _end) {
+			for( uint32 i = _min + _begin; i < _min + _end; ++i )
+			{
+				threadBounds[_thread].min = ε::min(threadBounds[_thread].min, _primitives[_ids[i]].center);
+				threadBounds[_thread].max = ε::max(threadBounds[_thread].max, _primitives[_ids[i]].center);
+			}
+		});
+		for( auto& box : threadBounds )
+			centerBounds = Box(centerBounds, box);
+	} else {
+		for( uint32 i = _min; i <= _max; ++i )
+		{
+			centerBounds.min = ε::min(centerBounds.min, _primitives[_ids[i]].center);
+			centerBounds.max = ε::max(centerBounds.max, _primitives[_ids[i]].center);
+		}
+	}
+	Vec3 extent = centerBounds.max - centerBounds.min;
+	// Slightly reduce the scale such that the max coordinate is mapped into the last bin.
+	Vec3 scale;
+	for( int d = 0; d < 3; ++d )
+		scale[d] = extent[d] > 0.0f ? NUM_BINS * 0.99999f / extent[d] : 0.0f;
+
+	// Fill the bins of all three dimensions at once
+	auto binRange = [&](uint32 _begin, uint32 _end, BinSet& _set) {
+		auto& _bins = _set.bins;
+		for( int d = 0; d < 3; ++d )
+			for( uint32 b = 0; b < NUM_BINS; ++b )
+			{
+				_bins[d][b].bounds = EMPTY_BOX;
+				_bins[d][b].count = 0;
+			}
+		for( uint32 i = _begin; i < _end; ++i )
+		{
+			const Primitive& p = _primitives[_ids[i]];
+			for( int d = 0; d < 3; ++d )
+			{
+				Bin& bin = _bins[d][BinIndex(p.center[d], centerBounds.min[d], scale[d])];
+				bin.bounds = Box(bin.bounds, p.bounds);
+				++bin.count;
+			}
+		}
+	};
+	BinSet binSet;
+	auto& bins = binSet.bins;
+	if( parallel )
+	{
+		std::vector<BinSet> threadBins(GetNumThreads());
+		ParallelRange(num, [&](uint32 _thread, uint32 _begin, uint32 _end) {
+			binRange(_min + _begin, _min + _end, threadBins[_thread]);
+		});
+		for( int d = 0; d < 3; ++d )
+			for( uint32 b = 0; b < NUM_BINS; ++b )
+			{
+				bins[d][b].bounds = EMPTY_BOX;
+				bins[d][b].count = 0;
+				for( auto& tb : threadBins )
+				{
+					if( tb.bins[d][b].count == 0 ) continue;
+					bins[d][b].bounds = Box(bins[d][b].bounds, tb.bins[d][b].bounds);
+					bins[d][b].count += tb.bins[d][b].count;
+				}
+			}
+	} else binRange(_min, _max + 1, binSet);
+
+	// Sweep over the bins and evaluate the heuristic for all planes between bins
+	float minCost = std::numeric_limits<float>::infinity();
+	int splitDim = -1;
+	uint32 splitBin = 0;
+	for( int d = 0; d < 3; ++d )
+	{
+		if( extent[d] <= 0.0f ) continue;
+		// Right sided costs from the back
+		float rightCost[NUM_BINS];
+		Box box = EMPTY_BOX;
+		uint32 count = 0;
+		for( uint32 b = NUM_BINS - 1; b > 0; --b )
+		{
+			if( bins[d][b].count ) box = Box(box, bins[d][b].bounds);
+			count += bins[d][b].count;
+			rightCost[b-1] = count >= MIN_LEAF_FILL ? surface(box) * LeafBlocks(count) : std::numeric_limits<float>::infinity();
+		}
+		// Left sides
+		box = EMPTY_BOX;
+		count = 0;
+		for( uint32 b = 0; b < NUM_BINS - 1; ++b )
+		{
+			if( bins[d][b].count ) box = Box(box, bins[d][b].bounds);
+			count += bins[d][b].count;
+			if( count < MIN_LEAF_FILL || num - count < MIN_LEAF_FILL ) continue;
+			float cost = surface(box) * LeafBlocks(count) + rightCost[b];
+			if( cost < minCost )
+			{
+				minCost = cost;
+				splitDim = d;
+				splitBin = b;
+			}
+		}
+	}
+
+	if( splitDim >= 0 )
+	{
+		uint32* mid = std::partition( _ids + _min, _ids + _max + 1, [&](uint32 _id) {
+			return BinIndex(_primitives[_id].center[splitDim], centerBounds.min[splitDim], scale[splitDim]) <= splitBin;
+		});
+		return uint32(mid - _ids) - 1;
+	}
+
+	// Fallback: all centers are too close to each other. Median split along
+	// the largest dimension.
+	int dim = 0;
+	if( extent[1] > extent[0] && extent[1] > extent[2] ) dim = 1;
+	if( extent[2] > extent[0] && extent[2] > extent[1] ) dim = 2;
+	uint32 splitIndex = _min + (num - 1) / 2;
+	std::nth_element( _ids + _min, _ids + splitIndex, _ids + _max + 1, [&](uint32 _lhs, uint32 _rhs) {
+		return _primitives[_lhs].center[dim] < _primitives[_rhs].center[dim];
+	});
+	return splitIndex;
+}
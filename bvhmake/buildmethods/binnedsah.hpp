@@ -0,0 +1,39 @@
+﻿#pragma once
+
+#include "../bvhmake.hpp"
+
+/// \brief Top-down build with binned surface area heuristic splits.
+/// \details The heuristic is evaluated on axis aligned boxes of the triangles
+///		(independent of the fit method). Large subtrees are built in parallel
+///		tasks, so the nodes are resorted into preorder at the end.
+class BuildBinnedSAH: public BuildMethod
+{
+public:
+	BuildBinnedSAH(BVHBuilder* _manager) : BuildMethod(_manager) {}
+
+    virtual uint32 operator()() const override;
+
+	/// \brief Precomputed per triangle data for the binning.
+	struct Primitive
+	{
+		ε::Box bounds;
+		ε::Vec3 center;		///< Center of the bounds
+	};
+
+	/// \brief Find the binned SAH split of a range and partition the ids.
+	/// \details Splits are restricted such that both sides get at least half a
+	///		leaf of triangles. If no such split exists a median split along the
+	///		largest center extent is done.
+	/// \param [inout] _ids Indices into _primitives which are reordered.
+	/// \returns The last index of the left partition.
+	static uint32 Split( uint32* _ids, const Primitive* _primitives, uint32 _min, uint32 _max );
+
+    /// \brief Create new tree-nodes recursively.
+	/// \details Can be used by other builders to process subsets of the
+	///		triangles. The nodes are not in preorder if _parallelDepth > 0.
+	/// \param [inout] _ids Triangle indices which are reordered.
+	/// \param [in] _parallelDepth Number of further recursion levels which
+	///		may spawn a new task.
+	/// \returns Index of the subtree's root node.
+    uint32 Build( uint32* _ids, const Primitive* _primitives, uint32 _min, uint32 _max, int _parallelDepth ) const;
+};
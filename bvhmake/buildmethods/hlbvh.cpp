@@ -0,0 +1,182 @@
+﻿#include "hlbvh.hpp"
+#include "lbvh.hpp"
+#include "binnedsah.hpp"
+#include "../parallel.hpp"
+#include "../../gpugi/utilities/assert.hpp"
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+
+using namespace ε;
+
+// Minimum number of triangles per cluster (except for the last one).
+const uint32 MIN_CLUSTER_SIZE = 8 * FileDecl::Leaf::NUM_PRIMITIVES;
+const uint32 NUM_TOP_LEVEL_BINS = 32;
+
+struct Cluster
+{
+	uint32 min, max;	///< Inclusive range in the sorted triangle list
+	uint32 root;		///< Root node of the cluster subtree
+};
+
+// Binned SAH split of the clusters [_min, _max]. Unlike
+// BuildBinnedSAH::Split() a cluster costs its number of triangles and each
+// side may get a single cluster.
+static uint32 SplitClusters( uint32* _ids, const BuildBinnedSAH::Primitive* _primitives,
+	const Cluster* _clusters, uint32 _min, uint32 _max )
+{
+	Box centerBounds( _primitives[_ids[_min]].center, _primitives[_ids[_min]].center );
+	for( uint32 i = _min + 1; i <= _max; ++i )
+	{
+		centerBounds.min = ε::min(centerBounds.min, _primitives[_ids[i]].center);
+		centerBounds.max = ε::max(centerBounds.max, _primitives[_ids[i]].center);
+	}
+	Vec3 extent = centerBounds.max - centerBounds.min;
+	Vec3 scale;
+	for( int d = 0; d < 3; ++d )
+		scale[d] = extent[d] > 0.0f ? NUM_TOP_LEVEL_BINS * 0.99999f / extent[d] : 0.0f;
+	auto binIndex = [&](uint32 _id, int _dim) {
+		return min(NUM_TOP_LEVEL_BINS - 1, uint32((_primitives[_id].center[_dim] - centerBounds.min[_dim]) * scale[_dim]));
+	};
+
+	float minCost = std::numeric_limits<float>::infinity();
+	int splitDim = -1;
+	uint32 splitBin = 0;
+	for( int d = 0; d < 3; ++d )
+	{
+		if( extent[d] <= 0.0f ) continue;
+		Box bounds[NUM_TOP_LEVEL_BINS];
+		uint32 triangles[NUM_TOP_LEVEL_BINS] = {0};
+		for( uint32 i = _min; i <= _max; ++i )
+		{
+			uint32 b = binIndex( _ids[i], d );
+			const Cluster& cluster = _clusters[_ids[i]];
+			bounds[b] = triangles[b] ? Box(bounds[b], _primitives[_ids[i]].bounds) : _primitives[_ids[i]].bounds;
+			triangles[b] += cluster.max - cluster.min + 1;
+		}
+		// Right sided costs from the back, then sweep the left sides.
+		// Both sides of a plane must contain a cluster.
+		float rightCost[NUM_TOP_LEVEL_BINS];
+		Box box;
+		uint32 count = 0;
+		for( uint32 b = NUM_TOP_LEVEL_BINS - 1; b > 0; --b )
+		{
+			if( triangles[b] ) box = count ? Box(box, bounds[b]) : bounds[b];
+			count += triangles[b];
+			rightCost[b-1] = count ? surface(box) * count : std::numeric_limits<float>::infinity();
+		}
+		count = 0;
+		for( uint32 b = 0; b < NUM_TOP_LEVEL_BINS - 1; ++b )
+		{
+			if( triangles[b] ) box = count ? Box(box, bounds[b]) : bounds[b];
+			count += triangles[b];
+			if( !count ) continue;
+			float cost = surface(box) * count + rightCost[b];
+			if( cost < minCost )
+			{
+				minCost = cost;
+				splitDim = d;
+				splitBin = b;
+			}
+		}
+	}
+
+	if( splitDim >= 0 )
+	{
+		uint32* mid = std::partition( _ids + _min, _ids + _max + 1, [&](uint32 _id) {
+			return binIndex( _id, splitDim ) <= splitBin;
+		});
+		return uint32(mid - _ids) - 1;
+	}
+
+	// All centers are equal, halve the list
+	return _min + (_max - _min) / 2;
+}
+
+// Connect the clusters [_min, _max] by binned SAH splits.
+static uint32 BuildTopLevel( BVHBuilder* _manager, uint32* _ids, const BuildBinnedSAH::Primitive* _primitives,
+	const Cluster* _clusters, uint32 _min, uint32 _max )
+{
+	if( _min == _max )
+		return _clusters[_ids[_min]].root;
+
+	uint32 nodeIdx = _manager->GetNewNode();
+	uint32 splitIndex = SplitClusters( _ids, _primitives, _clusters, _min, _max );
+	BVHBuilder::Node& node = _manager->GetNode( nodeIdx );
+	node.left = BuildTopLevel( _manager, _ids, _primitives, _clusters, _min, splitIndex );
+	node.right = BuildTopLevel( _manager, _ids, _primitives, _clusters, splitIndex + 1, _max );
+	(*_manager->GetFitMethod())( node.left, node.right, nodeIdx );
+	return nodeIdx;
+}
+
+uint32 BuildHLBVH::operator()() const
+{
+    std::cerr << "  Sorting Morton codes for HLBVH..." << std::endl;
+
+	std::vector<uint64> codes;
+	std::vector<uint32> sorted;
+	int bits = BuildLBVH::ComputeSortedMortonCodes( m_manager, codes, sorted );
+	uint32 n = (uint32)sorted.size();
+
+	// Find the clusters (runs of equal prefixes). Small runs are merged with
+	// their successors, since single triangles would become single leaves.
+	int shift = bits - min(m_clusterBits, bits);
+	std::vector<Cluster> clusters;
+	Cluster cluster;
+	cluster.min = 0;
+	for( uint32 i = 1; i <= n; ++i )
+		if( i == n || ((codes[i] >> shift) != (codes[i-1] >> shift) && i - cluster.min >= MIN_CLUSTER_SIZE) )
+		{
+			cluster.max = i - 1;
+			clusters.push_back( cluster );
+			cluster.min = i;
+		}
+	uint32 numClusters = (uint32)clusters.size();
+
+    std::cerr << "  Building " << numClusters << " HLBVH clusters with binned SAH..." << std::endl;
+
+	std::unique_ptr<BuildBinnedSAH::Primitive[]> primitives(new BuildBinnedSAH::Primitive[n]);
+	ParallelFor(n, [&](uint32 i) {
+		BuildBinnedSAH::Primitive& p = primitives[sorted[i]];
+		p.bounds = Box( m_manager->GetTriangle( sorted[i] ) );
+		p.center = (p.bounds.min + p.bounds.max) * 0.5f;
+	});
+
+	// Process the clusters from large to small. Threads take the next
+	// cluster from a shared counter. Clusters which are larger than the
+	// share of a single thread are built in parallel themselves.
+	std::vector<uint32> order(numClusters);
+	for( uint32 i = 0; i < numClusters; ++i ) order[i] = i;
+	std::sort( order.begin(), order.end(), [&](uint32 _lhs, uint32 _rhs) {
+		return clusters[_lhs].max - clusters[_lhs].min > clusters[_rhs].max - clusters[_rhs].min;
+	});
+	uint32 numThreads = GetNumThreads();
+	BuildBinnedSAH sah( m_manager );
+	std::atomic<uint32> next(0);
+	ParallelRange(numThreads, [&](uint32, uint32, uint32) {
+		for( uint32 i = next++; i < numClusters; i = next++ )
+		{
+			Cluster& c = clusters[order[i]];
+			int parallelDepth = (c.max - c.min) * numThreads > n ? 2 : 0;
+			c.root = sah.Build( sorted.data(), primitives.get(), c.min, c.max, parallelDepth );
+		}
+	}, 1);
+
+    std::cerr << "  Building HLBVH top level..." << std::endl;
+
+	std::unique_ptr<BuildBinnedSAH::Primitive[]> clusterPrimitives(new BuildBinnedSAH::Primitive[numClusters]);
+	std::vector<uint32> ids(numClusters);
+	for( uint32 i = 0; i < numClusters; ++i )
+	{
+		Box bounds = primitives[sorted[clusters[i].min]].bounds;
+		for( uint32 j = clusters[i].min + 1; j <= clusters[i].max; ++j )
+			bounds = Box(bounds, primitives[sorted[j]].bounds);
+		clusterPrimitives[i].bounds = bounds;
+		clusterPrimitives[i].center = (bounds.min + bounds.max) * 0.5f;
+		ids[i] = i;
+	}
+	uint32 root = BuildTopLevel( m_manager, ids.data(), clusterPrimitives.get(), clusters.data(), 0, numClusters - 1 );
+
+	return m_manager->SortNodesPreorder( root );
+}
@@ -0,0 +1,24 @@
+﻿#pragma once
+
+#include "../bvhmake.hpp"
+
+/// \brief Hierarchical LBVH: Morton clusters with SAH subtrees and a SAH top
+///		level (similar to Garanzha et al. 2011).
+/// \details The triangles are sorted by Morton code (see BuildLBVH) and
+///		grouped by the first _clusterBits bits of their code. Each cluster is
+///		built with binned SAH in parallel and the cluster roots are connected
+///		by a binned SAH top level.
+///		Fewer cluster bits give larger clusters, i.e. a higher quality and a
+///		longer build time.
+class BuildHLBVH: public BuildMethod
+{
+public:
+	/// \param [in] _clusterBits Length of the Morton prefix which defines a
+	///		cluster (at most 30).
+	BuildHLBVH(BVHBuilder* _manager, int _clusterBits) : BuildMethod(_manager), m_clusterBits(_clusterBits) {}
+
+    virtual uint32 operator()() const override;
+
+private:
+	int m_clusterBits;
+};
@@ -28,12 +28,6 @@ uint32 BuildKdtree::operator()() const
     return Build(sorted, centers.get(), 0, n-1);
 }
 
-void BuildKdtree::EstimateNodeCounts( uint32& _numInnerNodes, uint32& _numLeafNodes ) const 
-{
-    _numInnerNodes = 4 * m_manager->GetTriangleCount() / FileDecl::Leaf::NUM_PRIMITIVES;
-    _numLeafNodes = 2 * m_manager->GetTriangleCount() / FileDecl::Leaf::NUM_PRIMITIVES;
-}
-
 void BuildKdtree::Initialize( const std::unique_ptr<uint32[]>* _sorted, Vec3* _centers ) const
 {
     uint32 n = m_manager->GetTriangleCount();
@@ -63,7 +57,8 @@ void BuildKdtree::Initialize( const std::unique_ptr<uint32[]>* _sorted, Vec3* _c
 void BuildKdtree::Split( uint32* _list, const Vec3* _centers, uint32 _size, int _splitDim, float _splitPlane ) const
 {
 	// Make a temporary copy
-    std::vector<uint32> tmp( _size );
+	ScratchArena::Scope scratch;
+	uint32* tmp = scratch.Allocate<uint32>( _size );
 
 	// The first half should have a size of (_size + 1) / 2 which is half of
 	// the elements and in case of a odd number the additional element goes to
@@ -79,7 +74,7 @@ void BuildKdtree::Split( uint32* _list, const Vec3* _centers, uint32 _size, int
 	Assert( l == rightOff, "Offset of right half was wrong!" );
 	Assert( l+r-rightOff == _size, "Inconsistent split - not all elements were copied!" );
 	// Copy back
-	memcpy( _list, &tmp[0], _size * sizeof(uint32) );
+	memcpy( _list, tmp, _size * sizeof(uint32) );
 }
 
 uint32 BuildKdtree::Build( const std::unique_ptr<uint32[]>* _sorted, Vec3* _centers, uint32 _min, uint32 _max ) const
@@ -9,8 +9,6 @@ public:
 
     virtual uint32 operator()() const override;
 
-    virtual void EstimateNodeCounts( uint32& _numInnerNodes, uint32& _numLeafNodes ) const override;
-
 private:
     /// \brief Compute triangle centers and fill the 3 arrays with sorted
     ///     indices of the triangle centers.
@@ -0,0 +1,220 @@
+﻿#include "lbvh.hpp"
+#include "sweep.hpp"
+#include "../parallel.hpp"
+#include "../../gpugi/utilities/assert.hpp"
+#include <iostream>
+#include <vector>
+#include <atomic>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+using namespace ε;
+
+// Runs of sorted triangles are closed early at large Morton gaps, but only
+// after they got at least MIN_LEAF_FILL triangles. This bounds the number of
+// leaves to n/MIN_LEAF_FILL+1.
+const uint32 MIN_LEAF_FILL = FileDecl::Leaf::NUM_PRIMITIVES / 2;
+
+// Count leading zeros of a 64 bit number
+static int clz64( uint64 _x )
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	if( _BitScanReverse64(&index, _x) ) return 63 - int(index);
+	return 64;
+#else
+	return _x ? __builtin_clzll(_x) : 64;
+#endif
+}
+
+uint32 BuildLBVH::operator()() const
+{
+    std::cerr << "  Sorting Morton codes for LBVH..." << std::endl;
+
+	std::vector<uint64> codes;
+	std::vector<uint32> sorted;
+	ComputeSortedMortonCodes( m_manager, codes, sorted );
+	uint32 n = (uint32)sorted.size();
+
+    std::cerr << "  Building LBVH..." << std::endl;
+
+	// Cut the sorted list into leaf runs. A run is closed if it is full or if
+	// the next code differs in a higher bit than all codes in the run so far.
+	std::vector<uint32> runStart;
+	runStart.push_back(0);
+	int runPrefix = 64;
+	for( uint32 i = 1; i < n; ++i )
+	{
+		uint32 runSize = i - runStart.back();
+		int prefix = clz64(codes[i] ^ codes[i-1]);
+		if( runSize == FileDecl::Leaf::NUM_PRIMITIVES
+			|| (runSize >= MIN_LEAF_FILL && prefix < runPrefix) )
+		{
+			runStart.push_back(i);
+			runPrefix = 64;
+		} else runPrefix = min(runPrefix, prefix);
+	}
+	uint32 numLeaves = (uint32)runStart.size();
+	runStart.push_back(n);
+
+	// Nodes [0, numLeaves-1) are the inner nodes of the radix tree, the
+	// following numLeaves nodes point to the leaves.
+	uint32 numInner = numLeaves - 1;
+	for( uint32 i = 0; i < numInner + numLeaves; ++i )
+		m_manager->GetNewNode();
+	for( uint32 i = 0; i < numLeaves; ++i )
+		m_manager->GetNewLeaf();
+	std::vector<uint32> parents(numInner + numLeaves, 0xffffffff);
+
+	// Length of the common prefix of two runs' keys. Equal keys are
+	// distinguished by their index.
+	auto delta = [&](uint32 _i, int64 _j) -> int {
+		if( _j < 0 || _j >= (int64)numLeaves ) return -1;
+		uint64 x = codes[runStart[_i]] ^ codes[runStart[uint32(_j)]];
+		if( x ) return clz64(x);
+		return 32 + clz64(uint64(_i ^ uint32(_j)));
+	};
+
+	// Emit the radix tree (each inner node independently)
+	ParallelFor(numInner, [&](uint32 i) {
+		// Direction of the range
+		int d = delta(i, int64(i) + 1) > delta(i, int64(i) - 1) ? 1 : -1;
+		// Upper bound for the length of the range
+		int δmin = delta(i, int64(i) - d);
+		int64 lmax = 2;
+		while( delta(i, int64(i) + lmax * d) > δmin ) lmax *= 2;
+		// Find the other end with binary search
+		int64 l = 0;
+		for( int64 t = lmax / 2; t >= 1; t /= 2 )
+			if( delta(i, int64(i) + (l + t) * d) > δmin ) l += t;
+		int64 j = int64(i) + l * d;
+		// Find the split position with binary search
+		int δnode = delta(i, j);
+		int64 s = 0;
+		int64 t = l;
+		do {
+			t = (t + 1) / 2;
+			if( delta(i, int64(i) + (s + t) * d) > δnode ) s += t;
+		} while( t > 1 );
+		uint32 γ = uint32(int64(i) + s * d + min(d, 0));
+
+		BVHBuilder::Node& node = m_manager->GetNode(i);
+		node.left = min(int64(i), j) == γ ? numInner + γ : γ;
+		node.right = max(int64(i), j) == γ + 1 ? numInner + γ + 1 : γ + 1;
+		parents[node.left] = i;
+		parents[node.right] = i;
+	});
+
+	// Fill the leaves and compute bounding volumes bottom up. The second
+	// thread which arrives at an inner node computes its volume.
+	auto fit = m_manager->GetFitMethod();
+	std::unique_ptr<std::atomic<uint32>[]> visits(new std::atomic<uint32>[numInner + 1]);
+	for( uint32 i = 0; i < numInner; ++i ) visits[i] = 0;
+	ParallelFor(numLeaves, [&](uint32 k) {
+		uint32 nodeIdx = numInner + k;
+		FileDecl::Leaf& leaf = m_manager->GetLeaf( k );
+		FileDecl::Triangle* trianglesPtr = leaf.triangles;
+		for( uint32 i = runStart[k]; i < runStart[k+1]; ++i )
+			*(trianglesPtr++) = m_manager->GetTriangleIdx( sorted[i] );
+		for( uint32 i = runStart[k+1] - runStart[k]; i < FileDecl::Leaf::NUM_PRIMITIVES; ++i )
+			*(trianglesPtr++) = FileDecl::INVALID_TRIANGLE;
+		BVHBuilder::Node& node = m_manager->GetNode( nodeIdx );
+		node.left = 0x80000000 | k;
+		node.right = 0;
+		(*fit)( leaf.triangles, runStart[k+1] - runStart[k], nodeIdx );
+
+		uint32 parent = parents[nodeIdx];
+		while( parent != 0xffffffff && visits[parent]++ == 1 )
+		{
+			(*fit)( m_manager->GetNode(parent).left, m_manager->GetNode(parent).right, parent );
+			parent = parents[parent];
+		}
+	});
+
+	// The root is node 0, a single leaf node included.
+	return m_manager->SortNodesPreorder( 0 );
+}
+
+int BuildLBVH::ComputeSortedMortonCodes( const BVHBuilder* _manager, std::vector<uint64>& _codes, std::vector<uint32>& _sorted )
+{
+	uint32 n = _manager->GetTriangleCount();
+	_codes.resize(n);
+	_sorted.resize(n);
+
+	// Bounding box of all centers
+	std::vector<Vec3> centers(n);
+	std::vector<Box> threadBounds(GetNumThreads(), Box(Vec3(std::numeric_limits<float>::infinity()), Vec3(-std::numeric_limits<float>::infinity())));
+	ParallelRange(n, [&](uint32 _thread, uint32 _begin, uint32 _end) {
+		for( uint32 i = _begin; i < _end; ++i )
+		{
+			Triangle t = _manager->GetTriangle( i );
+			centers[i] = (t.v0 + t.v1 + t.v2) / 3.0f;
+			threadBounds[_thread].min = min(threadBounds[_thread].min, centers[i]);
+			threadBounds[_thread].max = max(threadBounds[_thread].max, centers[i]);
+		}
+	});
+	Box bounds = threadBounds[0];
+	for( auto& box : threadBounds )
+		bounds = Box(bounds, box);
+
+	// Large scenes need more bits to keep the number of equal codes small.
+	int bits = n < (1u << 20) ? 30 : 63;
+	float gridSize = bits == 30 ? 1023.0f : 2097151.0f;
+	Vec3 scale = bounds.max - bounds.min;
+	for( int d = 0; d < 3; ++d )
+		scale[d] = scale[d] > 0.0f ? gridSize / scale[d] : 0.0f;
+	ParallelFor(n, [&](uint32 i) {
+		Vec3 q = centers[i] - bounds.min;
+		uint32 x = uint32(q.x * scale.x), y = uint32(q.y * scale.y), z = uint32(q.z * scale.z);
+		_codes[i] = bits == 30 ? morton30(x, y, z) : morton63(x, y, z);
+		_sorted[i] = i;
+	});
+
+	RadixSort( _codes, _sorted, bits );
+	return bits;
+}
+
+void BuildLBVH::RadixSort( std::vector<uint64>& _keys, std::vector<uint32>& _values, int _bits )
+{
+	const int DIGIT_BITS = 8;
+	const uint32 NUM_BUCKETS = 1 << DIGIT_BITS;
+	uint32 n = (uint32)_keys.size();
+	uint32 numThreads = GetNumThreads();
+	std::vector<uint64> tmpKeys(n);
+	std::vector<uint32> tmpValues(n);
+	std::vector<uint32> histograms(numThreads * NUM_BUCKETS);
+
+	for( int shift = 0; shift < _bits; shift += DIGIT_BITS )
+	{
+		// Count digits per thread block
+		std::fill(histograms.begin(), histograms.end(), 0);
+		ParallelRange(n, [&](uint32 _thread, uint32 _begin, uint32 _end) {
+			uint32* histogram = &histograms[_thread * NUM_BUCKETS];
+			for( uint32 i = _begin; i < _end; ++i )
+				++histogram[(_keys[i] >> shift) & (NUM_BUCKETS - 1)];
+		});
+		// Exclusive prefix sum ordered by digit and then by thread which makes
+		// the sort stable.
+		uint32 offset = 0;
+		for( uint32 b = 0; b < NUM_BUCKETS; ++b )
+			for( uint32 t = 0; t < numThreads; ++t )
+			{
+				uint32 count = histograms[t * NUM_BUCKETS + b];
+				histograms[t * NUM_BUCKETS + b] = offset;
+				offset += count;
+			}
+		// Scatter (the block partition is the same as during counting)
+		ParallelRange(n, [&](uint32 _thread, uint32 _begin, uint32 _end) {
+			uint32* histogram = &histograms[_thread * NUM_BUCKETS];
+			for( uint32 i = _begin; i < _end; ++i )
+			{
+				uint32 target = histogram[(_keys[i] >> shift) & (NUM_BUCKETS - 1)]++;
+				tmpKeys[target] = _keys[i];
+				tmpValues[target] = _values[i];
+			}
+		});
+		std::swap(_keys, tmpKeys);
+		std::swap(_values, tmpValues);
+	}
+}
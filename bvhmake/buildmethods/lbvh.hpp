@@ -0,0 +1,27 @@
+﻿#pragma once
+
+#include "../bvhmake.hpp"
+
+/// \brief Linear BVH build (Karras 2012) for fast previews.
+/// \details Triangle centers are sorted by their Morton code with a parallel
+///		radix sort. Runs of up to NUM_PRIMITIVES sorted triangles form the
+///		leaves and a binary radix tree over these runs is emitted in parallel.
+///		The quality is lower than that of the SAH based builders.
+class BuildLBVH: public BuildMethod
+{
+public:
+	BuildLBVH(BVHBuilder* _manager) : BuildMethod(_manager) {}
+
+    virtual uint32 operator()() const override;
+
+	/// \brief Stable parallel LSD radix sort of key-value pairs.
+	/// \param [in] _bits Number of relevant (lower) bits of the keys.
+	static void RadixSort( std::vector<uint64>& _keys, std::vector<uint32>& _values, int _bits );
+
+	/// \brief Compute Morton codes of the triangle centers and sort the
+	///		triangle indices accordingly.
+	/// \param [out] _codes Sorted Morton codes.
+	/// \param [out] _sorted Triangle indices in Morton order.
+	/// \returns Number of bits used for the codes (30 or 63).
+	static int ComputeSortedMortonCodes( const BVHBuilder* _manager, std::vector<uint64>& _codes, std::vector<uint32>& _sorted );
+};
@@ -1,5 +1,6 @@
 ﻿#include "lds.hpp"
 #include "sweep.hpp"
+#include "../fitmethods/staticfit.hpp"
 #include "../../gpugi/utilities/assert.hpp"
 #include <iostream>
 #include <vector>
@@ -23,18 +24,19 @@ uint32 BuildLDS::operator()() const
 		centersproj[i].pos = (t.v0 + t.v1 + t.v2) / 3.0f;
 	}
 
-	return Build(ids.get(), centersproj.get(), 0, n-1);
-}
-
-void BuildLDS::EstimateNodeCounts( uint32& _numInnerNodes, uint32& _numLeafNodes ) const 
-{
-	// Use the same threshold as the sweep algorithm (which is one of two possible options)
-    _numInnerNodes = 4 * m_manager->GetTriangleCount() / FileDecl::Leaf::NUM_PRIMITIVES;
-    _numLeafNodes = 2 * m_manager->GetTriangleCount() / FileDecl::Leaf::NUM_PRIMITIVES;
+	switch( m_manager->GetFitMethod()->Type() )
+	{
+	case FitMethod::BVType::AABOX: return Build<Box>(ids.get(), centersproj.get(), 0, n-1);
+	case FitMethod::BVType::SPHERE: return Build<Sphere>(ids.get(), centersproj.get(), 0, n-1);
+	case FitMethod::BVType::AAELLIPSOID: return Build<Ellipsoid>(ids.get(), centersproj.get(), 0, n-1);
+	case FitMethod::BVType::OBOX: return Build<OBox>(ids.get(), centersproj.get(), 0, n-1);
+	default: Assert( false, "Fit method not supported by the LDS builder!" ); return 0;
+	}
 }
 
 static int DEB = 0;
 
+template<typename BV>
 uint32 BuildLDS::Build( uint32* _ids, ProjCoordinate* _centers, uint32 _min, uint32 _max ) const
 {
 	auto fit = m_manager->GetFitMethod();
@@ -118,75 +120,55 @@ uint32 BuildLDS::Build( uint32* _ids, ProjCoordinate* _centers, uint32 _min, uin
 
 #ifdef LDS_SPLITMODE_SWEEP
 	// 2. Sweep
-	ComputeBoundingVolume(_ids, _min, _max, nodeIdx, *fit);
-/*	Vec3 bbsize = bbox.max - bbox.min;
-	// Fake sorting along straight dimensions
-	int d = 0;
-	if( bbsize.y > bbsize.z && bbsize.y > bbsize.x ) d = 1;
-	else if(bbsize.z > bbsize.x) d = 2;
-	std::sort( _ids + _min, _ids + _max + 1,
-		[&](const uint32 _lhs, const uint32 _rhs) { return _centers[_lhs].pos[d] < _centers[_rhs].pos[d]; }
-	);*/
-	// Reserve some nodes for temporary work Assume the last indices to be unused
-	uint32 tmpIdx0 = 4 * m_manager->GetTriangleCount() / FileDecl::Leaf::NUM_PRIMITIVES - 1;
-	uint32 tmpIdx1 = tmpIdx0 - 1;
-	uint32 tmpIdx2 = tmpIdx0 - 2;
 	// Compute lhs/rhs bounding volumes for all splits. This is done from left
-	// and right adding one triangle at a time.
-	// Uses the current node's BV memory and three additional.
-	std::unique_ptr<Vec2[]> heuristics(new Vec2[_max - _min]);
-	FileDecl::Triangle t = m_manager->GetTriangleIdx( _ids[_min] );
-	(*fit)(&t, 1, tmpIdx0);
-	t = m_manager->GetTriangleIdx( _ids[_max] );
-	(*fit)(&t, 1, tmpIdx1);
-	for(uint32 i = _min; i < _max; ++i)
+	// and right adding one triangle at a time. The full prefix is the
+	// current node's bounding volume if merging is exact. The scratch memory
+	// is released before the recursion.
 	{
-		// Left
-		t = m_manager->GetTriangleIdx( _ids[i] );
-		(*fit)(&t, 1, tmpIdx2);
-		(*fit)(tmpIdx0, tmpIdx2, tmpIdx0);
-		// Again for the right side
-		t = m_manager->GetTriangleIdx( _ids[_max-i+_min] );
-		(*fit)(&t, 1, tmpIdx2);
-		(*fit)(tmpIdx1, tmpIdx2, tmpIdx1);
-		// The volumes are rejected in the next iteration but remember
-		// the result for the split decision.
-		heuristics[i-_min].x   = SurfaceAreaHeuristic( *fit, tmpIdx0, nodeIdx, i-_min+1, _max-i );
-		heuristics[_max-i-1].y = SurfaceAreaHeuristic( *fit, tmpIdx1, nodeIdx, i-_min+1, _max-i );
-	}
+		ScratchArena::Scope scratch;
+		uint32 num = _max - _min + 1;
+		BV* prefix = scratch.Allocate<BV>( num );
+		BV* suffix = scratch.Allocate<BV>( num );
+		SweepBounds<BV>( m_manager, _ids + _min, num, prefix, suffix );
+		m_manager->GetBoundingVolume<BV>( nodeIdx ) = StaticFit<BV>::EXACT_MERGE ? prefix[num-1]
+			: FitRange<BV>( m_manager, _ids + _min, num );
+/*		Vec3 bbsize = bbox.max - bbox.min;
+		// Fake sorting along straight dimensions
+		int d = 0;
+		if( bbsize.y > bbsize.z && bbsize.y > bbsize.x ) d = 1;
+		else if(bbsize.z > bbsize.x) d = 2;
+		std::sort( _ids + _min, _ids + _max + 1,
+			[&](const uint32 _lhs, const uint32 _rhs) { return _centers[_lhs].pos[d] < _centers[_rhs].pos[d]; }
+		);*/
+		float parentSurface = StaticFit<BV>::Surface( prefix[num-1] );
+		Vec2* heuristics = scratch.Allocate<Vec2>( num - 1 );
+		for(uint32 i = 0; i < num - 1; ++i)
+		{
+			heuristics[i].x = SurfaceAreaHeuristic( StaticFit<BV>::Surface(prefix[i]), parentSurface, i+1, num-1-i );
+			heuristics[i].y = SurfaceAreaHeuristic( StaticFit<BV>::Surface(suffix[i+1]), parentSurface, num-1-i, i+1 );
+		}
 
-	// Find the minimum for the current dimension
-	float minCost = std::numeric_limits<float>::infinity();
-	for(uint32 i = 0; i < (_max-_min); ++i)
-	{
-		if(sum(heuristics[i]) < minCost)
+		// Find the minimum for the current dimension
+		float minCost = std::numeric_limits<float>::infinity();
+		for(uint32 i = 0; i < (_max-_min); ++i)
 		{
-			minCost = sum(heuristics[i]);
-			splitIndex = i + _min;
+			if(sum(heuristics[i]) < minCost)
+			{
+				minCost = sum(heuristics[i]);
+				splitIndex = i + _min;
+			}
 		}
 	}
 #endif
 
-	node.left = Build( _ids, _centers, _min, splitIndex );
-	node.right = Build( _ids, _centers, splitIndex+1, _max );
+	node.left = Build<BV>( _ids, _centers, _min, splitIndex );
+	node.right = Build<BV>( _ids, _centers, splitIndex+1, _max );
 
 #ifdef LDS_SPLITMODE_MEDIAN
-	(*fit)( node.left, node.right, nodeIdx );
+	m_manager->GetBoundingVolume<BV>( nodeIdx ) = StaticFit<BV>::Merge(
+		m_manager->GetBoundingVolume<BV>( node.left ),
+		m_manager->GetBoundingVolume<BV>( node.right ) );
 #endif
 
 	return nodeIdx;
-}
-
-void BuildLDS::ComputeBoundingVolume( const uint32* _ids, uint32 _min, uint32 _max, uint32 _target, const FitMethod& _fit ) const
-{
-	FileDecl::Triangle t = m_manager->GetTriangleIdx( _ids[_max] );
-	_fit(&t, 1, _target);
-	// Assume the last index to be unused
-	uint32 tmpIdx = 4 * m_manager->GetTriangleCount() / FileDecl::Leaf::NUM_PRIMITIVES - 1;
-	for(uint32 i = _min; i < _max; ++i)
-	{
-		t = m_manager->GetTriangleIdx( _ids[i] );
-		_fit(&t, 1, tmpIdx);
-		_fit(_target, tmpIdx, _target);
-	}
 }
\ No newline at end of file
@@ -13,8 +13,6 @@ public:
 
     virtual uint32 operator()() const override;
 
-    virtual void EstimateNodeCounts( uint32& _numInnerNodes, uint32& _numLeafNodes ) const override;
-
 private:
 	// Helper coordinate which can additionally store a projection along an arbitrary direction
 	struct ProjCoordinate
@@ -24,7 +22,7 @@ private:
 	};
 
     /// \brief Create new tree-nodes recursively.
+    /// \tparam BV Bounding volume type of the fit method (see StaticFit).
+    template<typename BV>
     uint32 Build( uint32* _ids, ProjCoordinate* _centers, uint32 _min, uint32 _max ) const;
-
-	void ComputeBoundingVolume( const uint32* _ids, uint32 _min, uint32 _max, uint32 _target, const FitMethod& _fit ) const;
 };
\ No newline at end of file
@@ -0,0 +1,359 @@
+﻿#include "sbvh.hpp"
+#include "binnedsah.hpp"
+#include "../parallel.hpp"
+#include "../../gpugi/utilities/assert.hpp"
+#include <iostream>
+#include <vector>
+#include <future>
+
+using namespace ε;
+
+const uint32 NUM_SPATIAL_BINS = 32;
+// Maximum number of additional references relative to the triangle count.
+const float DUPLICATE_BUDGET = 0.3f;
+// Spatial splits are tried if the children of the object split overlap by
+// more than this fraction of the root's surface.
+const float MIN_OVERLAP = 1e-5f;
+// Both sides of a split get at least this many references. Together with the
+// duplicate budget this bounds the number of leaves.
+const uint32 MIN_LEAF_FILL = FileDecl::Leaf::NUM_PRIMITIVES / 2;
+const uint32 PARALLEL_BUILD_THRESHOLD = 4096;
+const uint32 PARALLEL_BINNING_THRESHOLD = 1 << 16;
+
+static const Box EMPTY_BOX( Vec3(std::numeric_limits<float>::infinity()), Vec3(-std::numeric_limits<float>::infinity()) );
+
+// Same cost model as BuildBinnedSAH: number of leaf blocks to be tested.
+static float LeafBlocks( uint32 _num )
+{
+	return float((_num + FileDecl::Leaf::NUM_PRIMITIVES - 1) / FileDecl::Leaf::NUM_PRIMITIVES);
+}
+
+static bool IsEmpty( const Box& _box )
+{
+	return _box.min.x > _box.max.x || _box.min.y > _box.max.y || _box.min.z > _box.max.z;
+}
+
+struct SpatialBin
+{
+	Box bounds;
+	uint32 entries;		///< Number of references starting in this bin
+	uint32 exits;		///< Number of references ending in this bin
+};
+
+struct SpatialBinSet
+{
+	SpatialBin bins[3][NUM_SPATIAL_BINS];
+};
+
+uint32 BuildSBVH::operator()() const
+{
+    std::cerr << "  Computing triangle bounds for SBVH..." << std::endl;
+
+	uint32 n = m_manager->GetTriangleCount();
+	std::vector<Reference> references(n);
+	std::vector<Box> threadBounds(GetNumThreads(), EMPTY_BOX);
+	ParallelRange(n, [&](uint32 _thread, uint32 _begin, uint32 _end) {
+		for( uint32 i = _begin; i < _end; ++i )
+		{
+			references[i].bounds = Box( m_manager->GetTriangle( i ) );
+			references[i].triangle = i;
+			threadBounds[_thread] = Box(threadBounds[_thread], references[i].bounds);
+		}
+	});
+	Box bounds = EMPTY_BOX;
+	for( auto& box : threadBounds )
+		bounds = Box(bounds, box);
+
+	BuildState state;
+	state.duplicates = int(n * DUPLICATE_BUDGET);
+	state.minOverlap = surface(bounds) * MIN_OVERLAP;
+
+	int parallelDepth = 2;
+	for( uint32 t = GetNumThreads(); t > 1; t >>= 1 ) ++parallelDepth;
+
+    std::cerr << "  Building tree via SBVH on " << GetNumThreads() << " threads..." << std::endl;
+
+	uint32 root = Build(references, bounds, state, parallelDepth);
+	std::cerr << "  Created " << (int(n * DUPLICATE_BUDGET) - state.duplicates) << " additional triangle references." << std::endl;
+	return m_manager->SortNodesPreorder( root );
+}
+
+uint32 BuildSBVH::Build( std::vector<Reference>& _references, const Box& _bounds, BuildState& _state, int _parallelDepth ) const
+{
+	auto fit = m_manager->GetFitMethod();
+
+	uint32 nodeIdx = m_manager->GetNewNode();
+	BVHBuilder::Node& node = m_manager->GetNode( nodeIdx );
+
+	uint32 num = (uint32)_references.size();
+	Assert(num > 0, "Node without triangles!");
+	if( num <= FileDecl::Leaf::NUM_PRIMITIVES )
+	{
+		// Allocate a new leaf
+		uint32 leafIdx = m_manager->GetNewLeaf();
+		FileDecl::Leaf& leaf = m_manager->GetLeaf( leafIdx );
+		// Fill it
+		FileDecl::Triangle* trianglesPtr = leaf.triangles;
+		for( auto& ref : _references )
+			*(trianglesPtr++) = m_manager->GetTriangleIdx( ref.triangle );
+		for( uint i = num; i < FileDecl::Leaf::NUM_PRIMITIVES; ++i )
+			*(trianglesPtr++) = FileDecl::INVALID_TRIANGLE;
+
+		// Let new inner node pointing to this leaf
+		node.left = 0x80000000 | leafIdx;
+		node.right = 0;
+
+		// Compute a bounding volume for the new node. Boxes only need to
+		// contain the parts of the triangles within this node.
+		(*fit)( leaf.triangles, num, nodeIdx );
+		if( fit->Type() == FitMethod::BVType::AABOX )
+		{
+			Box& box = m_manager->GetBoundingVolume<Box>( nodeIdx );
+			box.min = max(box.min, _bounds.min);
+			box.max = min(box.max, _bounds.max);
+		}
+
+		return nodeIdx;
+	}
+
+	// Find the best object split. The scratch memory is released before the
+	// recursion.
+	std::vector<Reference> left, right;
+	Box leftBounds = EMPTY_BOX, rightBounds = EMPTY_BOX;
+	{
+		ScratchArena::Scope scratch;
+		BuildBinnedSAH::Primitive* primitives = scratch.Allocate<BuildBinnedSAH::Primitive>( num );
+		uint32* ids = scratch.Allocate<uint32>( num );
+		for( uint32 i = 0; i < num; ++i )
+		{
+			primitives[i].bounds = _references[i].bounds;
+			primitives[i].center = (_references[i].bounds.min + _references[i].bounds.max) * 0.5f;
+			ids[i] = i;
+		}
+		uint32 splitIndex = BuildBinnedSAH::Split( ids, primitives, 0, num - 1 );
+		for( uint32 i = 0; i < num; ++i )
+			if( i <= splitIndex ) leftBounds = Box(leftBounds, primitives[ids[i]].bounds);
+			else rightBounds = Box(rightBounds, primitives[ids[i]].bounds);
+		float objectCost = surface(leftBounds) * LeafBlocks(splitIndex + 1) + surface(rightBounds) * LeafBlocks(num - splitIndex - 1);
+
+		// Try a spatial split if the children overlap
+		Box overlap( max(leftBounds.min, rightBounds.min), min(leftBounds.max, rightBounds.max) );
+		bool spatial = !IsEmpty(overlap) && surface(overlap) > _state.minOverlap
+			&& SpatialSplit( _references, _bounds, objectCost, _state, left, right );
+		if( spatial )
+		{
+			leftBounds = rightBounds = EMPTY_BOX;
+			for( auto& ref : left ) leftBounds = Box(leftBounds, ref.bounds);
+			for( auto& ref : right ) rightBounds = Box(rightBounds, ref.bounds);
+		} else {
+			left.resize( splitIndex + 1 );
+			right.resize( num - splitIndex - 1 );
+			for( uint32 i = 0; i < num; ++i )
+				if( i <= splitIndex ) left[i] = _references[ids[i]];
+				else right[i - splitIndex - 1] = _references[ids[i]];
+		}
+	}
+	// Free the memory before going deeper
+	std::vector<Reference>().swap(_references);
+
+	if( _parallelDepth > 0 && num >= PARALLEL_BUILD_THRESHOLD )
+	{
+		// Build the left subtree in a new task and the right one in this.
+		auto leftTask = std::async( std::launch::async, [&]() {
+			return Build( left, leftBounds, _state, _parallelDepth - 1 );
+		} );
+		node.right = Build( right, rightBounds, _state, _parallelDepth - 1 );
+		node.left = leftTask.get();
+	} else {
+		node.left = Build( left, leftBounds, _state, 0 );
+		node.right = Build( right, rightBounds, _state, 0 );
+	}
+
+	(*fit)( node.left, node.right, nodeIdx );
+
+	return nodeIdx;
+}
+
+bool BuildSBVH::SpatialSplit( const std::vector<Reference>& _references, const Box& _bounds, float _maxCost,
+	BuildState& _state, std::vector<Reference>& _left, std::vector<Reference>& _right ) const
+{
+	uint32 num = (uint32)_references.size();
+	Vec3 extent = _bounds.max - _bounds.min;
+	auto binIndex = [&](int _dim, float _x) {
+		return min(NUM_SPATIAL_BINS - 1, uint32(max(0.0f, (_x - _bounds.min[_dim]) * NUM_SPATIAL_BINS / extent[_dim])));
+	};
+	// Plane between bin _bin and _bin+1
+	auto planePosition = [&](int _dim, uint32 _bin) {
+		return _bounds.min[_dim] + (_bin + 1) * extent[_dim] / NUM_SPATIAL_BINS;
+	};
+
+	// Chop all references into the bins they overlap
+	auto binRange = [&](uint32 _begin, uint32 _end, SpatialBinSet& _set) {
+		auto& _bins = _set.bins;
+		for( int d = 0; d < 3; ++d )
+			for( uint32 b = 0; b < NUM_SPATIAL_BINS; ++b )
+			{
+				_bins[d][b].bounds = EMPTY_BOX;
+				_bins[d][b].entries = _bins[d][b].exits = 0;
+			}
+		for( uint32 i = _begin; i < _end; ++i )
+		{
+			const Reference& ref = _references[i];
+			Triangle triangle = m_manager->GetTriangle( ref.triangle );
+			for( int d = 0; d < 3; ++d )
+			{
+				if( extent[d] <= 0.0f ) continue;
+				uint32 first = binIndex(d, ref.bounds.min[d]);
+				uint32 last = binIndex(d, ref.bounds.max[d]);
+				Reference rest = ref;
+				for( uint32 b = first; b < last; ++b )
+				{
+					Reference part;
+					SplitReference( rest, triangle, d, planePosition(d, b), part, rest );
+					_bins[d][b].bounds = Box(_bins[d][b].bounds, part.bounds);
+				}
+				_bins[d][last].bounds = Box(_bins[d][last].bounds, rest.bounds);
+				++_bins[d][first].entries;
+				++_bins[d][last].exits;
+			}
+		}
+	};
+	SpatialBinSet binSet;
+	auto& bins = binSet.bins;
+	if( num >= PARALLEL_BINNING_THRESHOLD )
+	{
+		std::vector<SpatialBinSet> threadBins(GetNumThreads());
+		ParallelRange(num, [&](uint32 _thread, uint32 _begin, uint32 _end) {
+			binRange(_begin, _end, threadBins[_thread]);
+		}, 64);
+		for( int d = 0; d < 3; ++d )
+			for( uint32 b = 0; b < NUM_SPATIAL_BINS; ++b )
+			{
+				bins[d][b].bounds = EMPTY_BOX;
+				bins[d][b].entries = bins[d][b].exits = 0;
+				for( auto& tb : threadBins )
+				{
+					bins[d][b].bounds = Box(bins[d][b].bounds, tb.bins[d][b].bounds);
+					bins[d][b].entries += tb.bins[d][b].entries;
+					bins[d][b].exits += tb.bins[d][b].exits;
+				}
+			}
+	} else binRange(0, num, binSet);
+
+	// Sweep over the planes between the bins
+	float minCost = _maxCost;
+	int splitDim = -1;
+	uint32 splitBin = 0;
+	Box splitLeftBounds, splitRightBounds;
+	uint32 splitLeftCount = 0, splitRightCount = 0;
+	for( int d = 0; d < 3; ++d )
+	{
+		if( extent[d] <= 0.0f ) continue;
+		Box rightBounds[NUM_SPATIAL_BINS];
+		uint32 rightCount[NUM_SPATIAL_BINS];
+		Box box = EMPTY_BOX;
+		uint32 count = 0;
+		for( uint32 b = NUM_SPATIAL_BINS - 1; b > 0; --b )
+		{
+			box = Box(box, bins[d][b].bounds);
+			count += bins[d][b].exits;
+			rightBounds[b-1] = box;
+			rightCount[b-1] = count;
+		}
+		box = EMPTY_BOX;
+		count = 0;
+		for( uint32 b = 0; b < NUM_SPATIAL_BINS - 1; ++b )
+		{
+			box = Box(box, bins[d][b].bounds);
+			count += bins[d][b].entries;
+			if( count < MIN_LEAF_FILL || rightCount[b] < MIN_LEAF_FILL
+				|| count >= num || rightCount[b] >= num )
+				continue;
+			float cost = surface(box) * LeafBlocks(count) + surface(rightBounds[b]) * LeafBlocks(rightCount[b]);
+			if( cost < minCost )
+			{
+				minCost = cost;
+				splitDim = d;
+				splitBin = b;
+				splitLeftBounds = box;
+				splitRightBounds = rightBounds[b];
+				splitLeftCount = count;
+				splitRightCount = rightCount[b];
+			}
+		}
+	}
+	if( splitDim < 0 )
+		return false;
+
+	// Partition the references. Straddling references are split unless
+	// moving them to one side completely is cheaper (reference unsplitting).
+	float position = planePosition(splitDim, splitBin);
+	_left.clear();
+	_right.clear();
+	for( auto& ref : _references )
+	{
+		if( ref.bounds.max[splitDim] <= position )
+			_left.push_back( ref );
+		else if( ref.bounds.min[splitDim] >= position )
+			_right.push_back( ref );
+		else {
+			float splitCost = surface(splitLeftBounds) * LeafBlocks(splitLeftCount) + surface(splitRightBounds) * LeafBlocks(splitRightCount);
+			float leftCost = surface(Box(splitLeftBounds, ref.bounds)) * LeafBlocks(splitLeftCount) + surface(splitRightBounds) * LeafBlocks(splitRightCount - 1);
+			float rightCost = surface(splitLeftBounds) * LeafBlocks(splitLeftCount - 1) + surface(Box(splitRightBounds, ref.bounds)) * LeafBlocks(splitRightCount);
+			Reference leftPart, rightPart;
+			SplitReference( ref, m_manager->GetTriangle( ref.triangle ), splitDim, position, leftPart, rightPart );
+			if( IsEmpty(rightPart.bounds) || (leftCost <= splitCost && leftCost <= rightCost) )
+				_left.push_back( ref );
+			else if( IsEmpty(leftPart.bounds) || rightCost <= splitCost )
+				_right.push_back( ref );
+			else {
+				_left.push_back( leftPart );
+				_right.push_back( rightPart );
+			}
+		}
+	}
+
+	uint32 numLeft = (uint32)_left.size();
+	uint32 numRight = (uint32)_right.size();
+	if( numLeft < MIN_LEAF_FILL || numRight < MIN_LEAF_FILL || numLeft >= num || numRight >= num )
+		return false;
+
+	// Take the new references from the budget
+	int duplicates = int(numLeft + numRight - num);
+	if( _state.duplicates.fetch_sub(duplicates) < duplicates )
+	{
+		_state.duplicates += duplicates;
+		return false;
+	}
+	return true;
+}
+
+void BuildSBVH::SplitReference( const Reference& _reference, const Triangle& _triangle, int _dim, float _position, Reference& _left, Reference& _right )
+{
+	_left.triangle = _right.triangle = _reference.triangle;
+	_left.bounds = _right.bounds = EMPTY_BOX;
+
+	// Clip the triangle edges at the plane
+	const Vec3* v[3] = { &_triangle.v0, &_triangle.v1, &_triangle.v2 };
+	for( int i = 0; i < 3; ++i )
+	{
+		const Vec3& a = *v[i];
+		const Vec3& b = *v[(i + 1) % 3];
+		if( a[_dim] <= _position ) { _left.bounds.min = min(_left.bounds.min, a); _left.bounds.max = max(_left.bounds.max, a); }
+		if( a[_dim] >= _position ) { _right.bounds.min = min(_right.bounds.min, a); _right.bounds.max = max(_right.bounds.max, a); }
+		if( (a[_dim] < _position && b[_dim] > _position) || (a[_dim] > _position && b[_dim] < _position) )
+		{
+			float t = (_position - a[_dim]) / (b[_dim] - a[_dim]);
+			Vec3 p = a + (b - a) * t;
+			p[_dim] = _position;
+			_left.bounds.min = min(_left.bounds.min, p); _left.bounds.max = max(_left.bounds.max, p);
+			_right.bounds.min = min(_right.bounds.min, p); _right.bounds.max = max(_right.bounds.max, p);
+		}
+	}
+
+	// The reference could have been clipped before
+	_left.bounds.min = max(_left.bounds.min, _reference.bounds.min);
+	_left.bounds.max = min(_left.bounds.max, _reference.bounds.max);
+	_right.bounds.min = max(_right.bounds.min, _reference.bounds.min);
+	_right.bounds.max = min(_right.bounds.max, _reference.bounds.max);
+}
@@ -0,0 +1,56 @@
+﻿#pragma once
+
+#include "../bvhmake.hpp"
+#include <atomic>
+
+/// \brief Spatial split BVH (Stich et al. 2009).
+/// \details In addition to the binned SAH object splits, splits of the node
+///		space are considered if the children of the object split overlap.
+///		Triangles crossing a spatial split plane are referenced in both
+///		children (only the leaf index buffers grow, not the vertex or triangle
+///		arrays). The number of additional references is limited to
+///		DUPLICATE_BUDGET times the triangle count.
+///		For axis aligned boxes the leaf volumes are clipped to the parts of the
+///		triangles within the node.
+class BuildSBVH: public BuildMethod
+{
+public:
+	BuildSBVH(BVHBuilder* _manager) : BuildMethod(_manager) {}
+
+    virtual uint32 operator()() const override;
+
+	/// \brief A (possibly clipped) reference to a triangle.
+	struct Reference
+	{
+		ε::Box bounds;		///< Bounds of the part of the triangle within the node
+		uint32 triangle;	///< Index of the triangle
+	};
+
+private:
+	/// \brief Shared state of all build tasks.
+	struct BuildState
+	{
+		std::atomic<int> duplicates;	///< Number of additional references which may still be created by spatial splits
+		float minOverlap;				///< Spatial splits are only tried if the object split children overlap by more than this area
+	};
+
+    /// \brief Create new tree-nodes recursively.
+	/// \param [in] _references All triangle parts within the new node.
+	/// \param [in] _bounds Union of all reference bounds.
+	/// \param [in] _parallelDepth Number of further recursion levels which
+	///		may spawn a new task.
+    uint32 Build( std::vector<Reference>& _references, const ε::Box& _bounds, BuildState& _state, int _parallelDepth ) const;
+
+	/// \brief Find the best spatial split and partition the references.
+	/// \param [in] _maxCost Only splits which are cheaper than this are done.
+	/// \returns false if no split was found or the duplicate budget was
+	///		exceeded. The output vectors are undefined in that case.
+	bool SpatialSplit( const std::vector<Reference>& _references, const ε::Box& _bounds, float _maxCost,
+		BuildState& _state, std::vector<Reference>& _left, std::vector<Reference>& _right ) const;
+
+	/// \brief Split a reference at an axis aligned plane.
+	/// \details The resulting bounds are those of the clipped triangle
+	///		intersected with the original reference bounds. One of them can be
+	///		empty (min > max).
+	static void SplitReference( const Reference& _reference, const ε::Triangle& _triangle, int _dim, float _position, Reference& _left, Reference& _right );
+};
@@ -1,4 +1,5 @@
 ﻿#include "sweep.hpp"
+#include "../fitmethods/staticfit.hpp"
 #include "../../gpugi/utilities/assert.hpp"
 #include <iostream>
 #include <vector>
@@ -11,14 +12,14 @@ using namespace ε;
 const float COST_UNDERFUL_LEAF = 0.01f;
 const float COST_UNBALANCED = 0.88f;
 const float COST_TRAVERSAL = 1.0f;
-float SurfaceAreaHeuristic( const FitMethod& _fit, uint32 _target, uint32 _parent, int _num, int _numOther )
+float SurfaceAreaHeuristic( float _surface, float _parentSurface, int _num, int _numOther )
 {
-	/*float val = _fit.Surface(_target) / _fit.Surface(_parent) * COST_TRAVERSAL
+	/*float val = _surface / _parentSurface * COST_TRAVERSAL
 		+ max(0, int(FileDecl::Leaf::NUM_PRIMITIVES) - _num) * COST_UNDERFUL_LEAF / FileDecl::Leaf::NUM_PRIMITIVES
 		+ pow(1.0f - min(_numOther / float(_num), _num / float(_numOther)), 8.0f) * COST_UNBALANCED;
 	//	+ (max(_numOther / float(_num), _num / float(_numOther)) - 1.0f) * COST_UNBALANCED; // with COST_UNBALANCED == 0.05
 	Assert( val >= 0.0f && val <= 3.0f, "Unexpected heuristic value." );*/
-	float val = _fit.Surface(_target) / _fit.Surface(_parent) * _num;
+	float val = _surface / _parentSurface * _num;
 	return val;
 }
 
@@ -37,13 +38,14 @@ uint32 BuildSweep::operator()() const
 
     std::cerr << "  Building tree via heuristic and sweep..." << std::endl;
 
-	return Build(sorted.get(), 0, n-1);
-}
-
-void BuildSweep::EstimateNodeCounts( uint32& _numInnerNodes, uint32& _numLeafNodes ) const 
-{
-    _numInnerNodes = 4 * m_manager->GetTriangleCount() / FileDecl::Leaf::NUM_PRIMITIVES;
-    _numLeafNodes = 2 * m_manager->GetTriangleCount() / FileDecl::Leaf::NUM_PRIMITIVES;
+	switch( m_manager->GetFitMethod()->Type() )
+	{
+	case FitMethod::BVType::AABOX: return Build<Box>(sorted.get(), 0, n-1);
+	case FitMethod::BVType::SPHERE: return Build<Sphere>(sorted.get(), 0, n-1);
+	case FitMethod::BVType::AAELLIPSOID: return Build<Ellipsoid>(sorted.get(), 0, n-1);
+	case FitMethod::BVType::OBOX: return Build<OBox>(sorted.get(), 0, n-1);
+	default: Assert( false, "Fit method not supported by the sweep builder!" ); return 0;
+	}
 }
 
 // Two sources to derive the z-order comparator
@@ -82,6 +84,27 @@ static uint64 morton(uint16 _a, uint16 _b, uint16 _c)
 {
 	return partby2(_a) | (partby2(_b) << 1) | (partby2(_c) << 2);
 }
+// Insert two 0 bits before each of the lower 21 bits.
+static uint64 partby2_21(uint32 _x)
+{
+	uint64 r = _x & 0x1fffff;
+	r = (r | (r << 32)) & 0x001f00000000ffff;
+	r = (r | (r << 16)) & 0x001f0000ff0000ff;
+	r = (r | (r <<  8)) & 0x100f00f00f00f00f;
+	r = (r | (r <<  4)) & 0x10c30c30c30c30c3;
+	r = (r | (r <<  2)) & 0x1249249249249249;
+	return r;
+}
+
+uint32 morton30(uint32 _a, uint32 _b, uint32 _c)
+{
+	return uint32(partby2(uint16(_a & 0x3ff)) | (partby2(uint16(_b & 0x3ff)) << 1) | (partby2(uint16(_c & 0x3ff)) << 2));
+}
+
+uint64 morton63(uint32 _a, uint32 _b, uint32 _c)
+{
+	return partby2_21(_a) | (partby2_21(_b) << 1) | (partby2_21(_c) << 2);
+}
 
 // Compare if the floor base-2 logarithm of _x0^_x1 is smaller than that of _y0^_y1.
 static bool lessMSB(float _x0, float _x1, float _y0, float _y1)
@@ -182,20 +205,19 @@ void BuildSweep::Initialize( uint32* _sorted ) const
 	);
 }
 
+template<typename BV>
 uint32 BuildSweep::Build( const uint32* _sorted, uint32 _min, uint32 _max ) const
 {
-	auto fit = m_manager->GetFitMethod();
-
 	uint32 nodeIdx = m_manager->GetNewNode();
 	BVHBuilder::Node& node = m_manager->GetNode( nodeIdx );
 
-	// Compute current bounding volume
-	ComputeBoundingVolume(_sorted, _min, _max, nodeIdx, *fit);
-
 	// Create a leaf if less than NUM_PRIMITIVES elements remain.
 	Assert(_min <= _max, "Node without triangles!");
 	if( _max - _min < FileDecl::Leaf::NUM_PRIMITIVES )
 	{
+		// Compute current bounding volume
+		m_manager->GetBoundingVolume<BV>( nodeIdx ) = FitRange<BV>( m_manager, _sorted + _min, _max - _min + 1 );
+
 		// Allocate a new leaf
 		uint32 leafIdx = m_manager->GetNewLeaf();
 		FileDecl::Leaf& leaf = m_manager->GetLeaf( leafIdx );
@@ -210,65 +232,44 @@ uint32 BuildSweep::Build( const uint32* _sorted, uint32 _min, uint32 _max ) cons
 		node.left = 0x80000000 | leafIdx;
 		node.right = 0;
 	} else {
-		// Assume the last indices to be unused
-		uint32 tmpIdx0 = 4 * m_manager->GetTriangleCount() / FileDecl::Leaf::NUM_PRIMITIVES - 1;
-		uint32 tmpIdx1 = tmpIdx0 - 1;
-		uint32 tmpIdx2 = tmpIdx0 - 2;
-		// Find a split index where the sum of heuristic terms left and right is minimized
-		std::unique_ptr<Vec2[]> heuristics(new Vec2[_max - _min]);
-		// Compute bounding volumes for all splits
-		// Use the current node's BV memory and one additional.
-		FileDecl::Triangle t = m_manager->GetTriangleIdx( _sorted[_min] );
-		(*fit)(&t, 1, tmpIdx0);
-		t = m_manager->GetTriangleIdx( _sorted[_max] );
-		(*fit)(&t, 1, tmpIdx1);
-		for(uint32 i = _min; i < _max; ++i)
-		{
-			// Left
-			t = m_manager->GetTriangleIdx( _sorted[i] );
-			(*fit)(&t, 1, tmpIdx2);
-			(*fit)(tmpIdx0, tmpIdx2, tmpIdx0);
-			// Again for the right side
-			t = m_manager->GetTriangleIdx( _sorted[_max-i+_min] );
-			(*fit)(&t, 1, tmpIdx2);
-			(*fit)(tmpIdx1, tmpIdx2, tmpIdx1);
-			// The volumes are rejected in the next iteration but remember
-			// the result for the split decision.
-			heuristics[i-_min].x   = SurfaceAreaHeuristic( *fit, tmpIdx0, nodeIdx, i-_min+1, _max-i );
-			heuristics[_max-i-1].y = SurfaceAreaHeuristic( *fit, tmpIdx1, nodeIdx, i-_min+1, _max-i );//_max-i, i-_min+1 );
-		}
-
-		// Find the minimum in sum
-		float minCost = std::numeric_limits<float>::infinity();
 		uint32 splitIndex = _min;
-		for(uint32 i = 1; i < (_max-_min); ++i)
 		{
-			if(sum(heuristics[i]) < minCost)
+			// Compute bounding volumes for all splits from left and right. The
+			// full prefix is the current node's bounding volume if merging is exact.
+			// The scratch memory is released before the recursion.
+			ScratchArena::Scope scratch;
+			uint32 num = _max - _min + 1;
+			BV* prefix = scratch.Allocate<BV>( num );
+			BV* suffix = scratch.Allocate<BV>( num );
+			SweepBounds<BV>( m_manager, _sorted + _min, num, prefix, suffix );
+			m_manager->GetBoundingVolume<BV>( nodeIdx ) = StaticFit<BV>::EXACT_MERGE ? prefix[num-1]
+				: FitRange<BV>( m_manager, _sorted + _min, num );
+
+			// Find a split index where the sum of heuristic terms left and right is minimized
+			float parentSurface = StaticFit<BV>::Surface( prefix[num-1] );
+			Vec2* heuristics = scratch.Allocate<Vec2>( num - 1 );
+			for(uint32 i = 0; i < num - 1; ++i)
 			{
-				minCost = sum(heuristics[i]);
-				splitIndex = i + _min;
+				heuristics[i].x = SurfaceAreaHeuristic( StaticFit<BV>::Surface(prefix[i]), parentSurface, i+1, num-1-i );
+				heuristics[i].y = SurfaceAreaHeuristic( StaticFit<BV>::Surface(suffix[i+1]), parentSurface, num-1-i, i+1 );
+			}
+
+			// Find the minimum in sum
+			float minCost = std::numeric_limits<float>::infinity();
+			for(uint32 i = 1; i < (_max-_min); ++i)
+			{
+				if(sum(heuristics[i]) < minCost)
+				{
+					minCost = sum(heuristics[i]);
+					splitIndex = i + _min;
+				}
 			}
 		}
 
 		// Go into recursion
 		Assert(splitIndex >= _min && splitIndex < _max, "Unexpected split index.");
-		node.left = Build(_sorted, _min, splitIndex);
-		node.right = Build(_sorted, splitIndex + 1, _max);
+		node.left = Build<BV>(_sorted, _min, splitIndex);
+		node.right = Build<BV>(_sorted, splitIndex + 1, _max);
 	}
 	return nodeIdx;
 }
-
-
-void BuildSweep::ComputeBoundingVolume( const uint32* _sorted, uint32 _min, uint32 _max, uint32 _target, const FitMethod& _fit ) const
-{
-	FileDecl::Triangle t = m_manager->GetTriangleIdx( _sorted[_max] );
-	_fit(&t, 1, _target);
-	// Assume the last index to be unused
-	uint32 tmpIdx = 4 * m_manager->GetTriangleCount() / FileDecl::Leaf::NUM_PRIMITIVES - 1;
-	for(uint32 i = _min; i < _max; ++i)
-	{
-		t = m_manager->GetTriangleIdx( _sorted[i] );
-		_fit(&t, 1, tmpIdx);
-		_fit(_target, tmpIdx, _target);
-	}
-}
@@ -5,7 +5,16 @@
 /// \brief Evaluate a cost function for the current node.
 /// \details The heuristic for a split is the sum from left and right
 ///		sided node costs.
-float SurfaceAreaHeuristic( const FitMethod& _fit, uint32 _target, uint32 _parent, int _num, int _numOther );
+/// \param [in] _surface Surface of the bounding volume of the side.
+/// \param [in] _parentSurface Surface of the bounding volume of the parent.
+float SurfaceAreaHeuristic( float _surface, float _parentSurface, int _num, int _numOther );
+
+/// \brief Interleave the lower 10 bits of three coordinates to a 30 bit
+///		Morton code (z-order).
+uint32 morton30(uint32 _a, uint32 _b, uint32 _c);
+/// \brief Interleave the lower 21 bits of three coordinates to a 63 bit
+///		Morton code (z-order).
+uint64 morton63(uint32 _a, uint32 _b, uint32 _c);
 
 
 class BuildSweep: public BuildMethod
@@ -15,8 +24,6 @@ public:
 
     virtual uint32 operator()() const override;
 
-    virtual void EstimateNodeCounts( uint32& _numInnerNodes, uint32& _numLeafNodes ) const override;
-
 private:
     /// \brief Compute triangle centers and fill the 3 arrays with sorted
     ///     indices of the triangle centers.
@@ -26,11 +33,10 @@ private:
     //void Split( uint32* _list, const ε::Vec3* _centers, uint32 _size, int _splitDim, float _splitPlane ) const;
 
     /// \brief Create new tree-nodes recursively.
+    /// \tparam BV Bounding volume type of the fit method (see StaticFit).
+    template<typename BV>
     uint32 Build( const uint32* _sorted, uint32 _min, uint32 _max ) const;
 
-	/// \brief Compute bounding volume for all triangles in the range.
-	void ComputeBoundingVolume( const uint32* _sorted, uint32 _min, uint32 _max, uint32 _target, const FitMethod& _fit ) const;
-
 	/// \brief Split the two perpendicular dimensions such they contain the
 	///		left/right part from the target dimension in two blocks.
 	//void Split( const uint32* _sorted, uint32 _min, uint32 _max, int _splitDimension, uint32 _splitIndex ) const;
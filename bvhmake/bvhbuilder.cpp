@@ -2,11 +2,24 @@
 #include "filedef.hpp"
 #include "fitmethods/aaboxfit.hpp"
 #include "fitmethods/aaellipsoidfit.hpp"
+#include "fitmethods/oboxfit.hpp"
+#include "fitmethods/spherefit.hpp"
 #include "buildmethods/kdtree.hpp"
 #include "buildmethods/sweep.hpp"
 #include "buildmethods/lds.hpp"
+#include "buildmethods/binnedsah.hpp"
+#include "buildmethods/lbvh.hpp"
+#include "buildmethods/sbvh.hpp"
+#include "buildmethods/hlbvh.hpp"
 #include "processing/tesselate.hpp"
 #include "processing/approx_sggx.hpp"
+#include "processing/treelet.hpp"
+#include "processing/widebvh.hpp"
+#include "processing/quality.hpp"
+#include "processing/toplevel.hpp"
+#include "processing/dynamic.hpp"
+#include "buildcache.hpp"
+#include "parallel.hpp"
 #include "../gpugi/utilities/assert.hpp"
 #include "../gpugi/utilities/logger.hpp"
 #include <assimp/matrix4x4.h>
@@ -19,10 +32,6 @@
 
 using namespace Jo::Files;
 
-// Needs the instance for hashing redundant vertices bidirectional and without
-// doublication.
-const BVHBuilder* g_bvhbuilder;
-
 // Helper method to transform Assimp types into something useful.
 template<typename T, typename F>
 T hard_cast(F _from)
@@ -36,26 +45,33 @@ const FileDecl::Triangle FileDecl::INVALID_TRIANGLE = {{0x0, 0x0, 0x0}, 0};
 
 
 BVHBuilder::BVHBuilder() :
-    m_bvbuffer(nullptr),
-    m_nodes(nullptr),
-    m_leaves(nullptr),
-    m_innerNodeCount(0),
-    m_maxInnerNodeCount(0),
-    m_leafNodeCount(0),
-    m_maxLeafNodeCount(0)
+    m_bvbuffer(sizeof(ε::Box)),
+	m_treeletPasses(0),
+	m_quantizationBits(0),
+	m_compactLeaves(false),
+	m_compressedLeaves(false),
+	m_packedVertexInfo(false),
+	m_perMeshHierarchies(false),
+	m_meshCache(nullptr),
+	m_instancing(false)
 {
     // Register methods
     m_buildMethods.insert( {"kdtree", new BuildKdtree(this)} );
 	m_buildMethods.insert( {"sweep", new BuildSweep(this)} );
 	m_buildMethods.insert( {"lds", new BuildLDS(this)} );
+	m_buildMethods.insert( {"binnedsah", new BuildBinnedSAH(this)} );
+	m_buildMethods.insert( {"lbvh", new BuildLBVH(this)} );
+	m_buildMethods.insert( {"sbvh", new BuildSBVH(this)} );
+	m_buildMethods.insert( {"hlbvh", new BuildHLBVH(this, 9)} );
+	m_buildMethods.insert( {"hlbvhfast", new BuildHLBVH(this, 15)} );
 	m_fitMethods.insert( {"aabox", new FitBox(this)} );
 	m_fitMethods.insert( {"ellipsoid", new FitEllipsoid(this)} );
+	m_fitMethods.insert( {"obox", new FitOBox(this)} );
+	m_fitMethods.insert( {"sphere", new FitSphere(this)} );
 
     // Set defaults
     m_buildMethod = m_buildMethods["kdtree"];
     m_fitMethod = m_fitMethods["aabox"];
-
-	g_bvhbuilder = this;
 }
 
 BVHBuilder::~BVHBuilder()
@@ -65,10 +81,6 @@ BVHBuilder::~BVHBuilder()
 
     for( auto it : m_fitMethods )
         delete it.second;
-
-    delete[] m_bvbuffer;
-    delete[] m_nodes;
-    delete[] m_leaves;
 }
 
 std::string BVHBuilder::GetBuildMethods()
@@ -137,7 +149,7 @@ bool BVHBuilder::LoadSceneWithAssimp( const char* _file )
 
 	if(scene == nullptr) return false;
 
-	ImportVertices( scene, scene->mRootNode, ε::identity4x4() );
+	ImportVertices( scene );
 	ImportMaterials( scene );
 
 	// This is not required anymore, make place for the algorithms
@@ -171,7 +183,7 @@ void BVHBuilder::LoadMaterials( const std::string& _materialFileName )
 }
 
 
-void BVHBuilder::ExportGeometry( std::ofstream& _file, int _numTexcoords )
+void BVHBuilder::ExportGeometry( ExportBuffer& _file, int _numTexcoords )
 {
     // Prepare file headers and find out how much space is required
     FileDecl::NamedArray vertexHeader;
@@ -192,8 +204,21 @@ void BVHBuilder::ExportGeometry( std::ofstream& _file, int _numTexcoords )
 	texcoordsHeader.numElements = GetVertexCount();
 
     // Export pure vertices
-    _file.write( (const char*)&vertexHeader, sizeof(FileDecl::NamedArray) );
-	_file.write( (const char*)m_vertices.data(), sizeof(FileDecl::Vertex) * m_vertices.size() );
+	_file.AddArray( vertexHeader.name, vertexHeader.elementSize, vertexHeader.numElements, m_vertices.data() );
+
+	// Export normals and texture coordinates in the GPU format
+	if( m_packedVertexInfo )
+	{
+		FileDecl::PackedVertexInfo* infos = _file.AddArray<FileDecl::PackedVertexInfo>( "vertex_info_packed", GetVertexCount() );
+		ParallelFor( GetVertexCount(), [&](uint32 _i) {
+			ε::Vec2 normal = FileDecl::EncodeOctahedral( m_vertices[_i].normal );
+			for( int j = 0; j < 2; ++j )
+			{
+				infos[_i].normal[j] = FileDecl::FloatToHalf( normal[j] );
+				infos[_i].texcoord[j] = FileDecl::FloatToHalf( m_vertices[_i].texcoord[j] );
+			}
+		} );
+	}
 
 	// Export tangents
 	//_file.write( (const char*)&tangentsHeader, sizeof(FileDecl::NamedArray) );
@@ -226,17 +251,13 @@ void BVHBuilder::ExportGeometry( std::ofstream& _file, int _numTexcoords )
 		CountGeometry( _node->mChildren[i], _numVertices, _numFaces );
 }*/
 
-void BVHBuilder::ImportVertices(
+void BVHBuilder::CollectMeshes(
 	const struct aiScene* _scene,
 	const struct aiNode* _node,
-	const ε::Mat4x4& _transformation)
+	const ε::Mat4x4& _transformation,
+	std::vector<MeshInstance>& _meshes )
 {
 	ε::Mat4x4 transformation = hard_cast<ε::Mat4x4>(_node->mTransformation) * _transformation;
-	ε::Mat3x3 invTransTransform(transformation.m00, transformation.m01, transformation.m02,
-								transformation.m10, transformation.m11, transformation.m12,
-								transformation.m20, transformation.m21, transformation.m22);
-	invTransTransform = transpose(invert(invTransTransform));
-	//unsigned meshVertexOffset = (unsigned)m_vertices.size();
 	for( unsigned i = 0; i < _node->mNumMeshes; ++i )
 	{
 		const aiMesh* mesh = _scene->mMeshes[ _node->mMeshes[i] ];
@@ -252,62 +273,140 @@ void BVHBuilder::ImportVertices(
 		if( materialIndex == m_materials.RootNode.Size() )
 			std::cerr << "Could not find the mesh material" << std::endl;
 
-		// Add vertices to the output array
-		/*for( unsigned v = 0; v < mesh->mNumVertices; ++v )
+		_meshes.push_back( MeshInstance{mesh, transformation, materialIndex} );
+	}
+
+	// Collect all children
+	for( unsigned i = 0; i < _node->mNumChildren; ++i )
+		CollectMeshes( _scene, _node->mChildren[i], transformation, _meshes );
+}
+
+// Write the vertices of a mesh in world space
+static void TransformVertices( const aiMesh* _mesh, const ε::Mat4x4& _transformation, FileDecl::Vertex* _vertices )
+{
+	ε::Mat3x3 invTransTransform(_transformation.m00, _transformation.m01, _transformation.m02,
+								_transformation.m10, _transformation.m11, _transformation.m12,
+								_transformation.m20, _transformation.m21, _transformation.m22);
+	invTransTransform = transpose(invert(invTransTransform));
+	for( unsigned v = 0; v < _mesh->mNumVertices; ++v )
+	{
+		FileDecl::Vertex& vertex = _vertices[v];
+		vertex.position = ε::transform(hard_cast<ε::Vec3>(_mesh->mVertices[v]), _transformation);
+		vertex.normal = invTransTransform * hard_cast<ε::Vec3>(_mesh->mNormals[v]);
+		if( _mesh->HasTextureCoords(0) )
+			vertex.texcoord = ε::Vec2(_mesh->mTextureCoords[0][v].x, _mesh->mTextureCoords[0][v].y);
+		else
+			vertex.texcoord = ε::Vec2(0.0f, 0.0f);
+	}
+}
+
+// Instance of a mesh hierarchy, instances of empty meshes are skipped
+static void AddInstance( std::vector<FileDecl::Instance>& _instances, uint32 _mesh, const ε::Mat4x4& _transformation )
+{
+	if( _mesh == 0xffffffff )
+		return;
+	FileDecl::Instance instance;
+	for( uint32 r = 0; r < 3; ++r )
+		for( uint32 c = 0; c < 4; ++c )
+			instance.transformation(r, c) = _transformation(r, c);
+	instance.mesh = _mesh;
+	_instances.push_back( instance );
+}
+
+void BVHBuilder::ImportVertices( const struct aiScene* _scene )
+{
+	std::vector<MeshInstance> meshes;
+	CollectMeshes( _scene, _scene->mRootNode, ε::identity4x4(), meshes );
+	uint32 numMeshes = (uint32)meshes.size();
+
+	if( m_perMeshHierarchies || m_instancing )
+	{
+		// With instancing each unique mesh is built once in its own space
+		std::unordered_map<const aiMesh*, uint32> uniqueMeshes;
+		std::vector<FileDecl::Vertex> vertices;
+		std::vector<FileDecl::Triangle> faces;
+		for( uint32 m = 0; m < numMeshes; ++m )
 		{
-			FileDecl::Vertex vertex;
-			vertex.position = ε::transform(hard_cast<ε::Vec3>(mesh->mVertices[v]), transformation);
-			vertex.normal = invTransTransform * hard_cast<ε::Vec3>(mesh->mNormals[v]);
-			if( mesh->HasTextureCoords(0) )
-				vertex.texcoord = ε::Vec2(mesh->mTextureCoords[0][v].x, mesh->mTextureCoords[0][v].y);
-			else
-				vertex.texcoord = ε::Vec2(0.0f, 0.0f);
-			uint32 newIdx = addVertex(vertex);
-			if( newIdx != m_vertices.size()-1 )
-				std::cerr << "Found redundant vertex. Bad, because index table is now wrong!" << std::endl;
+			const aiMesh* mesh = meshes[m].mesh;
+			if( m_instancing )
+			{
+				auto it = uniqueMeshes.find( mesh );
+				if( it == uniqueMeshes.end() )
+					it = uniqueMeshes.emplace( mesh, 0xffffffff ).first;
+				else {
+					AddInstance( m_instances, it->second, meshes[m].transformation );
+					continue;
+				}
+			}
+			vertices.resize( mesh->mNumVertices );
+			TransformVertices( mesh, m_instancing ? ε::identity4x4() : meshes[m].transformation, vertices.data() );
+			faces.resize( mesh->mNumFaces );
+			for( unsigned t = 0; t < mesh->mNumFaces; ++t )
+			{
+				Assert( mesh->mFaces[t].mNumIndices == 3, "This is a triangle importer!" );
+				for( unsigned j = 0; j < 3; ++j )
+					faces[t].vertices[j] = mesh->mFaces[t].mIndices[j];
+				faces[t].material = meshes[m].material;
+			}
+			bool added = AddMeshHierarchy( vertices.data(), (uint32)vertices.size(), faces.data(), (uint32)faces.size() );
+			if( m_instancing && added )
+			{
+				uniqueMeshes[mesh] = (uint32)m_meshHierarchies.size() - 1;
+				AddInstance( m_instances, uniqueMeshes[mesh], meshes[m].transformation );
+			}
 		}
+		return;
+	}
 
-		// Add each triangle to the output array
-		for( unsigned t = 0; t < mesh->mNumFaces; ++t )
-		{
-			const aiFace& face = mesh->mFaces[t];
-			Assert( face.mNumIndices == 3, "This is a triangle importer!" );
-			m_triangles.push_back(face.mIndices[0] + meshVertexOffset);
-			m_triangles.push_back(face.mIndices[1] + meshVertexOffset);
-			m_triangles.push_back(face.mIndices[2] + meshVertexOffset);
-			m_triangles.push_back(materialIndex);
-		}*/
+	std::vector<uint32> vertexOffsets(numMeshes + 1, 0);
+	for( uint32 m = 0; m < numMeshes; ++m )
+		vertexOffsets[m+1] = vertexOffsets[m] + meshes[m].mesh->mNumVertices;
+
+	// Transform the vertices of all meshes in parallel
+	std::vector<FileDecl::Vertex> vertices(vertexOffsets.back());
+	ParallelFor( numMeshes, [&](uint32 _m)
+	{
+		TransformVertices( meshes[_m].mesh, meshes[_m].transformation, vertices.data() + vertexOffsets[_m] );
+	}, 1 );
+
+	// Join equal vertices over all meshes
+	std::vector<uint32> indices(vertices.size());
+	WeldVertices( vertices.data(), (uint32)vertices.size(), indices.data() );
 
-		// Add each triangle to the output array and do an optional tesselation
+	// Map the faces to the joined vertices. Faces which degenerated by the
+	// welding are dropped.
+	std::vector<std::vector<FileDecl::Triangle>> meshTriangles(numMeshes);
+	ParallelFor( numMeshes, [&](uint32 _m)
+	{
+		const aiMesh* mesh = meshes[_m].mesh;
+		meshTriangles[_m].reserve(mesh->mNumFaces);
 		for( unsigned t = 0; t < mesh->mNumFaces; ++t )
 		{
 			const aiFace& face = mesh->mFaces[t];
 			Assert( face.mNumIndices == 3, "This is a triangle importer!" );
-			// Build the 3 vertices and map them to new indices
 			FileDecl::Triangle triangle;
-			FileDecl::Vertex vertex;
-			for( unsigned j = 0; j < 3; ++j)
-			{
-				vertex.position = ε::transform(hard_cast<ε::Vec3>(mesh->mVertices[face.mIndices[j]]), transformation);
-				vertex.normal = invTransTransform * hard_cast<ε::Vec3>(mesh->mNormals[face.mIndices[j]]);
-				if( mesh->HasTextureCoords(0) )
-					vertex.texcoord = ε::Vec2(mesh->mTextureCoords[0][face.mIndices[j]].x, mesh->mTextureCoords[0][face.mIndices[j]].y);
-				else
-					vertex.texcoord = ε::Vec2(0.0f, 0.0f);
-				triangle.vertices[j] = AddVertex(vertex);
-			}
-			triangle.material = materialIndex;
-			if( m_triangleSplitThreshold > 0.0f )
-				TesselateSimple(triangle, this, m_triangleSplitThreshold);
-			else TesselateNone(triangle, this);
+			for( unsigned j = 0; j < 3; ++j )
+				triangle.vertices[j] = indices[vertexOffsets[_m] + face.mIndices[j]];
+			triangle.material = meshes[_m].material;
+			if( triangle.vertices[0] != triangle.vertices[1]
+				&& triangle.vertices[0] != triangle.vertices[2]
+				&& triangle.vertices[1] != triangle.vertices[2] )
+				meshTriangles[_m].push_back(triangle);
 		}
+	}, 1 );
 
-	//	meshVertexOffset += mesh->mNumVertices;
+	// Add the triangles in scene order and do an optional tesselation
+	if( m_triangleSplitThreshold > 0.0f )
+	{
+		std::vector<FileDecl::Triangle> triangles;
+		for( uint32 m = 0; m < numMeshes; ++m )
+			triangles.insert( triangles.end(), meshTriangles[m].begin(), meshTriangles[m].end() );
+		TesselateParallel( triangles, this, m_triangleSplitThreshold );
+	} else {
+		for( uint32 m = 0; m < numMeshes; ++m )
+			for( const FileDecl::Triangle& triangle : meshTriangles[m] )
+				TesselateNone(triangle, this);
 	}
-
-	// Export all children
-	for( unsigned i = 0; i < _node->mNumChildren; ++i )
-		ImportVertices( _scene, _node->mChildren[i], transformation );
 }
 
 void BVHBuilder::ImportMaterials( const struct aiScene* _scene )
@@ -517,64 +616,458 @@ void BVHBuilder::ExportTexcoords( std::ofstream& _file,
 }*/
 
 
-static int RecursiveTreeDepth(uint32 _idx, BVHBuilder::Node* _nodes)
+static int RecursiveTreeDepth(uint32 _idx, const Pool<BVHBuilder::Node>& _nodes)
 {
 	if(_nodes[_idx].left & 0x80000000) return 1;
 	else return ε::max(RecursiveTreeDepth(_nodes[_idx].left, _nodes), RecursiveTreeDepth(_nodes[_idx].right, _nodes)) + 1;
 }
 
-void BVHBuilder::BuildBVH()
+void BVHBuilder::ClearBuffers()
 {
-    // The maximum number of nodes is limited. It is possible that a build
-    // method use less, but should never take more.
-    m_buildMethod->EstimateNodeCounts(m_maxInnerNodeCount, m_maxLeafNodeCount);
-    m_innerNodeCount = m_leafNodeCount = 0;
-    m_nodes = new Node[m_maxInnerNodeCount];
-    m_leaves = new FileDecl::Leaf[m_maxLeafNodeCount];
-    switch(m_fitMethod->Type())
-    {
-    case FitMethod::BVType::AABOX:
-        m_bvbuffer = new ε::Box[m_maxInnerNodeCount];
-        break;
-	case FitMethod::BVType::SPHERE:
-        m_bvbuffer = new ε::Sphere[m_maxInnerNodeCount];
-        break;
-    case FitMethod::BVType::AAELLIPSOID:
-        m_bvbuffer = new ε::Ellipsoid[m_maxInnerNodeCount];
-        break;
-    default:
-        break;
-    }
+    m_nodes.Resize( 0 );
+    m_leaves.Resize( 0 );
+    m_bvbuffer.Reset( GetBoundingVolumeSize() );
+}
+
+void BVHBuilder::BuildSingleHierarchy()
+{
+	ClearBuffers();
 
     // Build now
     uint32 root = (*m_buildMethod)();
 	Assert( root == 0, "The root must be always the first node! Resort or allocate in perorder." );
 
-	std::cout << "Created tree with " << m_innerNodeCount << " inner nodes and " << m_leafNodeCount << " leaves.\n";
+	if( m_treeletPasses > 0 )
+		OptimizeTreelets( this, m_treeletPasses );
+}
+
+bool BVHBuilder::BuildBVH()
+{
+	if( (m_instancing || m_perMeshHierarchies) && m_meshHierarchies.empty() )
+	{
+		std::cerr << "No mesh with a valid triangle to build a hierarchy from!" << std::endl;
+		return false;
+	}
+
+	if( m_instancing )
+	{
+		std::cerr << "  Building the top level tree over " << m_instances.size() << " instances of " << m_meshHierarchies.size() << " meshes..." << std::endl;
+		AssembleMeshHierarchies();
+	} else if( m_perMeshHierarchies )
+	{
+		std::cerr << "  Joining " << m_meshHierarchies.size() << " mesh hierarchies..." << std::endl;
+		AssembleMeshHierarchies();
+	} else {
+		if( m_treeletPasses > 0 )
+			std::cerr << "  Building and optimizing treelets..." << std::endl;
+		BuildSingleHierarchy();
+	}
+	ReorderVertices();
+	if( m_compactLeaves )
+		ComputeLeafOffsets();
+
+	std::cout << "Created tree with " << m_nodes.Size() << " inner nodes and " << m_leaves.Size() << " leaves.\n";
 	std::cout << "Max depth is " << RecursiveTreeDepth(0, m_nodes) << '\n';
+	return true;
+}
+
+void BVHBuilder::Refit( const ε::Vec3* _positions, uint32 _numVertices )
+{
+	Assert( _numVertices == GetVertexCount(), "Refit expects one position per vertex!" );
+	CommitUpdates();
+	ParallelFor( _numVertices, [&](uint32 _i) { m_vertices[_i].position = _positions[_i]; } );
+
+	// Sort the nodes by depth. In preorder each parent comes before its
+	// children, roots (instancing) stay at depth 0.
+	uint32 numNodes = m_nodes.Size();
+	std::vector<uint32> depth(numNodes, 0);
+	uint32 maxDepth = 0;
+	for( uint32 i = 0; i < numNodes; ++i )
+	{
+		if( !(m_nodes[i].left & 0x80000000) )
+			depth[m_nodes[i].left] = depth[m_nodes[i].right] = depth[i] + 1;
+		maxDepth = ε::max(maxDepth, depth[i]);
+	}
+	std::vector<uint32> levelOffsets(maxDepth + 2, 0);
+	for( uint32 i = 0; i < numNodes; ++i )
+		++levelOffsets[depth[i] + 1];
+	for( uint32 l = 0; l <= maxDepth; ++l )
+		levelOffsets[l+1] += levelOffsets[l];
+	std::vector<uint32> levelNodes(numNodes);
+	std::vector<uint32> cursor(levelOffsets.begin(), levelOffsets.end() - 1);
+	for( uint32 i = 0; i < numNodes; ++i )
+		levelNodes[cursor[depth[i]]++] = i;
+
+	// The nodes of one level are independent, their children are done
+	for( int l = (int)maxDepth; l >= 0; --l )
+	{
+		ParallelFor( levelOffsets[l+1] - levelOffsets[l], [&](uint32 _i)
+		{
+			uint32 index = levelNodes[levelOffsets[l] + _i];
+			const Node& node = m_nodes[index];
+			if( node.left & 0x80000000 )
+			{
+				FileDecl::Leaf& leaf = m_leaves[node.left & 0x7fffffff];
+				uint32 count = 0;
+				while( count < FileDecl::Leaf::NUM_PRIMITIVES && FileDecl::IsTriangleValid(leaf.triangles[count]) )
+					++count;
+				(*m_fitMethod)( leaf.triangles, count, index );
+			} else
+				(*m_fitMethod)( node.left, node.right, index );
+		}, 64 );
+	}
+
+	if( m_instancing )
+	{
+		// Mesh boxes from the moved vertices, then the top level tree bottom up
+		std::vector<ε::Box> meshBoxes(m_instancedMeshes.size());
+		ParallelFor( (uint32)m_instancedMeshes.size(), [&](uint32 _m)
+		{
+			const FileDecl::InstancedMesh& mesh = m_instancedMeshes[_m];
+			const ε::Vec3& first = GetVertex(m_leaves[mesh.firstLeaf].triangles[0].vertices[0]).position;
+			ε::Box box( first, first );
+			for( uint32 l = mesh.firstLeaf; l < mesh.firstLeaf + mesh.numLeaves; ++l )
+				for( uint32 i = 0; i < FileDecl::Leaf::NUM_PRIMITIVES && FileDecl::IsTriangleValid(m_leaves[l].triangles[i]); ++i )
+					box = ε::Box( box, ε::Box(GetTriangle(m_leaves[l].triangles[i])) );
+			meshBoxes[_m] = box;
+		}, 1 );
+		std::vector<ε::Box> instanceBoxes;
+		ComputeInstanceBoxes( meshBoxes, instanceBoxes );
+		for( uint32 i = (uint32)m_instanceNodes.size(); i-- > 0; )
+		{
+			const Node& node = m_instanceNodes[i];
+			if( node.left & 0x80000000 )
+				m_instanceBoxes[i] = instanceBoxes[node.left & 0x7fffffff];
+			else
+				m_instanceBoxes[i] = ε::Box( m_instanceBoxes[node.left], m_instanceBoxes[node.right] );
+		}
+	}
+}
+
+void BVHBuilder::InsertTriangle( const FileDecl::Triangle& _triangle )
+{
+	Assert( !m_instancing, "Instanced hierarchies cannot be updated!" );
+	Assert( m_nodes.Size() > 0, "BuildBVH() must be called before the update!" );
+	if( !m_dynamic )
+		m_dynamic.reset( new DynamicUpdates(this) );
+	m_dynamic->Insert( _triangle );
+}
+
+bool BVHBuilder::RemoveTriangle( const FileDecl::Triangle& _triangle )
+{
+	Assert( !m_instancing, "Instanced hierarchies cannot be updated!" );
+	Assert( m_nodes.Size() > 0, "BuildBVH() must be called before the update!" );
+	if( !m_dynamic )
+		m_dynamic.reset( new DynamicUpdates(this) );
+	return m_dynamic->Remove( _triangle );
+}
+
+void BVHBuilder::CommitUpdates()
+{
+	if( !m_dynamic )
+		return;
+	m_dynamic->FitBoundingVolumes();
+	SortNodesPreorder( m_dynamic->GetRoot(), true );
+	m_dynamic.reset();
+
+	// Renumber the leaves in the order they are referenced, freed leaves are
+	// not referenced anymore.
+	std::vector<FileDecl::Leaf> leaves;
+	leaves.reserve( m_leaves.Size() );
+	for( uint32 i = 0; i < m_nodes.Size(); ++i )
+		if( m_nodes[i].left & 0x80000000 )
+		{
+			leaves.push_back( m_leaves[m_nodes[i].left & 0x7fffffff] );
+			m_nodes[i].left = 0x80000000 | uint32(leaves.size() - 1);
+		}
+	m_leaves.Resize( (uint32)leaves.size() );
+	m_leaves.Write( 0, (uint32)leaves.size(), leaves.data() );
+
+	// The triangle list matches the tree again
+	m_triangles.clear();
+	for( const FileDecl::Leaf& leaf : leaves )
+		for( uint32 i = 0; i < FileDecl::Leaf::NUM_PRIMITIVES && FileDecl::IsTriangleValid(leaf.triangles[i]); ++i )
+			AddTriangle( leaf.triangles[i] );
+
+	if( m_compactLeaves )
+		ComputeLeafOffsets();
+}
+
+std::string BVHBuilder::GetMeshBuildParameters() const
+{
+	std::string parameters;
+	for( auto& it : m_buildMethods ) if( it.second == m_buildMethod ) parameters += "b=" + it.first + '\n';
+	for( auto& it : m_fitMethods ) if( it.second == m_fitMethod ) parameters += "g=" + it.first + '\n';
+	parameters += "s=" + std::to_string(m_triangleSplitThreshold) + '\n';
+	parameters += "r=" + std::to_string(m_treeletPasses) + '\n';
+	return parameters;
+}
+
+bool BVHBuilder::AddMeshHierarchy( const FileDecl::Vertex* _vertices, uint32 _numVertices, const FileDecl::Triangle* _faces, uint32 _numFaces )
+{
+	std::string parameters = GetMeshBuildParameters();
+	uint64 key = BuildCache::Hash( &BuildCache::VERSION, sizeof(BuildCache::VERSION) );
+	key = BuildCache::Hash( parameters.data(), parameters.size(), key );
+	key = BuildCache::Hash( _vertices, sizeof(FileDecl::Vertex) * _numVertices, key );
+	key = BuildCache::Hash( _faces, sizeof(FileDecl::Triangle) * _numFaces, key );
+
+	MeshHierarchy mesh;
+	if( m_meshCache && m_meshCache->LoadMesh( key, GetBoundingVolumeSize(), mesh ) )
+	{
+		m_meshHierarchies.push_back( std::move(mesh) );
+		return true;
+	}
+
+	// Build with a separate builder of the same settings
+	BVHBuilder builder;
+	for( auto& it : m_buildMethods ) if( it.second == m_buildMethod ) builder.m_buildMethod = builder.m_buildMethods[it.first];
+	for( auto& it : m_fitMethods ) if( it.second == m_fitMethod ) builder.m_fitMethod = builder.m_fitMethods[it.first];
+	builder.m_treeletPasses = m_treeletPasses;
+
+	std::vector<uint32> indices(_numVertices);
+	builder.WeldVertices( _vertices, _numVertices, indices.data() );
+	std::vector<FileDecl::Triangle> triangles;
+	triangles.reserve( _numFaces );
+	for( uint32 t = 0; t < _numFaces; ++t )
+	{
+		FileDecl::Triangle triangle = _faces[t];
+		for( int j = 0; j < 3; ++j )
+			triangle.vertices[j] = indices[triangle.vertices[j]];
+		if( triangle.vertices[0] != triangle.vertices[1]
+			&& triangle.vertices[0] != triangle.vertices[2]
+			&& triangle.vertices[1] != triangle.vertices[2] )
+			triangles.push_back(triangle);
+	}
+	if( triangles.empty() )
+		return false;
+	if( m_triangleSplitThreshold > 0.0f )
+		TesselateParallel( triangles, &builder, m_triangleSplitThreshold );
+	else
+		for( const FileDecl::Triangle& triangle : triangles )
+			TesselateNone( triangle, &builder );
+	builder.BuildSingleHierarchy();
+
+	mesh.vertices = std::move(builder.m_vertices);
+	mesh.leaves.resize( builder.m_leaves.Size() );
+	builder.m_leaves.Read( 0, builder.m_leaves.Size(), mesh.leaves.data() );
+	mesh.nodes.resize( builder.m_nodes.Size() );
+	builder.m_nodes.Read( 0, builder.m_nodes.Size(), mesh.nodes.data() );
+	mesh.boundingVolumes.resize( builder.GetBoundingVolumeSize() * builder.m_bvbuffer.Size() );
+	builder.m_bvbuffer.Read( 0, builder.m_bvbuffer.Size(), mesh.boundingVolumes.data() );
+	if( m_meshCache )
+		m_meshCache->StoreMesh( key, mesh );
+	m_meshHierarchies.push_back( std::move(mesh) );
+	return true;
+}
+
+void BVHBuilder::AssembleMeshHierarchies()
+{
+	uint32 numMeshes = (uint32)m_meshHierarchies.size();
+	Assert( numMeshes > 0, "No triangles to build a hierarchy from!" );
+
+	// Concatenate geometry and leaves. The vertex indices are shifted by
+	// the offset of the mesh vertices.
+	std::vector<uint32> leafOffsets(numMeshes + 1, 0);
+	for( uint32 m = 0; m < numMeshes; ++m )
+		leafOffsets[m+1] = leafOffsets[m] + (uint32)m_meshHierarchies[m].leaves.size();
+	ClearBuffers();
+	m_leaves.Resize( leafOffsets.back() );
+	std::vector<ε::Box> boxes(numMeshes);
+	for( uint32 m = 0; m < numMeshes; ++m )
+	{
+		const MeshHierarchy& mesh = m_meshHierarchies[m];
+		uint32 vertexOffset = AppendVertices( mesh.vertices.data(), (uint32)mesh.vertices.size() );
+		boxes[m] = ε::Box( mesh.vertices[0].position, mesh.vertices[0].position );
+		for( const FileDecl::Vertex& vertex : mesh.vertices )
+			boxes[m] = ε::Box( ε::min(boxes[m].min, vertex.position), ε::max(boxes[m].max, vertex.position) );
+		for( uint32 l = 0; l < mesh.leaves.size(); ++l )
+		{
+			FileDecl::Leaf& leaf = m_leaves[leafOffsets[m] + l];
+			leaf = mesh.leaves[l];
+			for( uint32 i = 0; i < FileDecl::Leaf::NUM_PRIMITIVES && FileDecl::IsTriangleValid(leaf.triangles[i]); ++i )
+			{
+				for( int j = 0; j < 3; ++j )
+					leaf.triangles[i].vertices[j] += vertexOffset;
+				AddTriangle( leaf.triangles[i] );
+			}
+		}
+	}
+
+	if( m_instancing )
+	{
+		// Keep the mesh hierarchies separate, the instances get their own tree
+		std::vector<Node> noTopLevel;
+		m_instancedMeshes.resize( numMeshes );
+		for( uint32 m = 0; m < numMeshes; ++m )
+		{
+			m_instancedMeshes[m].rootNode = EmitMeshHierarchies( noTopLevel, 0x80000000 | m, leafOffsets );
+			m_instancedMeshes[m].firstLeaf = leafOffsets[m];
+			m_instancedMeshes[m].numLeaves = leafOffsets[m+1] - leafOffsets[m];
+		}
+		BuildInstanceHierarchy( boxes );
+	} else {
+		// Join the meshes with a top level tree and write everything in preorder
+		std::vector<Node> topLevel;
+		if( numMeshes > 1 )
+			BuildTopLevelTree( boxes, topLevel );
+		EmitMeshHierarchies( topLevel, numMeshes > 1 ? 0 : 0x80000000, leafOffsets );
+	}
+	m_meshHierarchies.clear();
+	m_meshHierarchies.shrink_to_fit();
 }
 
-void BVHBuilder::ExportApproximation( std::ofstream& _file )
+uint32 BVHBuilder::EmitMeshHierarchies( const std::vector<Node>& _topLevel, uint32 _code, const std::vector<uint32>& _leafOffsets )
 {
+	if( _code & 0x80000000 )
+	{
+		// Copy the mesh hierarchy as one block, it is in preorder already
+		uint32 m = _code & 0x7fffffff;
+		const MeshHierarchy& mesh = m_meshHierarchies[m];
+		uint32 first = m_nodes.Size();
+		m_nodes.Resize( first + (uint32)mesh.nodes.size() );
+		m_bvbuffer.Resize( m_nodes.Size() );
+		for( uint32 i = 0; i < mesh.nodes.size(); ++i )
+		{
+			Node& node = m_nodes[first + i];
+			node = mesh.nodes[i];
+			if( node.left & 0x80000000 )
+				node.left += _leafOffsets[m];
+			else {
+				node.left += first;
+				node.right += first;
+			}
+		}
+		m_bvbuffer.Write( first, (uint32)mesh.nodes.size(), mesh.boundingVolumes.data() );
+		return first;
+	}
+
+	uint32 index = GetNewNode();
+	uint32 left = EmitMeshHierarchies( _topLevel, _topLevel[_code].left, _leafOffsets );
+	uint32 right = EmitMeshHierarchies( _topLevel, _topLevel[_code].right, _leafOffsets );
+	m_nodes[index].left = left;
+	m_nodes[index].right = right;
+	(*m_fitMethod)( left, right, index );
+	return index;
+}
+
+// Write a top level tree with one instance per leaf node in preorder
+static uint32 EmitInstanceNodes( const std::vector<BVHBuilder::Node>& _topLevel, uint32 _code, const std::vector<ε::Box>& _instanceBoxes,
+								 std::vector<BVHBuilder::Node>& _nodes, std::vector<ε::Box>& _boxes )
+{
+	uint32 index = (uint32)_nodes.size();
+	_nodes.push_back( BVHBuilder::Node() );
+	_boxes.push_back( ε::Box() );
+	if( _code & 0x80000000 )
+	{
+		_nodes[index].left = _code;
+		_nodes[index].right = 0;
+		_boxes[index] = _instanceBoxes[_code & 0x7fffffff];
+		return index;
+	}
+
+	uint32 left = EmitInstanceNodes( _topLevel, _topLevel[_code].left, _instanceBoxes, _nodes, _boxes );
+	uint32 right = EmitInstanceNodes( _topLevel, _topLevel[_code].right, _instanceBoxes, _nodes, _boxes );
+	_nodes[index].left = left;
+	_nodes[index].right = right;
+	_boxes[index] = ε::Box( ε::min(_boxes[left].min, _boxes[right].min), ε::max(_boxes[left].max, _boxes[right].max) );
+	return index;
+}
+
+void BVHBuilder::ComputeInstanceBoxes( const std::vector<ε::Box>& _meshBoxes, std::vector<ε::Box>& _boxes ) const
+{
+	uint32 numInstances = (uint32)m_instances.size();
+	_boxes.resize( numInstances );
+	ParallelFor( numInstances, [&](uint32 _i)
+	{
+		_boxes[_i] = FileDecl::TransformBox( _meshBoxes[m_instances[_i].mesh], m_instances[_i].transformation );
+	} );
+}
+
+void BVHBuilder::BuildInstanceHierarchy( const std::vector<ε::Box>& _meshBoxes )
+{
+	uint32 numInstances = (uint32)m_instances.size();
+	Assert( numInstances > 0, "No instances to build a hierarchy from!" );
+	std::vector<ε::Box> boxes;
+	ComputeInstanceBoxes( _meshBoxes, boxes );
+
+	std::vector<Node> topLevel;
+	if( numInstances > 1 )
+		BuildTopLevelTree( boxes, topLevel );
+	m_instanceNodes.clear();
+	m_instanceBoxes.clear();
+	EmitInstanceNodes( topLevel, numInstances > 1 ? 0 : 0x80000000, boxes, m_instanceNodes, m_instanceBoxes );
+}
+
+void BVHBuilder::ExportApproximation( ExportBuffer& _file )
+{
+	CommitUpdates();
 	ComputeSGGXBases(this, m_hierarchyApproximation);
 
-	FileDecl::NamedArray header;
-	strcpy( header.name, "approx_sggx" );
-	header.elementSize = sizeof(FileDecl::SGGX);
-	header.numElements = m_innerNodeCount;
-	_file.write( (const char*)&header, sizeof(FileDecl::NamedArray) );
-	_file.write( (const char*)m_hierarchyApproximation.data(), header.numElements * header.elementSize );
+	_file.AddArray( "approx_sggx", sizeof(FileDecl::SGGX), m_nodes.Size(), m_hierarchyApproximation.data() );
+}
+
+template<typename T>
+static void WriteQuantizedBoxes( ExportBuffer& _file, const BVHBuilder* _builder )
+{
+	uint32 numNodes = _builder->GetNumNodes();
+	const ε::Box& rootBox = _builder->GetBoundingVolume<ε::Box>(0);
+	_file.AddArray( "bounding_aabox_root", sizeof(ε::Box), 1, &rootBox );
+
+	// Encode top down relative to the decoded parent box. In preorder all
+	// parents are before their children.
+	FileDecl::QuantizedBox<T>* boxes = _file.AddArray<FileDecl::QuantizedBox<T>>( sizeof(T) == 1 ? "bounding_aabox_q8" : "bounding_aabox_q16", numNodes );
+	std::vector<ε::Box> decoded(numNodes);
+	std::vector<uint32> parents(numNodes, 0);
+	boxes[0] = FileDecl::QuantizeBox<T>( rootBox, rootBox );
+	decoded[0] = FileDecl::DequantizeBox( boxes[0], rootBox );
+	for( uint32 i = 0; i < numNodes; ++i )
+	{
+		if( i > 0 )
+		{
+			boxes[i] = FileDecl::QuantizeBox<T>( _builder->GetBoundingVolume<ε::Box>(i), decoded[parents[i]] );
+			decoded[i] = FileDecl::DequantizeBox( boxes[i], decoded[parents[i]] );
+		}
+		const BVHBuilder::Node& node = _builder->GetNode(i);
+		if( !(node.left & 0x80000000) )
+			parents[node.left] = parents[node.right] = i;
+	}
 }
 
-void BVHBuilder::ExportBVH( std::ofstream& _file )
+// The nodes are in preorder, so the file hierarchy has the same indices.
+// Parent and escape are propagated top down (parents come first). Roots
+// are their own parents and have the escape 0.
+template<typename N, typename F>
+static void WriteHierarchy( const N& _nodes, uint32 _numNodes, FileDecl::Node* _hierarchy, F _childCode )
 {
+	for( uint32 i = 0; i < _numNodes; ++i )
+	{
+		_hierarchy[i].parent = i;
+		_hierarchy[i].escape = 0;
+	}
+	for( uint32 i = 0; i < _numNodes; ++i )
+	{
+		_hierarchy[i].firstChild = _childCode( _nodes[i].left );
+		if( !(_nodes[i].left & 0x80000000) )
+		{
+			Assert( _nodes[i].left > i && _nodes[i].right > i, "Nodes are not in preorder!" );
+			_hierarchy[_nodes[i].left].parent = i;
+			_hierarchy[_nodes[i].left].escape = _nodes[i].right;
+			_hierarchy[_nodes[i].right].parent = i;
+			_hierarchy[_nodes[i].right].escape = _hierarchy[i].escape;
+		}
+	}
+}
+
+void BVHBuilder::ExportBVH( ExportBuffer& _file )
+{
+	CommitUpdates();
     // Prepare file headers and find out how much space is required
     FileDecl::NamedArray treeHeader;
     FileDecl::NamedArray bvHeader;
     strcpy( treeHeader.name, "hierarchy" );
     treeHeader.elementSize = sizeof(FileDecl::Node);
-    treeHeader.numElements = m_innerNodeCount;
-    bvHeader.numElements = m_innerNodeCount;
+    treeHeader.numElements = m_nodes.Size();
+    bvHeader.numElements = m_nodes.Size();
     switch(m_fitMethod->Type())
     {
     case FitMethod::BVType::AABOX: strcpy( bvHeader.name, "bounding_aabox" );
@@ -586,65 +1079,302 @@ void BVHBuilder::ExportBVH( std::ofstream& _file )
     case FitMethod::BVType::AAELLIPSOID: strcpy( bvHeader.name, "bounding_ellipsoid" );
         bvHeader.elementSize = sizeof(ε::Ellipsoid);
         break;
+    case FitMethod::BVType::OBOX: strcpy( bvHeader.name, "bounding_obox" );
+        bvHeader.elementSize = sizeof(ε::OBox);
+        break;
     default: Assert( false, "Current geometry cannot be stored!" ); break;
     }
 
 	// Write the bounding volumes sequentially
-    _file.write( (const char*)&bvHeader, sizeof(FileDecl::NamedArray) );
-    _file.write( (const char*)m_bvbuffer, bvHeader.elementSize * bvHeader.numElements );
+	if( m_quantizationBits && m_fitMethod->Type() != FitMethod::BVType::AABOX )
+		std::cerr << "Only boxes can be quantised. Writing full precision bounding volumes." << std::endl;
+	if( m_quantizationBits == 8 && m_fitMethod->Type() == FitMethod::BVType::AABOX )
+		WriteQuantizedBoxes<uint8>( _file, this );
+	else if( m_quantizationBits == 16 && m_fitMethod->Type() == FitMethod::BVType::AABOX )
+		WriteQuantizedBoxes<uint16>( _file, this );
+	else
+		m_bvbuffer.Read( 0, bvHeader.numElements, _file.AddArray( bvHeader.name, bvHeader.elementSize, bvHeader.numElements ) );
+
+	FileDecl::Node* hierarchy = _file.AddArray<FileDecl::Node>( treeHeader.name, treeHeader.numElements );
+	WriteHierarchy( m_nodes, m_nodes.Size(), hierarchy, [this](uint32 _code) { return GetExportChildCode(_code); } );
+}
 
-	// Write the hierarchy as it is in the memory
-    _file.write( (const char*)&treeHeader, sizeof(FileDecl::NamedArray) );
-	RecursiveWriteHierarchy( _file, 0, 0, 0 );
+void BVHBuilder::ExportQualityReport( const std::string& _fileName, uint32 _numRays )
+{
+	CommitUpdates();
+	std::string buildMethod, fitMethod;
+	for( auto& it : m_buildMethods ) if( it.second == m_buildMethod ) buildMethod = it.first;
+	for( auto& it : m_fitMethods ) if( it.second == m_fitMethod ) fitMethod = it.first;
+	if( !WriteQualityReport( this, _fileName, buildMethod, fitMethod, _numRays ) )
+		std::cerr << "Cannot write quality report: " << _fileName << std::endl;
 }
 
-void BVHBuilder::ExportTriangles( std::ofstream& _file )
+void BVHBuilder::ExportTriangles( ExportBuffer& _file )
 {
-    // Prepare file headers and find out how much space is required
-    FileDecl::NamedArray indexHeader;
-    strcpy( indexHeader.name, "triangles" );
-    indexHeader.elementSize = sizeof(FileDecl::Triangle) * FileDecl::Leaf::NUM_PRIMITIVES;
-    indexHeader.numElements = m_leafNodeCount;
+	CommitUpdates();
+	if( m_compactLeaves )
+	{
+		// Leave out the padding, the hierarchy contains (offset, count) codes
+		FileDecl::Triangle* triangles = _file.AddArray<FileDecl::Triangle>( "triangles", m_leafOffsets.back() );
+		for( uint32 i = 0; i < m_leaves.Size(); ++i )
+			memcpy( triangles + m_leafOffsets[i], m_leaves[i].triangles, sizeof(FileDecl::Triangle) * (m_leafOffsets[i+1] - m_leafOffsets[i]) );
+		return;
+	}
+
+	if( m_compressedLeaves )
+	{
+		// Local indices relative to the smallest vertex of each leaf. The
+		// vertices are in leaf order, so most leaves span few vertices.
+		Assert( !m_compactLeaves, "Compressed leaves cannot be compact!" );
+		std::vector<uint32> materials;
+		std::vector<FileDecl::Triangle> fullTriangles;
+		FileDecl::CompressedLeaf* leaves = _file.AddArray<FileDecl::CompressedLeaf>( "leaves_compressed", m_leaves.Size() );
+		for( uint32 i = 0; i < m_leaves.Size(); ++i )
+		{
+			const FileDecl::Leaf& leaf = m_leaves[i];
+			FileDecl::CompressedLeaf& compressed = leaves[i];
+			uint32 count = 0;
+			uint32 minVertex = 0xffffffff, maxVertex = 0;
+			bool uniformMaterial = true;
+			for( ; count < FileDecl::Leaf::NUM_PRIMITIVES && FileDecl::IsTriangleValid(leaf.triangles[count]); ++count )
+			{
+				for( int j = 0; j < 3; ++j )
+				{
+					minVertex = ε::min( minVertex, leaf.triangles[count].vertices[j] );
+					maxVertex = ε::max( maxVertex, leaf.triangles[count].vertices[j] );
+				}
+				uniformMaterial &= leaf.triangles[count].material == leaf.triangles[0].material;
+			}
+
+			memset( compressed.indices, 0, sizeof(compressed.indices) );
+			if( maxVertex - minVertex <= 255 )
+			{
+				compressed.firstVertex = minVertex;
+				for( uint32 t = 0; t < count; ++t )
+					for( int j = 0; j < 3; ++j )
+						compressed.indices[t][j] = uint8(leaf.triangles[t].vertices[j] - minVertex);
+			} else {
+				compressed.firstVertex = FileDecl::CompressedLeaf::FULL_TRIANGLES | (uint32)fullTriangles.size();
+				for( uint32 t = 0; t < count; ++t )
+				{
+					fullTriangles.push_back( leaf.triangles[t] );
+					compressed.indices[t][1] = 1;
+					compressed.indices[t][2] = 2;
+				}
+			}
+			if( uniformMaterial )
+				compressed.material = leaf.triangles[0].material;
+			else {
+				compressed.material = FileDecl::CompressedLeaf::MIXED_MATERIALS | (uint32)materials.size();
+				for( uint32 t = 0; t < count; ++t )
+					materials.push_back( leaf.triangles[t].material );
+			}
+		}
+		if( !materials.empty() )
+			_file.AddArray( "leaf_materials", sizeof(uint32), (uint32)materials.size(), materials.data() );
+		if( !fullTriangles.empty() )
+			_file.AddArray( "leaf_triangles", sizeof(FileDecl::Triangle), (uint32)fullTriangles.size(), fullTriangles.data() );
+		return;
+	}
 
     // Write a "resorted index buffer" to file
-    _file.write( (const char*)&indexHeader, sizeof(FileDecl::NamedArray) );
-    _file.write( (const char*)m_leaves, indexHeader.elementSize * indexHeader.numElements );
+	m_leaves.Read( 0, m_leaves.Size(), _file.AddArray( "triangles", sizeof(FileDecl::Triangle) * FileDecl::Leaf::NUM_PRIMITIVES, m_leaves.Size() ) );
 }
 
+void BVHBuilder::ExportInstances( ExportBuffer& _file )
+{
+	if( !m_instancing )
+		return;
 
+	_file.AddArray( "instances", sizeof(FileDecl::Instance), (uint32)m_instances.size(), m_instances.data() );
+	_file.AddArray( "instance_meshes", sizeof(FileDecl::InstancedMesh), (uint32)m_instancedMeshes.size(), m_instancedMeshes.data() );
+	FileDecl::Node* hierarchy = _file.AddArray<FileDecl::Node>( "instance_hierarchy", (uint32)m_instanceNodes.size() );
+	WriteHierarchy( m_instanceNodes, (uint32)m_instanceNodes.size(), hierarchy, [](uint32 _code) { return _code; } );
+	_file.AddArray( "instance_bounding_aabox", sizeof(ε::Box), (uint32)m_instanceBoxes.size(), m_instanceBoxes.data() );
+}
 
-void BVHBuilder::ExportMaterials( std::ofstream& _file, const std::string& _materialFileName )
+void BVHBuilder::ComputeLeafOffsets()
 {
-	// Create the json file
-	m_materials.Write( HDDFile(_materialFileName, HDDFile::OVERWRITE), Format::JSON );
+	m_leafOffsets.resize( m_leaves.Size() + 1 );
+	m_leafOffsets[0] = 0;
+	for( uint32 i = 0; i < m_leaves.Size(); ++i )
+	{
+		uint32 count = 0;
+		while( count < FileDecl::Leaf::NUM_PRIMITIVES && FileDecl::IsTriangleValid(m_leaves[i].triangles[count]) )
+			++count;
+		Assert( count > 0, "Empty leaf!" );
+		m_leafOffsets[i+1] = m_leafOffsets[i] + count;
+	}
+	Assert( m_leafOffsets.back() <= 0x0FFFFFFF, "Too many triangles for 28 bit leaf offsets!" );
+}
 
-	// Create the materialref table
-	FileDecl::NamedArray materialHeader;
-	strcpy( materialHeader.name, "materialref" );
-	materialHeader.elementSize = sizeof(FileDecl::Material);
-	materialHeader.numElements = static_cast<uint32>(m_materialTable.size());
-	_file.write( (const char*)&materialHeader, sizeof(FileDecl::NamedArray) );
+void BVHBuilder::ReorderVertices()
+{
+	const uint32 UNUSED = 0xffffffff;
+	uint32 numVertices = GetVertexCount();
+	std::vector<uint32> newIndex(numVertices, UNUSED);
+	std::vector<FileDecl::Vertex> vertices;
+	vertices.reserve( numVertices );
+
+	// The nodes are in preorder, so are their leaves. Each leaf is
+	// referenced exactly once.
+	for( uint32 i = 0; i < m_nodes.Size(); ++i )
+		if( m_nodes[i].left & 0x80000000 )
+		{
+			FileDecl::Leaf& leaf = m_leaves[m_nodes[i].left & 0x7fffffff];
+			for( uint32 t = 0; t < FileDecl::Leaf::NUM_PRIMITIVES && FileDecl::IsTriangleValid(leaf.triangles[t]); ++t )
+				for( int j = 0; j < 3; ++j )
+				{
+					uint32& index = leaf.triangles[t].vertices[j];
+					if( newIndex[index] == UNUSED )
+					{
+						newIndex[index] = (uint32)vertices.size();
+						vertices.push_back( m_vertices[index] );
+					}
+					index = newIndex[index];
+				}
+		}
+	for( uint32 i = 0; i < numVertices; ++i )
+		if( newIndex[i] == UNUSED )
+		{
+			newIndex[i] = (uint32)vertices.size();
+			vertices.push_back( m_vertices[i] );
+		}
+	m_vertices.swap( vertices );
+
+	// Remap the triangle list and the weld tables for later additions
+	ParallelFor( GetTriangleCount(), [&](uint32 _t) {
+		for( int j = 0; j < 3; ++j )
+			m_triangles[_t * 4 + j] = newIndex[m_triangles[_t * 4 + j]];
+	} );
+	ParallelFor( NUM_WELD_SHARDS, [&](uint32 _shard) {
+		for( auto& it : m_vertexToIndex[_shard] )
+			it.second = newIndex[it.second];
+	}, 1 );
+}
 
-	for( uint i = 0; i < materialHeader.numElements; ++i )
+uint32 BVHBuilder::GetExportChildCode( uint32 _childCode ) const
+{
+	if( !m_compactLeaves || !(_childCode & 0x80000000) )
+		return _childCode;
+	uint32 leaf = _childCode & 0x7fffffff;
+	uint32 count = m_leafOffsets[leaf+1] - m_leafOffsets[leaf];
+	return 0x80000000 | ((count - 1) << 28) | m_leafOffsets[leaf];
+}
+
+
+template<uint N>
+static void WriteWideHierarchy( ExportBuffer& _file, const BVHBuilder* _builder )
+{
+	std::vector<FileDecl::WideNode<N>> nodes;
+	CollapseHierarchy( _builder, nodes );
+
+	_file.AddArray( ("hierarchy_bvh" + std::to_string(N)).c_str(), sizeof(FileDecl::WideNode<N>), (uint32)nodes.size(), nodes.data() );
+}
+
+void BVHBuilder::ExportWideBVH( ExportBuffer& _file, int _width )
+{
+	CommitUpdates();
+	switch(_width)
 	{
-		_file.write( (const char*)&m_materialTable[i], sizeof(FileDecl::Material) );
+	case 4: WriteWideHierarchy<4>( _file, this ); break;
+	case 8: WriteWideHierarchy<8>( _file, this ); break;
+	default: Assert( false, "Only 4 and 8 wide hierarchies are supported!" ); break;
 	}
 }
 
+void BVHBuilder::ExportMaterials( ExportBuffer& _file, const std::string& _materialFileName )
+{
+	// Create the json file
+	m_materials.Write( HDDFile(_materialFileName, HDDFile::OVERWRITE), Format::JSON );
+
+	// Create the materialref table
+	_file.AddArray( "materialref", sizeof(FileDecl::Material), static_cast<uint32>(m_materialTable.size()), m_materialTable.data() );
+}
+
 uint32 BVHBuilder::AddVertex( const FileDecl::Vertex& _vertex )
 {
 	// Already existant?
-	VertexHandle handle;
-	m_vertices.push_back(_vertex); // Temp add
-	handle.id = uint32(m_vertices.size()-1);
-	auto it = m_vertexToIndex.find(handle);
-	if(it != m_vertexToIndex.end()) {
-		m_vertices.pop_back();
+	VertexKey key(_vertex);
+	auto& table = m_vertexToIndex[GetWeldShard(key)];
+	auto it = table.find(key);
+	if(it != table.end())
 		return it->second;
-	}
-	// Nope - "add it now" (keep temporary)
-	m_vertexToIndex.emplace( handle, handle.id );
-	return handle.id;
+	// Nope - add it now
+	uint32 index = (uint32)m_vertices.size();
+	m_vertices.push_back(_vertex);
+	table.emplace( key, index );
+	return index;
+}
+
+void BVHBuilder::WeldVertices( const FileDecl::Vertex* _vertices, uint32 _num, uint32* _indices )
+{
+	// Compute the keys and distribute the vertices to the shards. Each thread
+	// fills its own lists which are concatenated in thread order, so every
+	// shard sees its vertices in input order.
+	std::vector<VertexKey> keys(_num);
+	uint32 numThreads = GetNumThreads();
+	std::vector<std::vector<uint32>> shardLists(numThreads * NUM_WELD_SHARDS);
+	ParallelRange( _num, [&](uint32 _thread, uint32 _begin, uint32 _end)
+	{
+		for( uint32 i = _begin; i < _end; ++i )
+		{
+			keys[i] = VertexKey(_vertices[i]);
+			shardLists[_thread * NUM_WELD_SHARDS + GetWeldShard(keys[i])].push_back(i);
+		}
+	} );
+
+	// Each shard is owned by one thread. Vertices which already exist get
+	// their final index. Others are marked with NEW_VERTEX and reference the
+	// first occurrence in the input.
+	const uint32 NEW_VERTEX = 0x80000000;
+	std::vector<uint8> isFirst(_num, 0);
+	ParallelFor( NUM_WELD_SHARDS, [&](uint32 _shard)
+	{
+		std::unordered_map<VertexKey, uint32> firstOccurrence;
+		const auto& table = m_vertexToIndex[_shard];
+		for( uint32 t = 0; t < numThreads; ++t )
+			for( uint32 i : shardLists[t * NUM_WELD_SHARDS + _shard] )
+			{
+				auto it = table.find(keys[i]);
+				if( it != table.end() )
+					_indices[i] = it->second;
+				else {
+					auto first = firstOccurrence.emplace(keys[i], i);
+					if( first.second ) isFirst[i] = 1;
+					_indices[i] = NEW_VERTEX | first.first->second;
+				}
+			}
+	}, 1 );
+
+	// New vertices are appended in input order which makes the result
+	// independent of the number of threads.
+	std::vector<uint32> newIndex(_num);
+	for( uint32 i = 0; i < _num; ++i )
+		if( isFirst[i] )
+		{
+			newIndex[i] = (uint32)m_vertices.size();
+			m_vertices.push_back(_vertices[i]);
+		}
+	ParallelFor( _num, [&](uint32 _i)
+	{
+		if( _indices[_i] & NEW_VERTEX )
+			_indices[_i] = newIndex[_indices[_i] & ~NEW_VERTEX];
+	} );
+	ParallelFor( NUM_WELD_SHARDS, [&](uint32 _shard)
+	{
+		for( uint32 t = 0; t < numThreads; ++t )
+			for( uint32 i : shardLists[t * NUM_WELD_SHARDS + _shard] )
+				if( isFirst[i] )
+					m_vertexToIndex[_shard].emplace( keys[i], _indices[i] );
+	}, 1 );
+}
+
+uint32 BVHBuilder::AppendVertices( const FileDecl::Vertex* _vertices, uint32 _num )
+{
+	uint32 first = (uint32)m_vertices.size();
+	m_vertices.insert( m_vertices.end(), _vertices, _vertices + _num );
+	return first;
 }
 
 void BVHBuilder::AddTriangle( const FileDecl::Triangle& _triangle )
@@ -695,45 +1425,107 @@ const FileDecl::Vertex& BVHBuilder::GetVertex( uint32 _index ) const
 
 uint32 BVHBuilder::GetNewLeaf()
 {
-    Assert( m_leaves != nullptr, "BuildBVH() was not called or the memory is not allocated for other reasons." );
-    Assert( m_leafNodeCount < m_maxLeafNodeCount, "Out-of-Bounds. The builder's estimation for the leaf count was to small!" );
-    return m_leafNodeCount++;
+    return m_leaves.Allocate();
 }
 
 uint32 BVHBuilder::GetNewNode()
 {
-    Assert( m_innerNodeCount < m_maxInnerNodeCount, "Out-of-Bounds. The builder's estimation for the inner node count was to small!" );
-	Assert( !(m_innerNodeCount & 0x80000000), "Scene too large. The first bit is reserved as flag." );
-    return m_innerNodeCount++;
+    uint32 index = m_nodes.Allocate();
+    m_bvbuffer.AllocateAt( index );
+	Assert( !(index & 0x80000000), "Scene too large. The first bit is reserved as flag." );
+    return index;
+}
+
+size_t BVHBuilder::GetBoundingVolumeSize() const
+{
+    switch(m_fitMethod->Type())
+    {
+    case FitMethod::BVType::AABOX: return sizeof(ε::Box);
+    case FitMethod::BVType::SPHERE: return sizeof(ε::Sphere);
+    case FitMethod::BVType::AAELLIPSOID: return sizeof(ε::Ellipsoid);
+    case FitMethod::BVType::OBOX: return sizeof(ε::OBox);
+    default: Assert( false, "Unknown bounding volume type!" ); return 0;
+    }
 }
 
-void BVHBuilder::RecursiveWriteHierarchy( std::ofstream& _file, uint32 _this, uint32 _parent, uint32 _escape )
+uint32 BVHBuilder::SortNodesPreorder( uint32 _root, bool _dropUnreachable )
 {
-	FileDecl::Node node;
-	node.firstChild = m_nodes[_this].left;
-	node.parent = _parent;
-	node.escape = _escape;
-	_file.write( (const char*)&node, sizeof(FileDecl::Node) );
-	if( !(m_nodes[_this].left & 0x80000000) )
+	uint32 numNodes = m_nodes.Size();
+	// Compute the preorder position of each node without recursion (the
+	// trees of parallel builders can be deep).
+	const uint32 UNREACHABLE = 0xffffffff;
+	std::vector<uint32> newIndex(numNodes, UNREACHABLE);
+	std::vector<uint32> stack;
+	stack.push_back(_root);
+	uint32 counter = 0;
+	while( !stack.empty() )
+	{
+		uint32 idx = stack.back(); stack.pop_back();
+		newIndex[idx] = counter++;
+		if( !(m_nodes[idx].left & 0x80000000) )
+		{
+			stack.push_back(m_nodes[idx].right);
+			stack.push_back(m_nodes[idx].left);
+		}
+	}
+	Assert( _dropUnreachable || counter == numNodes, "Not all allocated nodes are part of the tree!" );
+
+	// Scatter nodes and bounding volumes into the new order
+	size_t bvSize = GetBoundingVolumeSize();
+	std::unique_ptr<Node[]> nodes(new Node[numNodes]);
+	std::unique_ptr<char[]> bvs(new char[bvSize * numNodes]);
+	for( uint32 i = 0; i < numNodes; ++i )
 	{
-		RecursiveWriteHierarchy( _file, m_nodes[_this].left, _this, m_nodes[_this].right );
-		RecursiveWriteHierarchy( _file, m_nodes[_this].right, _this, _escape );
+		if( newIndex[i] == UNREACHABLE ) continue;
+		Node& node = nodes[newIndex[i]];
+		node = m_nodes[i];
+		if( !(node.left & 0x80000000) )
+		{
+			node.left = newIndex[node.left];
+			node.right = newIndex[node.right];
+		}
+		memcpy( bvs.get() + bvSize * newIndex[i], m_bvbuffer[i], bvSize );
 	}
+	m_nodes.Resize( counter );
+	m_nodes.Write( 0, counter, nodes.get() );
+	m_bvbuffer.Resize( counter );
+	m_bvbuffer.Write( 0, counter, bvs.get() );
+	return 0;
 }
 
-
 // ************************************************************************* //
-bool VertexHandle::operator == (VertexHandle _rhs) const
+// Round away the lowest _bits of the mantissa. -0 and +0 get the same key.
+static uint32 QuantizeFloat( float _x, int _bits )
+{
+	if( _x == 0.0f ) return 0;
+	uint32 bits = hard_cast<uint32>(_x);
+	return (bits + (1u << (_bits - 1))) >> _bits;
+}
+
+VertexKey::VertexKey( const FileDecl::Vertex& _vertex )
+{
+	for( int i = 0; i < 3; ++i )
+	{
+		components[i] = QuantizeFloat( _vertex.position[i], 4 );
+		components[3+i] = QuantizeFloat( _vertex.normal[i], 10 );
+	}
+	components[6] = QuantizeFloat( _vertex.texcoord[0], 4 );
+	components[7] = QuantizeFloat( _vertex.texcoord[1], 4 );
+}
+
+bool VertexKey::operator == (const VertexKey& _rhs) const
 {
-	const FileDecl::Vertex* pl = &g_bvhbuilder->GetVertex(id);
-	const FileDecl::Vertex* pr = &g_bvhbuilder->GetVertex(_rhs.id);
-	return approx(pl->position, pr->position)
-		&& approx(pl->normal, pr->normal)
-		&& approx(pl->texcoord, pr->texcoord);
+	return memcmp( components, _rhs.components, sizeof(components) ) == 0;
 }
 
-size_t std::hash<VertexHandle>::operator()(const VertexHandle& _x) const
+size_t std::hash<VertexKey>::operator()(const VertexKey& _x) const
 {
-	const FileDecl::Vertex* p = &g_bvhbuilder->GetVertex(_x.id);
-	return hash<ε::Vec3>()(p->position) ^ hash<ε::Vec3>()(p->normal) ^ hash<ε::Vec2>()(p->texcoord);
-}
\ No newline at end of file
+	// FNV-1a over the components with a final avalanche step
+	uint64 h = 14695981039346656037ull;
+	for( int i = 0; i < 8; ++i )
+		h = (h ^ _x.components[i]) * 1099511628211ull;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	return size_t(h);
+}
@@ -6,10 +6,15 @@
 #include <ei/3dtypes.hpp>
 #include <ei/stdextensions.hpp>
 #include <memory>
+#include <atomic>
 #include <jofilelib.hpp>
 
 #include "filedef.hpp"
+#include "exportbuffer.hpp"
+#include "pool.hpp"
 class BVHBuilder;
+class BuildCache;
+class DynamicUpdates;
 
 /// \brief The fit method decides which geometry should be used and how
 ///    this is computed.
@@ -22,7 +27,8 @@ public:
     {
         AABOX,
 		SPHERE,
-        AAELLIPSOID
+        AAELLIPSOID,
+        OBOX
     };
 
 /*	/// \brief One time forward iterator
@@ -79,29 +85,28 @@ public:
     /// \return The index of the root element
     virtual uint32 operator()() const = 0;
 
-    /// \brief Estimate the number of maximal tree nodes.
-    /// \details It is important that the generator never takes
-    ///     more nodes from BVHBuilder, but if the tree is reasonable small
-    ///     try to allocate as few as possible.
-    virtual void EstimateNodeCounts( uint32& _numInnerNodes, uint32& _numLeafNodes ) const = 0;
-
 protected:
     BVHBuilder* m_manager;
 };
 
 
-/// \brief Helper type to use Vertices in hashmaps without doublicating them.
-struct VertexHandle
+/// \brief Quantised vertex to find redundant vertices in hashmaps.
+/// \details The lowest mantissa bits of all components are rounded away
+///		(4 bits for positions and texture coordinates, 10 for normals).
+///		Vertices with equal keys are joined.
+struct VertexKey
 {
-	uint32 id;
-	// Compare content not the pointers
-	bool operator == (VertexHandle _rhs) const;
+	uint32 components[8];	///< Position, normal and texture coordinate
+
+	VertexKey() {}
+	explicit VertexKey( const FileDecl::Vertex& _vertex );
+	bool operator == (const VertexKey& _rhs) const;
 };
 namespace std {
 	/// \brief Hash method to find redundant vertices
-	template <> struct hash<VertexHandle>
+	template <> struct hash<VertexKey>
 	{
-		size_t operator()(const VertexHandle& _x) const;
+		size_t operator()(const VertexKey& _x) const;
 	};
 }
 
@@ -136,6 +141,46 @@ public:
 	///		automatic splits.
 	void SetTriangleSplitThreshold( float _value ) { m_triangleSplitThreshold = _value; }
 
+	/// \brief Set the number of treelet restructuring passes after the build.
+	/// \param [in] _numPasses 0 disables the optimization.
+	void SetTreeletOptimizationPasses( int _numPasses ) { m_treeletPasses = _numPasses; }
+
+	/// \brief Export quantised boxes relative to the parent boxes instead of
+	///		"bounding_aabox".
+	/// \param [in] _bits 8, 16 or 0 to disable the quantisation.
+	void SetBoundingVolumeQuantization( int _bits ) { m_quantizationBits = _bits; }
+
+	/// \brief Export leaves as (offset, count) ranges into an unpadded
+	///		"triangles" array instead of fixed size blocks.
+	/// \details The leaf child codes are 0x80000000 | (count-1) << 28 | offset.
+	void SetCompactLeaves( bool _enable ) { m_compactLeaves = _enable; }
+
+	/// \brief Export "leaves_compressed" with vertex indices relative to a
+	///		base vertex of each leaf instead of the "triangles" blocks.
+	/// \details The leaf indices in the hierarchy do not change. Cannot be
+	///		combined with compact leaves.
+	void SetCompressedLeaves( bool _enable ) { m_compressedLeaves = _enable; }
+
+	/// \brief Additionally export "vertex_info_packed" with an octahedral
+	///		normal and the texture coordinate as half floats per vertex.
+	void SetPackedVertexInfo( bool _enable ) { m_packedVertexInfo = _enable; }
+
+	/// \brief Build one hierarchy per mesh and join them with a top level
+	///		tree instead of building over all triangles at once.
+	/// \details Vertices are only joined within a mesh. Treelet passes are
+	///		applied to the mesh hierarchies.
+	/// \param [in] _cache Optional store for the mesh hierarchies. Meshes with
+	///		the same transformed vertices, faces and build parameters are
+	///		loaded instead of built. Must outlive the import.
+	void SetPerMeshHierarchies( bool _enable, const BuildCache* _cache = nullptr ) { m_perMeshHierarchies = _enable; m_meshCache = _cache; }
+
+	/// \brief Keep the assimp node transformations instead of flattening
+	///		all mesh instances into world space.
+	/// \details One hierarchy is built per unique mesh in its own space and
+	///		the instances get a separate top level tree (see ExportInstances()).
+	///		The mesh cache of SetPerMeshHierarchies() is used as well.
+	void SetInstancing( bool _enable ) { m_instancing = _enable; }
+
     /// \brief Get the current fit method.
     /// \detail The build method is responsible to use this method and to
     ///     fill the array of bounding volumes with it.
@@ -152,30 +197,94 @@ public:
 	///		if both have the same name.
 	void LoadMaterials( const std::string& _materialFileName );
 
+	/// \brief Names of all known materials in the order of the material indices.
+	const std::vector<FileDecl::Material>& GetMaterialTable() const { return m_materialTable; }
+
     /// \brief Write the vertex, triangle and material arrays to file
 	/// \param [in] _numTexcoords Number of texture coordinates (2D) to be expected.
 	///		Meshs with fewer coordinates get NaN vectors instead.
-    void ExportGeometry( std::ofstream& _file, int _numTexcoords );
+    void ExportGeometry( ExportBuffer& _file, int _numTexcoords );
 
     /// \brief Allocate space for the tree and the BVs and compute them.
-    void BuildBVH();
+	/// \details The vertices are renumbered in leaf order afterwards, the
+	///		indices of GetVertex() and AddVertex() change.
+	/// \returns false if the per mesh or instanced import produced no mesh
+	///		with a valid triangle. Nothing is built in this case.
+    bool BuildBVH();
+
+	/// \brief Move the vertices and recompute all bounding volumes without
+	///		changing the tree.
+	/// \details Meant for deforming geometry. The nodes of each tree level
+	///		are fitted in parallel from the deepest level up to the root with
+	///		the fit method of the build. The instance boxes are updated too.
+	///		Normals are not changed.
+	/// \param [in] _positions One new position for each vertex (GetVertexCount()).
+	void Refit( const ε::Vec3* _positions, uint32 _numVertices );
+
+	/// \brief Add a single triangle to the finished hierarchy.
+	/// \details The triangle is placed next to the node with the smallest
+	///		SAH cost and the ancestors are refitted and rotated. The vertices
+	///		must have been added before (AddVertex() or AppendVertices()).
+	///		The node pools grow if necessary. The bounding volumes of the
+	///		changed nodes are fitted and the tree is brought into preorder
+	///		again by the next export or Refit(). Not available for instancing.
+	void InsertTriangle( const FileDecl::Triangle& _triangle );
+
+	/// \brief Remove a triangle with the same vertex indices from the
+	///		finished hierarchy (see InsertTriangle()).
+	/// \details Triangles referenced from several leaves (SBVH) are removed
+	///		from all of them.
+	/// \returns true if all references were removed, false if there is no
+	///		such triangle or no other triangle would be left.
+	bool RemoveTriangle( const FileDecl::Triangle& _triangle );
 
 	/// \brief Compute a basis per node which approximates all underlying geometry.
 	// TODO: maybe involve projected area to make node hit probability more similar to underlying geometry.
-	void ExportApproximation( std::ofstream& _file );
+	void ExportApproximation( ExportBuffer& _file );
 
     /// \brief Write the bounding volume hierarchy to file.
-    void ExportBVH( std::ofstream& _file );
-	void ExportTriangles( std::ofstream& _file );
+	/// \details If a quantisation is set and the volumes are boxes
+	///		"bounding_aabox_root" and "bounding_aabox_q8/16" are written instead
+	///		of "bounding_aabox".
+    void ExportBVH( ExportBuffer& _file );
+
+	/// \brief Analyze the hierarchy and write a JSON quality report.
+	/// \param [in] _numRays Number of random rays for the traversal estimate.
+	void ExportQualityReport( const std::string& _fileName, uint32 _numRays );
+
+	/// \brief Write the leaves as "triangles" or as "leaves_compressed",
+	///		"leaf_materials" and "leaf_triangles" (see SetCompressedLeaves()).
+	void ExportTriangles( ExportBuffer& _file );
+
+	/// \brief Write the "instances", "instance_meshes", "instance_hierarchy"
+	///		and "instance_bounding_aabox" arrays (instancing only).
+	void ExportInstances( ExportBuffer& _file );
+
+	/// \brief Write an additional collapsed 4 or 8 wide hierarchy
+	///		("hierarchy_bvh4" or "hierarchy_bvh8").
+	/// \details The leaves are the same as in "triangles".
+	void ExportWideBVH( ExportBuffer& _file, int _width );
 
 	/// \brief Create the "materialref", the "materialassociation" arrays
 	///		and import new material entries for the json file.
-	void ExportMaterials( std::ofstream& _file, const std::string& _materialFileName );
+	void ExportMaterials( ExportBuffer& _file, const std::string& _materialFileName );
 
 	/// \brief Adds/finds a vertex and returns its index.
 	/// \details Unique vertices are joined automatically.
 	uint32 AddVertex( const FileDecl::Vertex& _vertex );
 
+	/// \brief Adds/finds many vertices in parallel.
+	/// \details The result is the same as calling AddVertex() for all
+	///		vertices in order.
+	/// \param [out] _indices The index for each of the _num vertices.
+	void WeldVertices( const FileDecl::Vertex* _vertices, uint32 _num, uint32* _indices );
+
+	/// \brief Appends vertices without joining them.
+	/// \details Meant for vertices which are known to be unique. They are not
+	///		found by later AddVertex() calls.
+	/// \return Index of the first new vertex.
+	uint32 AppendVertices( const FileDecl::Vertex* _vertices, uint32 _num );
+
 	/// \brief Adds a triangle by its indices.
 	void AddTriangle( const FileDecl::Triangle& _triangle );
 	
@@ -186,12 +295,31 @@ public:
         uint32 right;           ///< Index of the right child in the node pool
     };
 
+	/// \brief Finished hierarchy of a single mesh (see SetPerMeshHierarchies()).
+	struct MeshHierarchy
+	{
+		std::vector<FileDecl::Vertex> vertices;
+		std::vector<FileDecl::Leaf> leaves;		///< Vertex indices refer to the own vertices
+		std::vector<Node> nodes;				///< Preorder with the root at 0
+		std::vector<char> boundingVolumes;		///< One volume of the current fit method per node
+	};
+
+	/// \brief Build (or load from the cache) the hierarchy of one mesh.
+	/// \details Called by the import in per mesh mode. BuildBVH() joins all
+	///		added mesh hierarchies.
+	/// \param [in] _vertices Transformed vertices of the mesh.
+	/// \param [in] _faces Triangles with indices into _vertices.
+	/// \returns false if no triangle remained and nothing was added.
+	bool AddMeshHierarchy( const FileDecl::Vertex* _vertices, uint32 _numVertices, const FileDecl::Triangle* _faces, uint32 _numFaces );
+
     uint32 GetTriangleCount() const { return (uint32)(m_triangles.size()/4); }
     uint32 GetVertexCount() const { return (uint32)m_vertices.size(); }
 
     /// \brief Read/write access to bounding volumes
     template<typename T>
-    T& GetBoundingVolume( uint32 _index )   { eiAssertWeak(_index < m_maxInnerNodeCount, "Out-of-Bounds!"); return static_cast<T*>(m_bvbuffer)[_index]; }
+    T& GetBoundingVolume( uint32 _index )   { eiAssertWeak(_index < m_bvbuffer.Size(), "Out-of-Bounds!"); return *static_cast<T*>(m_bvbuffer[_index]); }
+    template<typename T>
+    const T& GetBoundingVolume( uint32 _index ) const   { eiAssertWeak(_index < m_bvbuffer.Size(), "Out-of-Bounds!"); return *static_cast<const T*>(m_bvbuffer[_index]); }
 
     /// \brief Read access to triangles.
     /// \details The triangle is constructed from index and vertex buffer on
@@ -215,47 +343,96 @@ public:
 	const FileDecl::Leaf& GetLeaf( uint32 _index ) const { return m_leaves[_index]; }
 
     /// \brief Allocate a new inner node from the pool.
+    /// \details GetNewNode() and GetNewLeaf() are thread safe. Parallel
+    ///     builders do not allocate in preorder and must call
+    ///     SortNodesPreorder() at the end.
     uint32 GetNewNode();
 
     /// \brief Get write access to the leaf memory.
     Node& GetNode( uint32 _index ) { return m_nodes[_index]; }
 	const Node& GetNode( uint32 _index ) const { return m_nodes[_index]; }
 
-	uint32 GetNumNodes() const { return m_innerNodeCount; }
+	uint32 GetNumNodes() const { return m_nodes.Size(); }
+	uint32 GetNumLeaves() const { return m_leaves.Size(); }
+
+	/// \brief Get the child code as it is written to the file.
+	/// \details Inner node indices are returned unchanged. Leaf codes are
+	///		converted to (offset, count) codes if compact leaves are enabled.
+	uint32 GetExportChildCode( uint32 _childCode ) const;
+
+	/// \brief Renumber all inner nodes (and their bounding volumes) such that
+	///		they are in preorder with the root at index 0.
+	/// \details The export writes the hierarchy in preorder and expects the
+	///		node indices to match this order.
+	/// \param [in] _dropUnreachable Remove nodes which are not part of the
+	///		tree instead of asserting that there are none.
+	/// \returns The new index of the root which is always 0.
+	uint32 SortNodesPreorder( uint32 _root, bool _dropUnreachable = false );
+
+	/// \brief Get the size of a single bounding volume of the current fit method.
+	size_t GetBoundingVolumeSize() const;
 
 private:
 	Jo::Files::MetaFileWrapper m_materials;
     BuildMethod* m_buildMethod;
     FitMethod* m_fitMethod;
 	float m_triangleSplitThreshold;
+	int m_treeletPasses;
+	int m_quantizationBits;
+	bool m_compactLeaves;
+	bool m_compressedLeaves;
+	bool m_packedVertexInfo;
+	bool m_perMeshHierarchies;
+	const BuildCache* m_meshCache;
+	std::vector<MeshHierarchy> m_meshHierarchies;	///< Filled by AddMeshHierarchy() until BuildBVH()
+	bool m_instancing;
+	std::vector<FileDecl::Instance> m_instances;			///< Mesh is the index into m_meshHierarchies/m_instancedMeshes
+	std::vector<FileDecl::InstancedMesh> m_instancedMeshes;	///< Filled by BuildBVH()
+	std::vector<Node> m_instanceNodes;						///< Top level tree over the instances in preorder
+	std::vector<ε::Box> m_instanceBoxes;					///< World space box per node in m_instanceNodes
+	std::vector<uint32> m_leafOffsets;	///< Offset of each leaf in the compact triangle array (filled by BuildBVH)
     std::unordered_map<std::string, BuildMethod*> m_buildMethods;
     std::unordered_map<std::string, FitMethod*> m_fitMethods;
 	std::vector<FileDecl::Vertex> m_vertices;
 	std::vector<uint32> m_triangles;
 	std::vector<FileDecl::Material> m_materialTable;
 	std::vector<FileDecl::SGGX> m_hierarchyApproximation;
+	std::unique_ptr<DynamicUpdates> m_dynamic;	///< Exists from the first insertion/removal until the tree is compacted
 
-	// Mechanism to detect doublicated vertices on add (for tesselation).
-	// Instead of storing the real vertex, only a pointer is used and hashing/comparison
-	// are done over default hash and == implementations.
-	std::unordered_map<VertexHandle, uint32> m_vertexToIndex;
+	// Mechanism to detect doublicated vertices on add (import and tesselation).
+	// The table is split into shards by the key hash such that each shard can
+	// be filled by a different thread.
+	static const uint32 NUM_WELD_SHARDS = 64;
+	std::unordered_map<VertexKey, uint32> m_vertexToIndex[NUM_WELD_SHARDS];
+	static uint32 GetWeldShard( const VertexKey& _key ) { return uint32(std::hash<VertexKey>()(_key) >> 24) % NUM_WELD_SHARDS; }
 
-    // Memory during build
-    void* m_bvbuffer;               ///< Buffer containing space for m_maxInnerNodeCount bounding volumes
-    Node* m_nodes;                  ///< Buffer for all m_maxInnerNodeCount tree nodes.
-    FileDecl::Leaf* m_leaves;       ///< Buffer for all tree leaves.
-    uint32 m_innerNodeCount, m_maxInnerNodeCount;
-    uint32 m_leafNodeCount, m_maxLeafNodeCount;
+    // Memory during build. The pools grow with the tree.
+    BlockPool m_bvbuffer;           ///< One bounding volume of the fit method per inner node
+    Pool<Node> m_nodes;             ///< All inner nodes
+    Pool<FileDecl::Leaf> m_leaves;  ///< All tree leaves
 
     /// \brief Prepare headers for geometry export by counting elements
     /// \param [out] _numVertices Counter for the vertices must be 0 before call.
     /// \param [out] _numFaces Counter for the vertices must be 0 before call.
     //void CountGeometry( const struct aiNode* _node, uint& _numVertices, uint& _numFaces );
-    /// \brief Recursive import function to copy data from assimp graph
-    void ImportVertices(
+	/// \brief A mesh of the assimp graph with its accumulated transformation.
+	struct MeshInstance
+	{
+		const struct aiMesh* mesh;
+		ε::Mat4x4 transformation;
+		uint32 material;
+	};
+
+	/// \brief Recursively list all meshes of the assimp graph in scene order.
+	void CollectMeshes(
 		const struct aiScene* _scene,
-        const struct aiNode* _node,
-        const ε::Mat4x4& _transformation );
+		const struct aiNode* _node,
+		const ε::Mat4x4& _transformation,
+		std::vector<MeshInstance>& _meshes );
+
+    /// \brief Copy data from assimp graph. The meshes are transformed and
+	///		joined in parallel.
+    void ImportVertices( const struct aiScene* _scene );
 
 	/// \brief Import a list of materials ready for export
 	/// \param [in] _scene The assimp scene from which the material gets imported.
@@ -276,6 +453,42 @@ private:
         const struct aiNode* _node,
 		int _texcoordChannel );*/
 
-	/// \brief Converts Node(s) to FileDecl::Node(s)
-	void RecursiveWriteHierarchy( std::ofstream& _file, uint32 _this, uint32 _parent, uint32 _escape );
+	/// \brief Fill m_leafOffsets from the final leaves (compact leaves only).
+	void ComputeLeafOffsets();
+
+	/// \brief Renumber the vertices in the order of their first use by the
+	///		leaves in preorder and rewrite all vertex indices.
+	/// \details Triangles of neighbouring leaves then fetch neighbouring
+	///		vertices. Unused vertices are moved to the end.
+	void ReorderVertices();
+
+	/// \brief Empty the node, leaf and bounding volume pools for a new build.
+	void ClearBuffers();
+
+	/// \brief Bring a dynamically updated tree into preorder, drop freed
+	///		nodes and leaves and renumber the leaves in tree order.
+	/// \details Called before everything which expects a compact tree.
+	void CommitUpdates();
+
+	/// \brief Run the build method and the treelet passes over all triangles.
+	void BuildSingleHierarchy();
+
+	/// \brief Canonical string of all settings which change a mesh hierarchy.
+	std::string GetMeshBuildParameters() const;
+
+	/// \brief Copy all mesh hierarchies into the pools and build the top
+	///		level tree over them.
+	void AssembleMeshHierarchies();
+
+	/// \brief Write the top level node _code and everything below in preorder.
+	/// \param [in] _code Index into _topLevel or first bit set and mesh index.
+	/// \returns Index of the written node.
+	uint32 EmitMeshHierarchies( const std::vector<Node>& _topLevel, uint32 _code, const std::vector<uint32>& _leafOffsets );
+
+	/// \brief Build m_instanceNodes and m_instanceBoxes from the object
+	///		space boxes of the meshes.
+	void BuildInstanceHierarchy( const std::vector<ε::Box>& _meshBoxes );
+
+	/// \brief Compute the world space box of each instance.
+	void ComputeInstanceBoxes( const std::vector<ε::Box>& _meshBoxes, std::vector<ε::Box>& _boxes ) const;
 };
\ No newline at end of file
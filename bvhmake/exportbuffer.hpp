@@ -0,0 +1,69 @@
+#pragma once
+
+#include "filedef.hpp"
+#include <vector>
+#include <fstream>
+#include <cstring>
+
+/// \brief Write buffer for the named arrays of a binary scene file.
+/// \details Each array is serialized into a contiguous memory block and the
+///		blocks are written to the file in bulk. The buffer is flushed when it
+///		grows beyond a threshold (before a new array is started) and on
+///		destruction.
+class ExportBuffer
+{
+public:
+	/// \param [in] _file Binary output stream. Must outlive the buffer.
+	/// \param [in] _flushThreshold Size in bytes after which the buffered
+	///		arrays are written.
+	ExportBuffer( std::ofstream& _file, size_t _flushThreshold = 64 * 1024 * 1024 ) :
+		m_file(_file),
+		m_flushThreshold(_flushThreshold)
+	{}
+
+	~ExportBuffer()		{ Flush(); }
+
+	/// \brief Append the header of a named array and reserve its data.
+	/// \returns Pointer to the uninitialized data of the new array. It is
+	///		valid until the next call of AddArray() or Flush().
+	void* AddArray( const char* _name, uint32 _elementSize, uint32 _numElements )
+	{
+		if( m_data.size() >= m_flushThreshold )
+			Flush();
+		FileDecl::NamedArray header;
+		memset( &header, 0, sizeof(FileDecl::NamedArray) );
+		strncpy( header.name, _name, sizeof(header.name) - 1 );
+		header.elementSize = _elementSize;
+		header.numElements = _numElements;
+		size_t offset = m_data.size();
+		m_data.resize( offset + sizeof(FileDecl::NamedArray) + size_t(_elementSize) * _numElements );
+		memcpy( m_data.data() + offset, &header, sizeof(FileDecl::NamedArray) );
+		return m_data.data() + offset + sizeof(FileDecl::NamedArray);
+	}
+
+	/// \brief Typed version of AddArray() with elementSize = sizeof(T).
+	template<typename T>
+	T* AddArray( const char* _name, uint32 _numElements )
+	{
+		return static_cast<T*>(AddArray( _name, sizeof(T), _numElements ));
+	}
+
+	/// \brief Append a named array and copy its data.
+	void AddArray( const char* _name, uint32 _elementSize, uint32 _numElements, const void* _data )
+	{
+		memcpy( AddArray( _name, _elementSize, _numElements ), _data, size_t(_elementSize) * _numElements );
+	}
+
+	/// \brief Write all buffered arrays to the file.
+	void Flush()
+	{
+		if( !m_data.empty() )
+			m_file.write( m_data.data(), m_data.size() );
+		m_data.clear();
+	}
+
+private:
+	std::ofstream& m_file;
+	size_t m_flushThreshold;
+	std::vector<char> m_data;
+};
@@ -1,7 +1,11 @@
 ﻿#pragma once
 
 #include <ei/vector.hpp>
+#include <ei/3dtypes.hpp>
 #include "../gpugi/utilities/assert.hpp"
+#include <limits>
+#include <cmath>
+#include <cstring>
 
 namespace FileDecl
 {
@@ -23,6 +27,60 @@ namespace FileDecl
         ε::Vec2 texcoord;
     };
 
+    /// \brief Normal and texture coordinate of a vertex in 8 bytes (array:
+    ///     vertex_info_packed).
+    /// \details One element per vertex in the order of (array: vertices).
+    ///     All four values are half floats, the normal is octahedral encoded
+    ///     (EncodeOctahedral()). The layout can be used as RGBA16F texture.
+    struct PackedVertexInfo
+    {
+        uint16 normal[2];
+        uint16 texcoord[2];
+    };
+
+    /// \brief Convert to a half float with rounding to the nearest value.
+    inline uint16 FloatToHalf(float _x)
+    {
+        uint32 bits;
+        memcpy(&bits, &_x, sizeof(float));
+        uint32 sign = (bits >> 16) & 0x8000;
+        uint32 absBits = bits & 0x7fffffff;
+        if(absBits >= 0x7f800000)   // Infinity or NaN
+            return uint16(sign | 0x7c00 | (absBits > 0x7f800000 ? 0x200 : 0));
+        if(absBits >= 0x477ff000)   // Rounds to a value above the largest half
+            return uint16(sign | 0x7c00);
+        if(absBits < 0x33000000)    // Rounds to zero
+            return uint16(sign);
+        if(absBits < 0x38800000)
+        {
+            // Denormalized half: mantissa with the implicit one in units of 2^-24
+            uint32 mantissa = (absBits & 0x7fffff) | 0x800000;
+            uint32 shift = 126 - (absBits >> 23);
+            uint32 half = mantissa >> shift;
+            uint32 rest = mantissa & ((1u << shift) - 1);
+            uint32 halfway = 1u << (shift - 1);
+            if(rest > halfway || (rest == halfway && (half & 1)))
+                ++half;
+            return uint16(sign | half);
+        }
+        // Change the exponent bias from 127 to 15 and round the mantissa to even
+        uint32 half = absBits - 0x38000000;
+        return uint16(sign | ((half + 0xfff + ((half >> 13) & 1)) >> 13));
+    }
+
+    /// \brief Map a unit vector to the octahedron unfolded into [-1,1]^2.
+    inline ε::Vec2 EncodeOctahedral(const ε::Vec3& _normal)
+    {
+        float l1 = std::abs(_normal.x) + std::abs(_normal.y) + std::abs(_normal.z);
+        if(l1 == 0.0f) return ε::Vec2(0.0f, 0.0f);
+        ε::Vec2 p(_normal.x / l1, _normal.y / l1);
+        // Fold the lower hemisphere over the diagonals
+        if(_normal.z < 0.0f)
+            p = ε::Vec2((1.0f - std::abs(p.y)) * (p.x >= 0.0f ? 1.0f : -1.0f),
+                        (1.0f - std::abs(p.x)) * (p.y >= 0.0f ? 1.0f : -1.0f));
+        return p;
+    }
+
     /// \brief Element type for triangle lists (array: triangles).
     struct Triangle
     {
@@ -68,6 +126,78 @@ namespace FileDecl
         uint32 escape;       ///< Where to go next when this node was not hit?
     };
 
+    /// \brief Axis aligned box quantised relative to the (decoded) box of the
+    ///     parent node (arrays: bounding_aabox_q8, bounding_aabox_q16).
+    /// \details The root is relative to the box in (array: bounding_aabox_root).
+    ///     Use QuantizeBox() and DequantizeBox() to convert. The decoded
+    ///     boxes are always conservative.
+    template<typename T>
+    struct QuantizedBox
+    {
+        T min[3];
+        T max[3];
+    };
+
+    /// \brief Decode a box relative to its parent box.
+    template<typename T>
+    ε::Box DequantizeBox(const QuantizedBox<T>& _box, const ε::Box& _parent)
+    {
+        const float maxValue = float(std::numeric_limits<T>::max());
+        ε::Box box;
+        for(int i = 0; i < 3; ++i)
+        {
+            float step = (_parent.max[i] - _parent.min[i]) / maxValue;
+            box.min[i] = _parent.min[i] + _box.min[i] * step;
+            // The upper end must be exact to stay conservative
+            box.max[i] = _box.max[i] == std::numeric_limits<T>::max() ? _parent.max[i] : _parent.min[i] + _box.max[i] * step;
+        }
+        return box;
+    }
+
+    /// \brief Encode a box relative to its parent box. Minima are rounded
+    ///     down and maxima up.
+    /// \param [in] _parent The decoded parent box (not the original one).
+    template<typename T>
+    QuantizedBox<T> QuantizeBox(const ε::Box& _box, const ε::Box& _parent)
+    {
+        const float maxValue = float(std::numeric_limits<T>::max());
+        QuantizedBox<T> q;
+        for(int i = 0; i < 3; ++i)
+        {
+            float extent = _parent.max[i] - _parent.min[i];
+            float scale = extent > 0.0f ? maxValue / extent : 0.0f;
+            q.min[i] = T(ε::clamp(std::floor((_box.min[i] - _parent.min[i]) * scale), 0.0f, maxValue));
+            q.max[i] = T(ε::clamp(std::ceil((_box.max[i] - _parent.min[i]) * scale), 0.0f, maxValue));
+        }
+        // Fix rounding errors of the decoding
+        ε::Box decoded = DequantizeBox(q, _parent);
+        for(int i = 0; i < 3; ++i)
+        {
+            while(q.min[i] > 0 && decoded.min[i] > _box.min[i]) { --q.min[i]; decoded = DequantizeBox(q, _parent); }
+            while(q.max[i] < std::numeric_limits<T>::max() && decoded.max[i] < _box.max[i]) { ++q.max[i]; decoded = DequantizeBox(q, _parent); }
+        }
+        return q;
+    }
+
+    /// \brief Element type for collapsed N-ary hierarchies (arrays:
+    ///     hierarchy_bvh4, hierarchy_bvh8).
+    /// \details The axis aligned boxes of all children are stored as structure
+    ///     of arrays such that all of them can be tested at once. The nodes
+    ///     are in preorder with the root at index 0.
+    ///
+    ///     If the most significant bit of a child index is set the remaining
+    ///     bits are a block index into (array: triangles). Otherwise it is the
+    ///     index of another wide node. Unused slots are INVALID_CHILD and have
+    ///     an empty box (min = +inf, max = -inf).
+    template<uint N>
+    struct WideNode
+    {
+        static const uint32 INVALID_CHILD = 0xffffffff;
+        float minX[N], minY[N], minZ[N];
+        float maxX[N], maxY[N], maxZ[N];
+        uint32 children[N];
+    };
+
     /// \brief A leaf node references a list of N triangles (array: leafnodes).
     struct Leaf
     {
@@ -76,6 +206,85 @@ namespace FileDecl
         //uint32 numTriangles;
     };
 
+    /// \brief A leaf with vertex indices relative to a base vertex (array:
+    ///     leaves_compressed).
+    /// \details Replaces the blocks of (array: triangles) with the same
+    ///     indices, a quarter of the size. The triangles of a leaf are the
+    ///     local index triples which are not (0,0,0). If the vertices of a
+    ///     leaf are more than 255 apart the triangles are stored in (array:
+    ///     leaf_triangles) instead and the local indices only mark the used
+    ///     slots. Use DecompressLeaf() to get the full triangles.
+    struct CompressedLeaf
+    {
+        static const uint32 FULL_TRIANGLES = 0x80000000;
+        static const uint32 MIXED_MATERIALS = 0x80000000;
+        uint32 firstVertex;     ///< Base of the local indices or FULL_TRIANGLES | offset into (array: leaf_triangles)
+        uint32 material;        ///< Material of all triangles or MIXED_MATERIALS | offset of one material per triangle in (array: leaf_materials)
+        uint8 indices[Leaf::NUM_PRIMITIVES][3];
+    };
+
+    /// \brief Expand a compressed leaf to a block of Leaf::NUM_PRIMITIVES
+    ///     triangles. Unused triangles are all 0.
+    inline void DecompressLeaf(const CompressedLeaf& _leaf, const uint32* _materials, const Triangle* _fullTriangles, Triangle* _triangles)
+    {
+        uint32 count = 0;
+        for(uint i = 0; i < Leaf::NUM_PRIMITIVES; ++i)
+        {
+            const uint8* local = _leaf.indices[i];
+            if(local[0] == 0 && local[1] == 0 && local[2] == 0)
+            {
+                _triangles[i] = Triangle{{0, 0, 0}, 0};
+                continue;
+            }
+            if(_leaf.firstVertex & CompressedLeaf::FULL_TRIANGLES)
+                _triangles[i] = _fullTriangles[(_leaf.firstVertex & ~CompressedLeaf::FULL_TRIANGLES) + count];
+            else
+                for(int j = 0; j < 3; ++j)
+                    _triangles[i].vertices[j] = _leaf.firstVertex + local[j];
+            _triangles[i].material = (_leaf.material & CompressedLeaf::MIXED_MATERIALS) ?
+                _materials[(_leaf.material & ~CompressedLeaf::MIXED_MATERIALS) + count] : _leaf.material;
+            ++count;
+        }
+    }
+
+    /// \brief Element type for instanced scenes (array: instances).
+    /// \details In scenes with instances (array: hierarchy) contains one
+    ///     hierarchy per unique mesh in the space of the mesh. The roots of
+    ///     these hierarchies are their own parents and have the escape 0.
+    ///     The instances are found through (array: instance_hierarchy) which
+    ///     has the same layout, but its leaf child codes are instance indices
+    ///     and its boxes (array: instance_bounding_aabox) are in world space.
+    struct Instance
+    {
+        ε::Mat3x4 transformation;   ///< Object to world transformation
+        uint32 mesh;                ///< Index into (array: instance_meshes)
+    };
+
+    /// \brief Hierarchy and leaves of one instanced mesh (array: instance_meshes).
+    struct InstancedMesh
+    {
+        uint32 rootNode;    ///< Root of the mesh hierarchy in (array: hierarchy)
+        uint32 firstLeaf;   ///< First leaf block in (array: triangles)
+        uint32 numLeaves;   ///< Number of leaf blocks of the mesh
+    };
+
+    /// \brief World space box around the transformed corners of an object
+    ///     space box (e.g. the root of an instanced mesh).
+    inline ε::Box TransformBox(const ε::Box& _box, const ε::Mat3x4& _transformation)
+    {
+        ε::Box box;
+        for(int c = 0; c < 8; ++c)
+        {
+            ε::Vec3 corner((c & 1) ? _box.max.x : _box.min.x,
+                           (c & 2) ? _box.max.y : _box.min.y,
+                           (c & 4) ? _box.max.z : _box.min.z);
+            ε::Vec3 position = _transformation * ε::Vec4(corner.x, corner.y, corner.z, 1.0f);
+            if(c == 0) box = ε::Box(position, position);
+            else box = ε::Box(ε::min(box.min, position), ε::max(box.max, position));
+        }
+        return box;
+    }
+
 	/// \brief A simplification of a node by SGGX base function.
 	/// \details This stores the encoded entries of a symmetric matrix S:
 	///		σ = (sqrt(S_xx), sqrt(S_yy), sqrt(S_zz))
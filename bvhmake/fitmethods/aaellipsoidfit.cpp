@@ -1,4 +1,5 @@
 ﻿#include "aaellipsoidfit.hpp"
+#include "staticfit.hpp"
 #include "ei/3dintersection.hpp"
 #include "optimize.hpp"
 #include "../../gpugi/utilities/assert.hpp"
@@ -28,19 +29,42 @@
 	return ellipsoid;
 }
 
-void FitEllipsoid::operator()(uint32 _left, uint32 _right, uint32 _target) const
+ε::Ellipsoid StaticFit<ε::Ellipsoid>::Merge(const ε::Ellipsoid& _a, const ε::Ellipsoid& _b)
 {
 	// TESTING: use bounding boxes and fit ellipsoid around
-	auto elll = m_manager->GetBoundingVolume<ε::Ellipsoid>(_left);
-	auto ellr = m_manager->GetBoundingVolume<ε::Ellipsoid>(_right);
 	// Reconstruct the inner boxes by dividing with sqrt(3)
-	elll.radii *=  0.577350269f;
-	ellr.radii *=  0.577350269f;
+	ε::Vec3 ral = _a.radii * 0.577350269f;
+	ε::Vec3 rar = _b.radii * 0.577350269f;
 	ε::Box box(
-		ε::min(elll.center - elll.radii, ellr.center - ellr.radii),
-		ε::max(elll.center + elll.radii, ellr.center + ellr.radii)
+		ε::min(_a.center - ral, _b.center - rar),
+		ε::max(_a.center + ral, _b.center + rar)
 		);
-	m_manager->GetBoundingVolume<ε::Ellipsoid>(_target) = ε::Ellipsoid(box);
+	return ε::Ellipsoid(box);
+}
+
+// Find optimal center and try to fit nearly optimal ellipsoid with fitFromCenter
+static ε::Ellipsoid fitVertices(const std::vector<ε::Vec3>& _vertices, const ε::Vec3& _minSearch, const ε::Vec3& _maxSearch)
+{
+	ε::Vec3 pos = optimize<3>(_minSearch, _maxSearch, [&_vertices](const ε::Vec3& _center){
+		return surface(fitFromCenter(_vertices.data(), (int)_vertices.size(), _center));
+	}, 15);
+
+	return fitFromCenter(_vertices.data(), (int)_vertices.size(), pos);
+}
+
+ε::Ellipsoid StaticFit<ε::Ellipsoid>::Fit(const ε::Triangle& _triangle)
+{
+	std::vector<ε::Vec3> vertices = { _triangle.v0, _triangle.v1, _triangle.v2 };
+	return fitVertices(vertices,
+		min(_triangle.v0, min(_triangle.v1, _triangle.v2)),
+		max(_triangle.v0, max(_triangle.v1, _triangle.v2)));
+}
+
+void FitEllipsoid::operator()(uint32 _left, uint32 _right, uint32 _target) const
+{
+	m_manager->GetBoundingVolume<ε::Ellipsoid>(_target) = StaticFit<ε::Ellipsoid>::Merge(
+		m_manager->GetBoundingVolume<ε::Ellipsoid>(_left),
+		m_manager->GetBoundingVolume<ε::Ellipsoid>(_right) );
 }
 
 void FitEllipsoid::operator()(FileDecl::Triangle* _tringles, uint32 _num, uint32 _target) const
@@ -65,15 +89,7 @@ void FitEllipsoid::operator()(FileDecl::Triangle* _tringles, uint32 _num, uint32
 		}
 	}
 
-	// Find optimal center and try to fit nearly optimal ellipsoid with fitFromCenter
-	ε::Vec3 pos = optimize<3>(minSearch, maxSearch, [&vertices](const ε::Vec3& _center){
-		return surface(fitFromCenter(vertices.data(), (int)vertices.size(), _center));
-	}, 15);
-
-	ε::Ellipsoid e = fitFromCenter(vertices.data(), (int)vertices.size(), pos);
-	ε::Ellipsoid e2 = ε::Ellipsoid(ε::Box(minSearch, maxSearch));
-	float vol = volume(e);
-	float vol2 = volume(e2);
+	ε::Ellipsoid e = fitVertices(vertices, minSearch, maxSearch);
 	//Assert(all(e.radii > 0.0f), "Degenerated cases are bad for the iterative composition!");
 	m_manager->GetBoundingVolume<ε::Ellipsoid>(_target) = e;
 }
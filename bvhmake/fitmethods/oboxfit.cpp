@@ -0,0 +1,304 @@
+﻿#include "oboxfit.hpp"
+#include "staticfit.hpp"
+#include <ei/3dtypes.hpp>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include "../../gpugi/utilities/assert.hpp"
+
+using namespace ε;
+
+// Rotate _x with the quaternion _q (the same as rotate() in the shaders)
+static Vec3 Rotate(const Vec3& _x, const Quaternion& _q)
+{
+	Vec3 u(_q.i, _q.j, _q.k);
+	Vec3 t = cross(u, _x);
+	return _x + 2.0f * (_q.r * t + cross(u, t));
+}
+
+// Quaternion which rotates the unit axes into the (orthonormal, right
+// handed) axes _a0, _a1, _a2.
+static Quaternion FromAxes(const Vec3& _a0, const Vec3& _a1, const Vec3& _a2)
+{
+	// Rotation matrix with the axes as columns
+	float m00 = _a0.x, m01 = _a1.x, m02 = _a2.x;
+	float m10 = _a0.y, m11 = _a1.y, m12 = _a2.y;
+	float m20 = _a0.z, m21 = _a1.z, m22 = _a2.z;
+	float trace = m00 + m11 + m22;
+	Quaternion q;
+	if( trace > 0.0f )
+	{
+		float s = 0.5f / std::sqrt(trace + 1.0f);
+		q = Quaternion((m21 - m12) * s, (m02 - m20) * s, (m10 - m01) * s, 0.25f / s);
+	} else if( m00 > m11 && m00 > m22 )
+	{
+		float s = 2.0f * std::sqrt(1.0f + m00 - m11 - m22);
+		q = Quaternion(0.25f * s, (m01 + m10) / s, (m02 + m20) / s, (m21 - m12) / s);
+	} else if( m11 > m22 )
+	{
+		float s = 2.0f * std::sqrt(1.0f + m11 - m00 - m22);
+		q = Quaternion((m01 + m10) / s, 0.25f * s, (m12 + m21) / s, (m02 - m20) / s);
+	} else {
+		float s = 2.0f * std::sqrt(1.0f + m22 - m00 - m11);
+		q = Quaternion((m02 + m20) / s, (m12 + m21) / s, 0.25f * s, (m10 - m01) / s);
+	}
+	// Normalize against rounding errors
+	float l = std::sqrt(q.i*q.i + q.j*q.j + q.k*q.k + q.r*q.r);
+	return Quaternion(q.i / l, q.j / l, q.k / l, q.r / l);
+}
+
+// Any orthonormal frame with _a0 as first axis
+static void CompleteFrame(const Vec3& _a0, Vec3& _a1, Vec3& _a2)
+{
+	_a1 = cross(_a0, Vec3(0.0f, 1.0f, 0.0f));
+	if( lensq(_a1) < 1e-6f )
+		_a1 = cross(_a0, Vec3(1.0f, 0.0f, 0.0f));
+	_a1 = normalize(_a1);
+	_a2 = cross(_a0, _a1);
+}
+
+// Candidate orientation with its tight extent around the points
+struct Frame
+{
+	Vec3 axes[3];
+	Vec3 min, max;
+
+	void Fit(const Vec3* _points, uint32 _num)
+	{
+		min = Vec3(std::numeric_limits<float>::infinity());
+		max = Vec3(-std::numeric_limits<float>::infinity());
+		for( uint32 i = 0; i < _num; ++i )
+		{
+			Vec3 p(dot(_points[i], axes[0]), dot(_points[i], axes[1]), dot(_points[i], axes[2]));
+			min = ε::min(min, p);
+			max = ε::max(max, p);
+		}
+	}
+
+	float Surface() const
+	{
+		Vec3 e = max - min;
+		return e.x * e.y + e.x * e.z + e.y * e.z;
+	}
+};
+
+OBox FitOBoxToPoints(const Vec3* _points, uint32 _num, const Quaternion* _hints, uint32 _numHints)
+{
+	Assert( _num > 0, "Cannot fit a box to an empty point set." );
+	Frame best;
+	best.axes[0] = Vec3(1.0f, 0.0f, 0.0f);
+	best.axes[1] = Vec3(0.0f, 1.0f, 0.0f);
+	best.axes[2] = Vec3(0.0f, 0.0f, 1.0f);
+	best.Fit(_points, _num);
+	float bestSurface = best.Surface();
+	auto test = [&](const Vec3& _a0, const Vec3& _a1, const Vec3& _a2) {
+		Frame frame;
+		frame.axes[0] = _a0; frame.axes[1] = _a1; frame.axes[2] = _a2;
+		frame.Fit(_points, _num);
+		float surface = frame.Surface();
+		if( surface < bestSurface )
+		{
+			best = frame;
+			bestSurface = surface;
+		}
+	};
+
+	// Orientations of the children
+	for( uint32 h = 0; h < _numHints; ++h )
+		test(Rotate(Vec3(1.0f, 0.0f, 0.0f), _hints[h]),
+			 Rotate(Vec3(0.0f, 1.0f, 0.0f), _hints[h]),
+			 Rotate(Vec3(0.0f, 0.0f, 1.0f), _hints[h]));
+
+	// Extremal points along a fixed set of directions
+	const int NUM_DIRECTIONS = 7;
+	const Vec3 DIRECTIONS[NUM_DIRECTIONS] = {
+		Vec3(1.0f, 0.0f, 0.0f), Vec3(0.0f, 1.0f, 0.0f), Vec3(0.0f, 0.0f, 1.0f),
+		Vec3(1.0f, 1.0f, 1.0f), Vec3(1.0f, 1.0f, -1.0f), Vec3(1.0f, -1.0f, 1.0f), Vec3(1.0f, -1.0f, -1.0f)
+	};
+	Vec3 extremal[NUM_DIRECTIONS * 2];
+	for( int d = 0; d < NUM_DIRECTIONS; ++d )
+	{
+		float minProj = dot(_points[0], DIRECTIONS[d]), maxProj = minProj;
+		extremal[d*2] = extremal[d*2+1] = _points[0];
+		for( uint32 i = 1; i < _num; ++i )
+		{
+			float proj = dot(_points[i], DIRECTIONS[d]);
+			if( proj < minProj ) { minProj = proj; extremal[d*2] = _points[i]; }
+			if( proj > maxProj ) { maxProj = proj; extremal[d*2+1] = _points[i]; }
+		}
+	}
+
+	// The most distant pair of extremal points gives the first edge
+	Vec3 p0 = extremal[0], p1 = extremal[1];
+	for( int d = 1; d < NUM_DIRECTIONS; ++d )
+		if( lensq(extremal[d*2+1] - extremal[d*2]) > lensq(p1 - p0) )
+		{
+			p0 = extremal[d*2];
+			p1 = extremal[d*2+1];
+		}
+	if( lensq(p1 - p0) > 0.0f )
+	{
+		Vec3 e0 = normalize(p1 - p0);
+		// Extremal point with the largest distance to the line p0-p1
+		Vec3 p2 = p0;
+		float maxDistSq = 0.0f;
+		for( int i = 0; i < NUM_DIRECTIONS * 2; ++i )
+		{
+			Vec3 v = extremal[i] - p0;
+			float distSq = lensq(v - dot(v, e0) * e0);
+			if( distSq > maxDistSq ) { maxDistSq = distSq; p2 = extremal[i]; }
+		}
+		Vec3 n = cross(p1 - p0, p2 - p0);
+		if( lensq(n) > 1e-12f * lensq(p1 - p0) * lensq(p1 - p0) )
+		{
+			// Align with the triangle and each of its edges. The normal is
+			// orthogonalized again against rounding errors.
+			n = normalize(n);
+			Vec3 edges[3] = { e0, normalize(p2 - p1), normalize(p0 - p2) };
+			for( int i = 0; i < 3; ++i )
+			{
+				Vec3 a2 = normalize(n - dot(n, edges[i]) * edges[i]);
+				test(edges[i], cross(a2, edges[i]), a2);
+			}
+		} else {
+			// Collinear points, only the first axis matters
+			Vec3 a1, a2;
+			CompleteFrame(e0, a1, a2);
+			test(e0, a1, a2);
+		}
+	}
+
+	// Fit again with the axes which are really encoded in the quaternion
+	Quaternion orientation = FromAxes(best.axes[0], best.axes[1], best.axes[2]);
+	best.axes[0] = Rotate(Vec3(1.0f, 0.0f, 0.0f), orientation);
+	best.axes[1] = Rotate(Vec3(0.0f, 1.0f, 0.0f), orientation);
+	best.axes[2] = Rotate(Vec3(0.0f, 0.0f, 1.0f), orientation);
+	best.Fit(_points, _num);
+	Vec3 localCenter = (best.min + best.max) * 0.5f;
+	return OBox(best.axes[0] * localCenter.x + best.axes[1] * localCenter.y + best.axes[2] * localCenter.z,
+				(best.max - best.min) * 0.5f,
+				orientation);
+}
+
+// Write the 8 corners of the box
+static void GetCorners(const OBox& _box, Vec3* _corners)
+{
+	Vec3 a0 = Rotate(Vec3(_box.halfSides.x, 0.0f, 0.0f), _box.orientation);
+	Vec3 a1 = Rotate(Vec3(0.0f, _box.halfSides.y, 0.0f), _box.orientation);
+	Vec3 a2 = Rotate(Vec3(0.0f, 0.0f, _box.halfSides.z), _box.orientation);
+	for( int i = 0; i < 8; ++i )
+		_corners[i] = _box.center + ((i & 1) ? a0 : -a0) + ((i & 2) ? a1 : -a1) + ((i & 4) ? a2 : -a2);
+}
+
+OBox StaticFit<OBox>::Fit(const Triangle& _triangle)
+{
+	Vec3 points[3] = { _triangle.v0, _triangle.v1, _triangle.v2 };
+	return FitOBoxToPoints(points, 3);
+}
+
+// Boxes around boxes grow with each level, so this is only used for
+// heuristics. Final bounding volumes are fitted to the geometry.
+OBox StaticFit<OBox>::Merge(const OBox& _a, const OBox& _b)
+{
+	Vec3 corners[16];
+	GetCorners(_a, corners);
+	GetCorners(_b, corners + 8);
+	Quaternion hints[2] = { _a.orientation, _b.orientation };
+	return FitOBoxToPoints(corners, 16, hints, 2);
+}
+
+template<>
+OBox FitRange<OBox>(const BVHBuilder* _manager, const uint32* _ids, uint32 _num)
+{
+	std::vector<Vec3> points;
+	points.reserve(_num * 3);
+	for( uint32 i = 0; i < _num; ++i )
+	{
+		Triangle triangle = _manager->GetTriangle(_ids[i]);
+		points.push_back(triangle.v0);
+		points.push_back(triangle.v1);
+		points.push_back(triangle.v2);
+	}
+	return FitOBoxToPoints(points.data(), (uint32)points.size());
+}
+
+void FitOBox::operator()(uint32 _left, uint32 _right, uint32 _target) const
+{
+	// A box around the children's corners grows with each level (about 3x
+	// the total surface on the test scenes). Use the vertices of the whole
+	// subtree instead. This costs O(n * depth) over the tree, so a refit
+	// costs as much as the initial fit. The buffers are reused per thread.
+	static thread_local std::vector<Vec3> points;
+	static thread_local std::vector<uint32> stack;
+	points.clear();
+	stack.assign( { _right, _left } );
+	while( !stack.empty() )
+	{
+		const BVHBuilder::Node& node = m_manager->GetNode( stack.back() );
+		stack.pop_back();
+		if( node.left & 0x80000000 )
+		{
+			const FileDecl::Leaf& leaf = m_manager->GetLeaf( node.left & 0x7fffffff );
+			for( uint32 i = 0; i < FileDecl::Leaf::NUM_PRIMITIVES && IsTriangleValid(leaf.triangles[i]); ++i )
+			{
+				Triangle triangle = m_manager->GetTriangle(leaf.triangles[i]);
+				points.push_back(triangle.v0);
+				points.push_back(triangle.v1);
+				points.push_back(triangle.v2);
+			}
+		} else {
+			stack.push_back(node.right);
+			stack.push_back(node.left);
+		}
+	}
+	// The children's orientations are good candidates
+	Quaternion hints[2] = { m_manager->GetBoundingVolume<OBox>(_left).orientation,
+							m_manager->GetBoundingVolume<OBox>(_right).orientation };
+	m_manager->GetBoundingVolume<OBox>(_target) = FitOBoxToPoints(points.data(), (uint32)points.size(), hints, 2);
+}
+
+void FitOBox::operator()(FileDecl::Triangle* _tringles, uint32 _num, uint32 _target) const
+{
+	Assert( IsTriangleValid(_tringles[0]),
+		"Empty leaves not allowed." );
+	Vec3 points[FileDecl::Leaf::NUM_PRIMITIVES * 3];
+	uint32 numPoints = 0;
+	for( uint32 i = 0; i < _num && IsTriangleValid(_tringles[i]); ++i )
+	{
+		Triangle triangle = m_manager->GetTriangle(_tringles[i]);
+		points[numPoints++] = triangle.v0;
+		points[numPoints++] = triangle.v1;
+		points[numPoints++] = triangle.v2;
+	}
+	m_manager->GetBoundingVolume<OBox>(_target) = FitOBoxToPoints(points, numPoints);
+}
+
+float FitOBox::Surface(uint32 _index) const
+{
+	return surface( m_manager->GetBoundingVolume<OBox>(_index) );
+}
+
+float FitOBox::Volume(uint32 _index) const
+{
+	return volume( m_manager->GetBoundingVolume<OBox>(_index) );
+}
+
+float FitOBox::GetMin(uint32 _index, int _dim) const
+{
+	const OBox& box = m_manager->GetBoundingVolume<OBox>(_index);
+	Vec3 corners[8];
+	GetCorners(box, corners);
+	float m = corners[0][_dim];
+	for( int i = 1; i < 8; ++i ) m = min(m, corners[i][_dim]);
+	return m;
+}
+
+float FitOBox::GetMax(uint32 _index, int _dim) const
+{
+	const OBox& box = m_manager->GetBoundingVolume<OBox>(_index);
+	Vec3 corners[8];
+	GetCorners(box, corners);
+	float m = corners[0][_dim];
+	for( int i = 1; i < 8; ++i ) m = max(m, corners[i][_dim]);
+	return m;
+}
@@ -0,0 +1,34 @@
+﻿#pragma once
+
+#include "../bvhmake.hpp"
+
+/// \brief Fit oriented boxes with a DiTO like heuristic.
+/// \details Candidate orientations are derived from a large triangle
+///		spanned by extremal points. Inner nodes are fitted to the vertices of
+///		their whole subtree with the children's orientations as additional
+///		candidates, because boxes around the children's boxes grow with each
+///		level. Fitting all inner nodes costs O(n * depth). The fitter is
+///		stateless, so parallel builders evaluate it concurrently.
+class FitOBox: public FitMethod
+{
+public:
+    FitOBox(BVHBuilder* _manager) : FitMethod(_manager) {}
+
+    virtual void operator()(uint32 _left, uint32 _right, uint32 _target) const override;
+    virtual void operator()(FileDecl::Triangle* _tringles, uint32 _num, uint32 _target) const override;
+
+    virtual BVType Type() const override
+    {
+        return BVType::OBOX;
+    }
+
+    virtual float Surface(uint32 _index) const override;
+    virtual float Volume(uint32 _index) const override;
+
+    virtual float GetMin(uint32 _index, int _dim) const override;
+    virtual float GetMax(uint32 _index, int _dim) const override;
+};
+
+/// \brief Fit an oriented box to a point set.
+/// \param [in] _hints Optional orientations which are tested additionally.
+ε::OBox FitOBoxToPoints(const ε::Vec3* _points, uint32 _num, const ε::Quaternion* _hints = nullptr, uint32 _numHints = 0);
@@ -0,0 +1,208 @@
+﻿#include "spherefit.hpp"
+#include "staticfit.hpp"
+#include <ei/3dtypes.hpp>
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+#include "../../gpugi/utilities/assert.hpp"
+
+using namespace ε;
+
+// Larger point sets get Ritter's approximation instead of the minimal sphere.
+// Welzl's algorithm is linear in expectation, but with a large constant.
+static const uint32 MAX_EXACT_POINTS = 3 * 1024;
+
+static bool Contains(const Sphere& _sphere, const Vec3& _point)
+{
+	return lensq(_point - _sphere.center) <= _sphere.radius * _sphere.radius * 1.00001f + 1e-12f;
+}
+
+// Smallest sphere with all support points (at most 4) on its surface
+static Sphere SupportSphere(const Vec3* _support, int _num)
+{
+	Sphere s;
+	if( _num == 0 ) { s.center = Vec3(0.0f); s.radius = 0.0f; return s; }
+	if( _num == 1 ) { s.center = _support[0]; s.radius = 0.0f; return s; }
+	if( _num == 2 )
+	{
+		s.center = (_support[0] + _support[1]) * 0.5f;
+		s.radius = len(_support[1] - _support[0]) * 0.5f;
+		return s;
+	}
+	Vec3 a = _support[1] - _support[0];
+	Vec3 b = _support[2] - _support[0];
+	Vec3 axb = cross(a, b);
+	float denominator;
+	Vec3 offset;
+	if( _num == 3 )
+	{
+		denominator = 2.0f * lensq(axb);
+		offset = cross(lensq(a) * b - lensq(b) * a, axb);
+	} else {
+		Vec3 c = _support[3] - _support[0];
+		denominator = 2.0f * dot(a, cross(b, c));
+		offset = lensq(a) * cross(b, c) + lensq(b) * cross(c, a) + lensq(c) * axb;
+	}
+	if( std::abs(denominator) > 1e-20f )
+	{
+		s.center = _support[0] + offset / denominator;
+		s.radius = len(offset / denominator);
+		if( std::isfinite(s.radius) ) return s;
+	}
+
+	// Degenerated (collinear or coplanar) support: use the smallest sphere of
+	// a subset which contains the remaining point.
+	s.radius = std::numeric_limits<float>::infinity();
+	for( int drop = 0; drop < _num; ++drop )
+	{
+		Vec3 subset[3];
+		for( int i = 0, j = 0; i < _num; ++i )
+			if( i != drop ) subset[j++] = _support[i];
+		Sphere candidate = SupportSphere(subset, _num - 1);
+		candidate.radius = std::max(candidate.radius, len(_support[drop] - candidate.center));
+		if( candidate.radius < s.radius ) s = candidate;
+	}
+	return s;
+}
+
+// Move-to-front variant of Welzl's algorithm. The recursion depth is
+// bounded by the maximum of 4 support points. The expected running time is
+// only linear if the points are in random order.
+static Sphere Welzl(Vec3* _points, uint32 _end, Vec3* _support, int _numSupport)
+{
+	Sphere s = SupportSphere(_support, _numSupport);
+	if( _numSupport == 4 ) return s;
+	for( uint32 i = 0; i < _end; ++i )
+		if( !Contains(s, _points[i]) )
+		{
+			_support[_numSupport] = _points[i];
+			s = Welzl(_points, i, _support, _numSupport + 1);
+			// Points which lie outside are likely to do so again
+			std::rotate(_points, _points + i, _points + i + 1);
+		}
+	return s;
+}
+
+// Ritter's bounding sphere: start with two distant points and grow the
+// sphere for each point outside. At most a few percent larger than the
+// minimal sphere in practice.
+static Sphere RitterSphere(const Vec3* _points, uint32 _num)
+{
+	uint32 y = 0, z = 0;
+	for( uint32 i = 1; i < _num; ++i )
+		if( lensq(_points[i] - _points[0]) > lensq(_points[y] - _points[0]) ) y = i;
+	for( uint32 i = 0; i < _num; ++i )
+		if( lensq(_points[i] - _points[y]) > lensq(_points[z] - _points[y]) ) z = i;
+	Sphere s;
+	s.center = (_points[y] + _points[z]) * 0.5f;
+	s.radius = len(_points[z] - _points[y]) * 0.5f;
+	for( uint32 i = 0; i < _num; ++i )
+	{
+		float dist = len(_points[i] - s.center);
+		if( dist > s.radius )
+		{
+			float radius = (s.radius + dist) * 0.5f;
+			s.center = s.center + (_points[i] - s.center) * ((radius - s.radius) / dist);
+			s.radius = radius;
+		}
+	}
+	return s;
+}
+
+// Rounding errors must not lead to points outside
+static void EnlargeToPoints(Sphere& _sphere, const Vec3* _points, uint32 _num)
+{
+	float radiusSq = _sphere.radius * _sphere.radius;
+	for( uint32 i = 0; i < _num; ++i )
+		radiusSq = std::max(radiusSq, lensq(_points[i] - _sphere.center));
+	_sphere.radius = std::sqrt(radiusSq);
+}
+
+Sphere FitSphereToPoints(Vec3* _points, uint32 _num)
+{
+	Assert( _num > 0, "Cannot fit a sphere to an empty point set." );
+	// The input is often spatially sorted which is the worst case for Welzl's
+	// algorithm. A fixed seed keeps the builds reproducible.
+	std::minstd_rand rng(_num);
+	std::shuffle(_points, _points + _num, rng);
+	Vec3 support[4];
+	Sphere s = Welzl(_points, _num, support, 0);
+	EnlargeToPoints(s, _points, _num);
+	return s;
+}
+
+Sphere StaticFit<Sphere>::Fit(const Triangle& _triangle)
+{
+	Vec3 points[3] = { _triangle.v0, _triangle.v1, _triangle.v2 };
+	return FitSphereToPoints(points, 3);
+}
+
+Sphere StaticFit<Sphere>::Merge(const Sphere& _a, const Sphere& _b)
+{
+	Vec3 dir = _b.center - _a.center;
+	float dist = len(dir);
+	// One sphere contains the other?
+	if( dist + _b.radius <= _a.radius ) return _a;
+	if( dist + _a.radius <= _b.radius ) return _b;
+	Sphere s;
+	s.radius = (dist + _a.radius + _b.radius) * 0.5f;
+	s.center = _a.center + dir * ((s.radius - _a.radius) / dist);
+	// Make sure both are contained despite rounding
+	s.radius = std::max(s.radius, std::max(len(_a.center - s.center) + _a.radius, len(_b.center - s.center) + _b.radius));
+	return s;
+}
+
+template<>
+Sphere FitRange<Sphere>(const BVHBuilder* _manager, const uint32* _ids, uint32 _num)
+{
+	std::vector<Vec3> points;
+	points.reserve(_num * 3);
+	for( uint32 i = 0; i < _num; ++i )
+	{
+		Triangle triangle = _manager->GetTriangle(_ids[i]);
+		points.push_back(triangle.v0);
+		points.push_back(triangle.v1);
+		points.push_back(triangle.v2);
+	}
+	if( points.size() > MAX_EXACT_POINTS )
+	{
+		Sphere s = RitterSphere(points.data(), (uint32)points.size());
+		EnlargeToPoints(s, points.data(), (uint32)points.size());
+		return s;
+	}
+	return FitSphereToPoints(points.data(), (uint32)points.size());
+}
+
+void FitSphere::operator()(uint32 _left, uint32 _right, uint32 _target) const
+{
+	m_manager->GetBoundingVolume<Sphere>(_target) = StaticFit<Sphere>::Merge(
+		m_manager->GetBoundingVolume<Sphere>(_left),
+		m_manager->GetBoundingVolume<Sphere>(_right) );
+}
+
+void FitSphere::operator()(FileDecl::Triangle* _tringles, uint32 _num, uint32 _target) const
+{
+	Assert( IsTriangleValid(_tringles[0]),
+		"Empty leaves not allowed." );
+	Vec3 points[FileDecl::Leaf::NUM_PRIMITIVES * 3];
+	uint32 numPoints = 0;
+	for( uint32 i = 0; i < _num && IsTriangleValid(_tringles[i]); ++i )
+	{
+		Triangle triangle = m_manager->GetTriangle(_tringles[i]);
+		points[numPoints++] = triangle.v0;
+		points[numPoints++] = triangle.v1;
+		points[numPoints++] = triangle.v2;
+	}
+	m_manager->GetBoundingVolume<Sphere>(_target) = FitSphereToPoints(points, numPoints);
+}
+
+float FitSphere::Surface(uint32 _index) const
+{
+	return surface( m_manager->GetBoundingVolume<Sphere>(_index) );
+}
+
+float FitSphere::Volume(uint32 _index) const
+{
+	return volume( m_manager->GetBoundingVolume<Sphere>(_index) );
+}
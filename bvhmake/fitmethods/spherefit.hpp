@@ -0,0 +1,42 @@
+﻿#pragma once
+
+#include "../bvhmake.hpp"
+
+/// \brief Fit bounding spheres.
+/// \details Leaves get the minimal sphere of their vertices (Welzl's
+///		algorithm). Inner nodes get the exact sphere around the two child
+///		spheres. Builders which fit whole triangle ranges (FitRange) use
+///		Ritter's approximation for more than 1024 triangles.
+class FitSphere: public FitMethod
+{
+public:
+    FitSphere(BVHBuilder* _manager) : FitMethod(_manager) {}
+
+    virtual void operator()(uint32 _left, uint32 _right, uint32 _target) const override;
+    virtual void operator()(FileDecl::Triangle* _tringles, uint32 _num, uint32 _target) const override;
+
+    virtual BVType Type() const override
+    {
+        return BVType::SPHERE;
+    }
+
+    virtual float Surface(uint32 _index) const override;
+    virtual float Volume(uint32 _index) const override;
+
+    virtual float GetMin(uint32 _index, int _dim) const override
+    {
+        auto& sphere = m_manager->GetBoundingVolume<ε::Sphere>(_index);
+        return sphere.center[_dim] - sphere.radius;
+    }
+
+    virtual float GetMax(uint32 _index, int _dim) const override
+    {
+        auto& sphere = m_manager->GetBoundingVolume<ε::Sphere>(_index);
+        return sphere.center[_dim] + sphere.radius;
+    }
+};
+
+/// \brief Minimal bounding sphere of a point set (move-to-front Welzl).
+/// \details The points are shuffled first, so the expected running time is
+///		linear. The order of _points is changed.
+ε::Sphere FitSphereToPoints(ε::Vec3* _points, uint32 _num);
@@ -0,0 +1,94 @@
+﻿#pragma once
+
+#include "../bvhmake.hpp"
+
+/// \brief Compile time version of a fit method for one bounding volume type.
+/// \details Specialisations give the same results as the FitMethod with the
+///		same BVType but work on values instead of node indices. Builders
+///		instantiate their inner loops with it to avoid virtual calls and
+///		temporary nodes.
+///
+///		Each specialisation provides
+///		static BV Fit(const ε::Triangle&),
+///		static BV Merge(const BV&, const BV&),
+///		static float Surface(const BV&) and
+///		EXACT_MERGE: false if merged volumes are larger than a fit to the
+///		same geometry (then final volumes should come from FitRange).
+template<typename BV> struct StaticFit;
+
+template<> struct StaticFit<ε::Box>
+{
+	static const FitMethod::BVType TYPE = FitMethod::BVType::AABOX;
+	static const bool EXACT_MERGE = true;
+
+	static ε::Box Fit(const ε::Triangle& _triangle)				{ return ε::Box(_triangle); }
+	static ε::Box Merge(const ε::Box& _a, const ε::Box& _b)		{ return ε::Box(ε::min(_a.min, _b.min), ε::max(_a.max, _b.max)); }
+	static float Surface(const ε::Box& _box)						{ return ε::surface(_box); }
+};
+
+template<> struct StaticFit<ε::Ellipsoid>
+{
+	static const FitMethod::BVType TYPE = FitMethod::BVType::AAELLIPSOID;
+	static const bool EXACT_MERGE = true;
+
+	// Implemented in aaellipsoidfit.cpp
+	static ε::Ellipsoid Fit(const ε::Triangle& _triangle);
+	static ε::Ellipsoid Merge(const ε::Ellipsoid& _a, const ε::Ellipsoid& _b);
+	static float Surface(const ε::Ellipsoid& _ellipsoid)			{ return ε::surface(_ellipsoid); }
+};
+
+template<> struct StaticFit<ε::Sphere>
+{
+	static const FitMethod::BVType TYPE = FitMethod::BVType::SPHERE;
+	static const bool EXACT_MERGE = false;
+
+	// Implemented in spherefit.cpp
+	static ε::Sphere Fit(const ε::Triangle& _triangle);
+	static ε::Sphere Merge(const ε::Sphere& _a, const ε::Sphere& _b);
+	static float Surface(const ε::Sphere& _sphere)				{ return ε::surface(_sphere); }
+};
+
+template<> struct StaticFit<ε::OBox>
+{
+	static const FitMethod::BVType TYPE = FitMethod::BVType::OBOX;
+	static const bool EXACT_MERGE = false;
+
+	// Implemented in oboxfit.cpp
+	static ε::OBox Fit(const ε::Triangle& _triangle);
+	static ε::OBox Merge(const ε::OBox& _a, const ε::OBox& _b);
+	static float Surface(const ε::OBox& _box)						{ return ε::surface(_box); }
+};
+
+/// \brief Bounding volume of the triangles _ids[0.._num-1] (merged one by one).
+template<typename BV>
+BV FitRange(const BVHBuilder* _manager, const uint32* _ids, uint32 _num)
+{
+	BV bv = StaticFit<BV>::Fit( _manager->GetTriangle(_ids[0]) );
+	for( uint32 i = 1; i < _num; ++i )
+		bv = StaticFit<BV>::Merge( bv, StaticFit<BV>::Fit(_manager->GetTriangle(_ids[i])) );
+	return bv;
+}
+
+/// \brief Bounding volumes of all prefixes and suffixes of a triangle range
+///		for sweep builders.
+/// \param [out] _prefix _prefix[i] bounds the triangles _ids[0..i].
+/// \param [out] _suffix _suffix[i] bounds the triangles _ids[i.._num-1].
+template<typename BV>
+void SweepBounds(const BVHBuilder* _manager, const uint32* _ids, uint32 _num, BV* _prefix, BV* _suffix)
+{
+	// Fit each triangle once, then accumulate into both directions
+	for( uint32 i = 0; i < _num; ++i )
+		_suffix[i] = StaticFit<BV>::Fit( _manager->GetTriangle(_ids[i]) );
+	_prefix[0] = _suffix[0];
+	for( uint32 i = 1; i < _num; ++i )
+		_prefix[i] = StaticFit<BV>::Merge( _prefix[i-1], _suffix[i] );
+	for( uint32 i = _num - 1; i > 0; --i )
+		_suffix[i-1] = StaticFit<BV>::Merge( _suffix[i-1], _suffix[i] );
+}
+
+/// \brief Spheres and oriented boxes are fitted to all vertices at once
+///		(spherefit.cpp, oboxfit.cpp).
+template<>
+ε::Sphere FitRange<ε::Sphere>(const BVHBuilder* _manager, const uint32* _ids, uint32 _num);
+template<>
+ε::OBox FitRange<ε::OBox>(const BVHBuilder* _manager, const uint32* _ids, uint32 _num);
@@ -1,6 +1,8 @@
 #include <iostream>
 #include <assimp/DefaultLogger.hpp>
 #include "bvhmake.hpp"
+#include "buildcache.hpp"
+#include <map>
 #include "../dependencies/glhelper/glhelper/utils/pathutils.hpp"
 #include "..\gpugi\utilities\loggerinit.hpp"
 
@@ -60,7 +62,35 @@ int main( int _numArgs, const char** _args )
 				  << "  t=[X]: OPTIONAL. Number of texture coordinates to export." << std::endl
 				  << "  s=[threshold(float)]: OPTIONAL. Split the triangles such\n"\
 					 "      that no edge is longer than threshold (absolute).\n"\
-					 "      The default is 0 which disables splitting." << std::endl;
+					 "      The default is 0 which disables splitting." << std::endl
+				  << "  r=[X]: OPTIONAL. Number of treelet restructuring passes\n"\
+					 "      after the build. The default is 0." << std::endl
+				  << "  w=[4|8]: OPTIONAL. Additionally export a collapsed 4 or 8\n"\
+					 "      wide hierarchy (hierarchy_bvh4/hierarchy_bvh8)." << std::endl
+				  << "  q=[8|16]: OPTIONAL. Store boxes with 8 or 16 bit per\n"\
+					 "      coordinate relative to the parent box." << std::endl
+				  << "  c=[0|1]: OPTIONAL. Store leaves as (offset, count) ranges\n"\
+					 "      of an unpadded triangle array. The default is 0." << std::endl
+				  << "  l=[0|1]: OPTIONAL. Store leaves with 8 bit vertex indices\n"\
+					 "      relative to a base vertex and one material per leaf.\n"\
+					 "      Cannot be combined with c=1. The default is 0." << std::endl
+				  << "  v=[0|1]: OPTIONAL. Additionally store the normals (octahedral)\n"\
+					 "      and texture coordinates as half floats in 8 bytes per\n"\
+					 "      vertex which are uploaded without conversion." << std::endl
+				  << "  a=[rays]: OPTIONAL. Write a quality report (SAH, EPO,\n"\
+					 "      overlap, histograms, traversal steps of the given\n"\
+					 "      number of random rays) to [scene].quality.json." << std::endl
+				  << "  x=[cache directory]: OPTIONAL. Reuse the output of a previous\n"\
+					 "      run with the same scene file and b, g, t, s, r, w, q, c, l, v, m, i\n"\
+					 "      arguments. Changed materials are remapped without a\n"\
+					 "      rebuild. Ignored together with a=." << std::endl
+				  << "  m=[0|1]: OPTIONAL. Build one hierarchy per mesh and join\n"\
+					 "      them with a top level tree. Together with x= unchanged\n"\
+					 "      meshes are not rebuilt. The default is 0." << std::endl
+				  << "  i=[0|1]: OPTIONAL. Keep the scene graph transformations.\n"\
+					 "      Each unique mesh gets one hierarchy in its own space and\n"\
+					 "      the instances a top level tree. Cannot be combined with\n"\
+					 "      w, q, c or a. The default is 0." << std::endl;
         return 1;
     }
 
@@ -68,9 +98,24 @@ int main( int _numArgs, const char** _args )
     std::string outputPath = PathUtils::GetDirectory( std::string(_args[1]) );
 	int numTextureCoordinates = 1;
 	float splitThreshold = 0.0f;
+	int wideHierarchy = 0;
+	int numReportRays = 0;
+	bool perMeshHierarchies = false;
+	bool instancing = false;
+	bool singleRootOptions = false;
+	bool compactLeaves = false;
+	bool compressedLeaves = false;
+	std::string cacheDirectory;
+	// All arguments which change the binary output (last one wins)
+	std::map<char, std::string> buildParameters;
     // Get the optional arguments
     for( int i = 2; i < _numArgs; ++i )
     {
+		if( strchr( "bgtsrwqclvmi", _args[i][0] ) )
+			buildParameters[_args[i][0]] = _args[i] + 2;
+		// These options expect a single hierarchy with one root
+		if( strchr( "wqa", _args[i][0] ) || (_args[i][0] == 'c' && atoi(_args[i] + 2) != 0) )
+			singleRootOptions = true;
         switch(_args[i][0])
         {
         case 'b':
@@ -96,18 +141,78 @@ int main( int _numArgs, const char** _args )
 		case 's':
 			splitThreshold = (float)atof(_args[i] + 2);
 			break;
+		case 'r':
+			builder.SetTreeletOptimizationPasses( atoi(_args[i] + 2) );
+			break;
+		case 'w':
+			wideHierarchy = atoi(_args[i] + 2);
+			if( wideHierarchy != 4 && wideHierarchy != 8 )
+			{
+				std::cerr << "Invalid hierarchy width: " << (_args[i] + 2) << std::endl;
+				return 1;
+			}
+			break;
+		case 'q':
+			if( atoi(_args[i] + 2) != 8 && atoi(_args[i] + 2) != 16 )
+			{
+				std::cerr << "Invalid quantisation: " << (_args[i] + 2) << std::endl;
+				return 1;
+			}
+			builder.SetBoundingVolumeQuantization( atoi(_args[i] + 2) );
+			break;
+		case 'c':
+			compactLeaves = atoi(_args[i] + 2) != 0;
+			builder.SetCompactLeaves( compactLeaves );
+			break;
+		case 'l':
+			compressedLeaves = atoi(_args[i] + 2) != 0;
+			builder.SetCompressedLeaves( compressedLeaves );
+			break;
+		case 'v':
+			builder.SetPackedVertexInfo( atoi(_args[i] + 2) != 0 );
+			break;
+		case 'a':
+			numReportRays = atoi(_args[i] + 2);
+			if( numReportRays <= 0 )
+			{
+				std::cerr << "Invalid number of rays: " << (_args[i] + 2) << std::endl;
+				return 1;
+			}
+			break;
+		case 'x':
+			cacheDirectory = _args[i] + 2;
+			break;
+		case 'm':
+			perMeshHierarchies = atoi(_args[i] + 2) != 0;
+			break;
+		case 'i':
+			instancing = atoi(_args[i] + 2) != 0;
+			break;
         default:
             std::cerr << "Unknown optional argument!" << std::endl;
             return 1;
         }
     }
 
+	if( instancing && singleRootOptions )
+	{
+		std::cerr << "Instancing cannot be combined with w, q, c or a!" << std::endl;
+		return 1;
+	}
+	if( compactLeaves && compressedLeaves )
+	{
+		std::cerr << "Compact leaves cannot be compressed!" << std::endl;
+		return 1;
+	}
+
 	builder.SetTriangleSplitThreshold(splitThreshold);
+	builder.SetInstancing(instancing);
     
     // Try to create output files before spending time for Assimp
     std::string sceneName = PathUtils::GetFilename(std::string(_args[1]));
     sceneName.erase( sceneName.find_last_of( '.' ) );
 	std::string materialFileName = outputPath + '/' + sceneName + ".json";
+	std::string reportFileName = outputPath + '/' + sceneName + ".quality.json";
     sceneName = outputPath + '/' + sceneName + ".bim";
     std::ofstream sceneOut( sceneName, std::ofstream::binary );
     if( sceneOut.bad() )
@@ -120,6 +225,28 @@ int main( int _numArgs, const char** _args )
     // The material file is a json which already might contain stuff load that first.
     builder.LoadMaterials( materialFileName );
 
+	// All arrays are serialized into memory first and written in bulk
+	ExportBuffer sceneBuffer( sceneOut );
+
+	// Skip import and build if the same scene was exported before. The
+	// quality report needs the hierarchy in memory.
+	std::unique_ptr<BuildCache> cache;
+	if( !cacheDirectory.empty() )
+	{
+		std::string parameters;
+		for( auto& it : buildParameters )
+			parameters += std::string(1, it.first) + '=' + it.second + '\n';
+		cache.reset( new BuildCache( cacheDirectory ) );
+		if( !cache->ComputeKey( _args[1], parameters ) )
+			cache.reset();
+	}
+	builder.SetPerMeshHierarchies( perMeshHierarchies, cache.get() );
+	if( cache && numReportRays == 0 && cache->Export( sceneBuffer, builder.GetMaterialTable() ) )
+	{
+		sceneBuffer.Flush();
+		return 0;
+	}
+
     std::cerr << "Loading with Assimp..." << std::endl;
     if( !builder.LoadSceneWithAssimp( _args[1] ) )
     {
@@ -128,20 +255,37 @@ int main( int _numArgs, const char** _args )
     }
 
 	std::cerr << "Computing hierarchy..." << std::endl;
-	builder.BuildBVH();
+	if( !builder.BuildBVH() )
+		return 4;
+
+	if( numReportRays > 0 )
+	{
+		std::cerr << "Analyzing hierarchy..." << std::endl;
+		builder.ExportQualityReport( reportFileName, numReportRays );
+	}
 
 	std::cerr << "Exporting materials..." << std::endl;
-	builder.ExportMaterials( sceneOut, materialFileName );
+	builder.ExportMaterials( sceneBuffer, materialFileName );
 
     std::cerr << "Exporting geometry..." << std::endl;
-    builder.ExportGeometry( sceneOut, numTextureCoordinates );
+    builder.ExportGeometry( sceneBuffer, numTextureCoordinates );
 
     std::cerr << "Exporting hierarchy..." << std::endl;
-    builder.ExportBVH( sceneOut );
-	builder.ExportTriangles( sceneOut );
+    builder.ExportBVH( sceneBuffer );
+	builder.ExportTriangles( sceneBuffer );
+	builder.ExportInstances( sceneBuffer );
+	if( wideHierarchy )
+		builder.ExportWideBVH( sceneBuffer, wideHierarchy );
 
 	std::cerr << "Building and Exporting hierarchy approximation..." << std::endl;
-	builder.ExportApproximation( sceneOut );
+	builder.ExportApproximation( sceneBuffer );
+	sceneBuffer.Flush();
+
+	if( cache )
+	{
+		sceneOut.close();
+		cache->Store( sceneName );
+	}
 
     return 0;
 }
\ No newline at end of file
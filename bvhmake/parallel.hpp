@@ -0,0 +1,53 @@
+#pragma once
+
+#include <ei/elementarytypes.hpp>
+#include <thread>
+#include <vector>
+
+/// \brief Number of threads used by the parallel helpers (at least 1).
+inline uint32 GetNumThreads()
+{
+	uint32 n = std::thread::hardware_concurrency();
+	return n > 0 ? n : 1;
+}
+
+/// \brief Split the range [0, _num) into one contiguous block per thread and
+///		call _func(_thread, _begin, _end) for each block concurrently.
+/// \details The calling thread processes the last block itself. Small ranges
+///		(less than _minPerThread elements per thread) use fewer threads.
+/// \param [in] _func Callable with signature void(uint32 _thread, uint32 _begin, uint32 _end).
+///		_thread is in [0, GetNumThreads()) and can be used to index per-thread
+///		accumulators.
+template<typename F>
+void ParallelRange(uint32 _num, F _func, uint32 _minPerThread = 1024)
+{
+	uint32 numThreads = GetNumThreads();
+	if( _minPerThread > 0 && _num / _minPerThread < numThreads )
+		numThreads = _num / _minPerThread > 0 ? _num / _minPerThread : 1;
+	uint32 blockSize = (_num + numThreads - 1) / numThreads;
+
+	std::vector<std::thread> threads;
+	threads.reserve(numThreads - 1);
+	for( uint32 t = 0; t < numThreads - 1; ++t )
+	{
+		uint32 begin = t * blockSize;
+		uint32 end = begin + blockSize < _num ? begin + blockSize : _num;
+		threads.emplace_back( [&_func, t, begin, end]() { if(begin < end) _func(t, begin, end); } );
+	}
+	uint32 begin = (numThreads - 1) * blockSize;
+	if( begin < _num )
+		_func(numThreads - 1, begin, _num);
+
+	for( auto& thread : threads )
+		thread.join();
+}
+
+/// \brief Call _func(i) for all i in [0, _num) distributed over all threads.
+template<typename F>
+void ParallelFor(uint32 _num, F _func, uint32 _minPerThread = 1024)
+{
+	ParallelRange(_num, [&_func](uint32, uint32 _begin, uint32 _end) {
+		for( uint32 i = _begin; i < _end; ++i )
+			_func(i);
+	}, _minPerThread);
+}
@@ -0,0 +1,222 @@
+#pragma once
+
+#include <ei/elementarytypes.hpp>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <vector>
+#include <cstring>
+
+/// \brief Growable array with thread safe appends and stable addresses.
+/// \details Memory is allocated in blocks of 2^BLOCK_BITS elements when an
+///		element of a new block is taken, so the memory follows the real
+///		number of elements. Elements never move and references stay valid
+///		while other threads append.
+class BlockPool
+{
+public:
+	static const uint32 BLOCK_BITS = 16;
+	static const uint32 BLOCK_SIZE = 1 << BLOCK_BITS;
+	/// Indices have 31 bits, the first bit is the leaf flag of the nodes.
+	static const uint32 MAX_BLOCKS = 1 << (31 - BLOCK_BITS);
+
+	explicit BlockPool( size_t _elementSize ) :
+		m_elementSize(_elementSize),
+		m_blocks(new std::atomic<char*>[MAX_BLOCKS]),
+		m_size(0)
+	{
+		for( uint32 b = 0; b < MAX_BLOCKS; ++b )
+			m_blocks[b] = nullptr;
+	}
+
+	~BlockPool()	{ Resize( 0 ); }
+
+	/// \brief Remove all elements and change the element size.
+	void Reset( size_t _elementSize )
+	{
+		Resize( 0 );
+		m_elementSize = _elementSize;
+	}
+
+	/// \brief Append one element. Thread safe.
+	/// \returns Index of the new (uninitialized) element.
+	uint32 Allocate()
+	{
+		uint32 index = m_size++;
+		ProvideBlock( index >> BLOCK_BITS );
+		return index;
+	}
+
+	/// \brief Make sure the element _index exists. Thread safe.
+	/// \details Used to keep a second pool in sync with the indices of
+	///		another one.
+	void AllocateAt( uint32 _index )
+	{
+		ProvideBlock( _index >> BLOCK_BITS );
+		uint32 size = m_size;
+		while( size <= _index && !m_size.compare_exchange_weak( size, _index + 1 ) ) {}
+	}
+
+	/// \brief Grow or shrink to _num elements. Blocks which are not needed
+	///		anymore are freed. Not thread safe.
+	void Resize( uint32 _num )
+	{
+		uint32 numBlocks = (_num + BLOCK_SIZE - 1) >> BLOCK_BITS;
+		for( uint32 b = 0; b < numBlocks; ++b )
+			ProvideBlock( b );
+		for( uint32 b = numBlocks; b < MAX_BLOCKS; ++b )
+			if( m_blocks[b] )
+			{
+				delete[] m_blocks[b].load();
+				m_blocks[b] = nullptr;
+			}
+		m_size = _num;
+	}
+
+	uint32 Size() const	{ return m_size; }
+	size_t ElementSize() const	{ return m_elementSize; }
+
+	void* operator[]( uint32 _index )	{ return m_blocks[_index >> BLOCK_BITS].load(std::memory_order_relaxed) + (_index & (BLOCK_SIZE - 1)) * m_elementSize; }
+	const void* operator[]( uint32 _index ) const	{ return m_blocks[_index >> BLOCK_BITS].load(std::memory_order_relaxed) + (_index & (BLOCK_SIZE - 1)) * m_elementSize; }
+
+	/// \brief Copy the elements [_first, _first + _num) to contiguous memory.
+	void Read( uint32 _first, uint32 _num, void* _target ) const
+	{
+		char* target = static_cast<char*>(_target);
+		while( _num > 0 )
+		{
+			uint32 count = std::min( _num, BLOCK_SIZE - (_first & (BLOCK_SIZE - 1)) );
+			memcpy( target, (*this)[_first], count * m_elementSize );
+			target += count * m_elementSize;
+			_first += count;
+			_num -= count;
+		}
+	}
+
+	/// \brief Overwrite the existing elements [_first, _first + _num).
+	void Write( uint32 _first, uint32 _num, const void* _source )
+	{
+		const char* source = static_cast<const char*>(_source);
+		while( _num > 0 )
+		{
+			uint32 count = std::min( _num, BLOCK_SIZE - (_first & (BLOCK_SIZE - 1)) );
+			memcpy( (*this)[_first], source, count * m_elementSize );
+			source += count * m_elementSize;
+			_first += count;
+			_num -= count;
+		}
+	}
+
+private:
+	size_t m_elementSize;
+	std::unique_ptr<std::atomic<char*>[]> m_blocks;
+	std::atomic<uint32> m_size;
+	std::mutex m_blockMutex;
+
+	void ProvideBlock( uint32 _block )
+	{
+		if( m_blocks[_block].load(std::memory_order_acquire) )
+			return;
+		std::lock_guard<std::mutex> lock( m_blockMutex );
+		if( !m_blocks[_block].load(std::memory_order_relaxed) )
+			m_blocks[_block].store( new char[BLOCK_SIZE * m_elementSize], std::memory_order_release );
+	}
+};
+
+/// \brief BlockPool with typed element access for plain data types.
+template<typename T>
+class Pool : public BlockPool
+{
+public:
+	Pool() : BlockPool(sizeof(T)) {}
+
+	T& operator[]( uint32 _index )	{ return *static_cast<T*>(BlockPool::operator[](_index)); }
+	const T& operator[]( uint32 _index ) const	{ return *static_cast<const T*>(BlockPool::operator[](_index)); }
+};
+
+/// \brief Stack like scratch memory of one thread for recursive builders.
+/// \details Memory is released with the Scope which allocated it and the
+///		blocks are kept, so a recursion stops allocating after the first
+///		descent. Each thread has its own arena (ForThread()).
+class ScratchArena
+{
+public:
+	static const size_t MIN_BLOCK_SIZE = 1 << 20;
+
+	/// \brief The arena of the calling thread.
+	static ScratchArena& ForThread()
+	{
+		static thread_local ScratchArena arena;
+		return arena;
+	}
+
+	/// \brief Release everything allocated through the scope on destruction.
+	class Scope
+	{
+	public:
+		Scope() :
+			m_arena(ForThread()),
+			m_block(m_arena.m_block),
+			m_offset(m_arena.m_offset)
+		{}
+
+		~Scope()
+		{
+			m_arena.m_block = m_block;
+			m_arena.m_offset = m_offset;
+		}
+
+		/// \brief Get memory for _num default constructed elements.
+		template<typename T>
+		T* Allocate( size_t _num )
+		{
+			static_assert(std::is_trivially_destructible<T>::value, "Scratch elements are never destructed.");
+			T* elements = static_cast<T*>(m_arena.Allocate( sizeof(T) * _num ));
+			for( size_t i = 0; i < _num; ++i )
+				new (elements + i) T;
+			return elements;
+		}
+
+	private:
+		ScratchArena& m_arena;
+		size_t m_block;
+		size_t m_offset;
+
+		Scope( const Scope& ) = delete;
+		void operator = ( const Scope& ) = delete;
+	};
+
+private:
+	struct Block
+	{
+		std::unique_ptr<char[]> memory;
+		size_t size;
+	};
+	std::vector<Block> m_blocks;
+	size_t m_block = 0;		///< Current block
+	size_t m_offset = 0;	///< First free byte in the current block
+
+	void* Allocate( size_t _size )
+	{
+		_size = (_size + 15) & ~size_t(15);
+		// Take the first following block which is large enough
+		while( m_block < m_blocks.size() && m_blocks[m_block].size - m_offset < _size )
+		{
+			++m_block;
+			m_offset = 0;
+		}
+		if( m_block == m_blocks.size() )
+		{
+			Block block;
+			block.size = _size > MIN_BLOCK_SIZE ? _size : MIN_BLOCK_SIZE;
+			block.memory.reset( new char[block.size] );
+			m_blocks.push_back( std::move(block) );
+		}
+		void* memory = m_blocks[m_block].memory.get() + m_offset;
+		m_offset += _size;
+		return memory;
+	}
+};
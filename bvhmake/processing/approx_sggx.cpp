@@ -1,4 +1,8 @@
 ﻿#include "approx_sggx.hpp"
+#include "../parallel.hpp"
+#include "../../gpugi/utilities/assert.hpp"
+#include <atomic>
+#include <memory>
 
 using namespace ε;
 
@@ -79,7 +83,27 @@ void CreateONB(const Vec3& n, Vec3& U, Vec3& V)
 }*/
 
 
-const int NORMAL_SAMPLES = 1000;
+// Number of normals per triangle to estimate the projected areas
+const int NORMAL_SAMPLES = 32;
+
+/// \brief Barycentric coordinates of a Halton sequence on a triangle.
+/// \details The table is the same for all triangles and computed once.
+struct NormalSampleTable
+{
+	Vec3 barycentric[NORMAL_SAMPLES];
+
+	NormalSampleTable()
+	{
+		for(int j = 0; j < NORMAL_SAMPLES; ++j)
+		{
+			float α = halton(2, j);
+			float β = halton(3, j);
+			if(α + β > 1.0f) { α = 1.0f - α; β = 1.0f - β; }
+			barycentric[j] = Vec3(α, β, 1.0f - α - β);
+		}
+	}
+};
+static const NormalSampleTable g_normalSamples;
 
 SGGX ComputeLeafSGGXBase(const BVHBuilder* _bvhBuilder, const FileDecl::Leaf& _leaf)
 {
@@ -96,60 +120,55 @@ SGGX ComputeLeafSGGXBase(const BVHBuilder* _bvhBuilder, const FileDecl::Leaf& _l
 		nrm[n*3 + 2] = _bvhBuilder->GetNormal( _leaf.triangles[n].vertices[2] );
 	}
 
-	// Sample random normals from all triangles and compute spherical distribution variances.
+	// Analytic second moments of the interpolated normals m = α n0 + β n1 + γ n2.
+	// For uniform barycentric coordinates E[α²] = 1/6 and E[αβ] = 1/12, which
+	// gives E[m m^T] = (Σ ni ni^T + (Σ ni)(Σ ni)^T) / 12. Each triangle is
+	// normalized by E[|m|²] to approximate the distribution of the normalized
+	// normals and weighted by its area.
 	Mat3x3 E(0.0f); // Expectations, later covariance matrix
-	float area = surface(pos[0]);
-	for(int i = 1; i < n; ++i) area += surface(pos[i]);
+	float area = 0.0f;
 	for(int i = 0; i < n; ++i)
 	{
-		// Get percentage of the total number of samples
-		int nsamples = int(NORMAL_SAMPLES * surface(pos[i]) / area);
-		for(int j = 0; j < nsamples; ++j)
+		const Vec3* tn = nrm + i*3;
+		Vec3 sum = tn[0] + tn[1] + tn[2];
+		float xx = sum.x * sum.x, xy = sum.x * sum.y, xz = sum.x * sum.z;
+		float yy = sum.y * sum.y, yz = sum.y * sum.z, zz = sum.z * sum.z;
+		for(int k = 0; k < 3; ++k)
 		{
-			// Create uniform barycentric sample
-			float α = halton(2, j);
-			float β = halton(3, j);
-			if(α + β > 1.0f) { α = 1.0f - α; β = 1.0f - β; }
-			float γ = 1.0f - α - β;
-			Vec3 normal = normalize(nrm[i*3] * α + nrm[i*3+1] * β + nrm[i*3+1] * γ);
-			E.m00 += normal.x * normal.x;
-			E.m01 += normal.x * normal.y;
-			E.m02 += normal.x * normal.z;
-			E.m11 += normal.y * normal.y;
-			E.m12 += normal.y * normal.z;
-			E.m22 += normal.z * normal.z;
+			xx += tn[k].x * tn[k].x; xy += tn[k].x * tn[k].y; xz += tn[k].x * tn[k].z;
+			yy += tn[k].y * tn[k].y; yz += tn[k].y * tn[k].z; zz += tn[k].z * tn[k].z;
 		}
+		float trace = xx + yy + zz;
+		float triangleArea = surface(pos[i]);
+		area += triangleArea;
+		if(trace <= 0.0f) continue;
+		float w = triangleArea / trace;
+		E.m00 += xx * w; E.m01 += xy * w; E.m02 += xz * w;
+		E.m11 += yy * w; E.m12 += yz * w; E.m22 += zz * w;
 	}
-	// Copy symmetric part of the matrix. Do not need to normalize by sample
-	// count because the scale (eigenvalues) are not of interest.
+	// Copy symmetric part of the matrix. Do not need to normalize by the area
+	// because the scale (eigenvalues) are not of interest.
 	E.m10 = E.m01; E.m20 = E.m02; E.m21 = E.m12;
 	// Get eigenvectors they are the same as for the SGGX base
 	Mat3x3 Q; Vec3 λ;
 	decomposeQl(E, Q, λ, true);
 
 	// Compute projected areas in the directions of eigenvectors using the same
-	// distribution as before.
+	// distribution as before (area weighted samples from the table).
 	λ = Vec3(0.0f);
-	int nTotalSamples = 0;
 	for(int i = 0; i < n; ++i)
 	{
-		// Get percentage of the total number of samples
-		int nsamples = int(NORMAL_SAMPLES * surface(pos[i]) / area);
-		nTotalSamples += nsamples;
-		for(int j = 0; j < nsamples; ++j)
+		float w = surface(pos[i]) / (area * NORMAL_SAMPLES);
+		for(int j = 0; j < NORMAL_SAMPLES; ++j)
 		{
-			// Create uniform barycentric sample
-			float α = halton(2, j);
-			float β = halton(3, j);
-			if(α + β > 1.0f) { α = 1.0f - α; β = 1.0f - β; }
-			float γ = 1.0f - α - β;
-			Vec3 normal = normalize(nrm[i*3] * α + nrm[i*3+1] * β + nrm[i*3+1] * γ);
-			λ[0] += abs(Q(0) * normal);
-			λ[1] += abs(Q(1) * normal);
-			λ[2] += abs(Q(2) * normal);
+			const Vec3& b = g_normalSamples.barycentric[j];
+			Vec3 normal = normalize(nrm[i*3] * b.x + nrm[i*3+1] * b.y + nrm[i*3+2] * b.z);
+			λ[0] += w * abs(Q(0) * normal);
+			λ[1] += w * abs(Q(1) * normal);
+			λ[2] += w * abs(Q(2) * normal);
 		}
 	}
-	λ /= nTotalSamples;// TODO: /4π ?
+	// TODO: /4π ?
 	E = transpose(Q) * diag(λ) * Q;
 	SGGX s;
 	s.xx = E.m00; s.xy = E.m01; s.xz = E.m02;
@@ -164,33 +183,11 @@ SGGX ComputeLeafSGGXBase(const BVHBuilder* _bvhBuilder, const FileDecl::Leaf& _l
 	return s;
 }
 
-SGGX RecursiveComputeSGGXBases(const BVHBuilder* _bvhBuilder, uint32 _index, std::vector<FileDecl::SGGX>& _output)
+// Store compressed form
+static void EncodeSGGX(const SGGX& _s, FileDecl::SGGX& _output)
 {
-	SGGX s;
-	// End of recursion (inner node which points to one leaf)
-	if(_bvhBuilder->GetNode(_index).left & 0x80000000)
-	{
-		s = ComputeLeafSGGXBase(_bvhBuilder, _bvhBuilder->GetLeaf(_bvhBuilder->GetNode(_index).left & 0x7fffffff));
-	} else {
-		s =  RecursiveComputeSGGXBases(_bvhBuilder, _bvhBuilder->GetNode(_index).left, _output);
-		SGGX s2 = RecursiveComputeSGGXBases(_bvhBuilder, _bvhBuilder->GetNode(_index).right, _output);
-		// Weight depending on subtree bounding volume sizes
-		auto fit = _bvhBuilder->GetFitMethod();
-		float lw = fit->Surface( _bvhBuilder->GetNode(_index).left );
-		float rw = fit->Surface( _bvhBuilder->GetNode(_index).right );
-		float wsum = lw + rw;
-		lw /= wsum; rw /= wsum;
-		s.xx = s.xx * lw + s2.xx * rw;
-		s.xy = s.xy * lw + s2.xy * rw;
-		s.xz = s.xz * lw + s2.xz * rw;
-		s.yy = s.yy * lw + s2.yy * rw;
-		s.yz = s.yz * lw + s2.yz * rw;
-		s.zz = s.zz * lw + s2.zz * rw;
-	}
-	// Store compressed form
-	_output[_index].σ = Vec<uint16, 3>(sqrt(Vec3(s.xx, s.yy, s.zz)) * 65535.0f);
-	_output[_index].r = Vec<uint16, 3>(Vec3(s.xy, s.xz, s.yz) / sqrt(Vec3(s.xx*s.yy, s.xx*s.zz, s.yy*s.zz)) * 32767.0f + 32767.0f);
-	return s;
+	_output.σ = Vec<uint16, 3>(sqrt(Vec3(_s.xx, _s.yy, _s.zz)) * 65535.0f);
+	_output.r = Vec<uint16, 3>(Vec3(_s.xy, _s.xz, _s.yz) / sqrt(Vec3(_s.xx*_s.yy, _s.xx*_s.zz, _s.yy*_s.zz)) * 32767.0f + 32767.0f);
 }
 
 void ComputeSGGXBases(const BVHBuilder* _bvhBuilder,
@@ -198,7 +195,49 @@ void ComputeSGGXBases(const BVHBuilder* _bvhBuilder,
 {
 	// The number of output nodes is known in advance.
 	// After resize writing is possible with random access.
-	_output.resize(_bvhBuilder->GetNumNodes());
+	uint32 numNodes = _bvhBuilder->GetNumNodes();
+	_output.resize(numNodes);
+	std::vector<SGGX> bases(numNodes);
 
-	RecursiveComputeSGGXBases(_bvhBuilder, 0, _output);
-}
\ No newline at end of file
+	std::vector<uint32> parents(numNodes, 0xffffffff);
+	std::vector<uint32> leafNodes;
+	for( uint32 i = 0; i < numNodes; ++i )
+	{
+		const BVHBuilder::Node& node = _bvhBuilder->GetNode(i);
+		if( node.left & 0x80000000 ) leafNodes.push_back(i);
+		else parents[node.left] = parents[node.right] = i;
+	}
+
+	// Leaves in parallel, the second thread arriving at an inner node
+	// combines the children.
+	auto fit = _bvhBuilder->GetFitMethod();
+	std::unique_ptr<std::atomic<uint32>[]> visits(new std::atomic<uint32>[numNodes]);
+	for( uint32 i = 0; i < numNodes; ++i ) visits[i] = 0;
+	ParallelFor((uint32)leafNodes.size(), [&](uint32 i) {
+		uint32 nodeIdx = leafNodes[i];
+		bases[nodeIdx] = ComputeLeafSGGXBase(_bvhBuilder, _bvhBuilder->GetLeaf(_bvhBuilder->GetNode(nodeIdx).left & 0x7fffffff));
+		EncodeSGGX(bases[nodeIdx], _output[nodeIdx]);
+
+		uint32 parent = parents[nodeIdx];
+		while( parent != 0xffffffff && visits[parent]++ == 1 )
+		{
+			const BVHBuilder::Node& node = _bvhBuilder->GetNode(parent);
+			const SGGX& s1 = bases[node.left];
+			const SGGX& s2 = bases[node.right];
+			// Weight depending on subtree bounding volume sizes
+			float lw = fit->Surface( node.left );
+			float rw = fit->Surface( node.right );
+			float wsum = lw + rw;
+			lw /= wsum; rw /= wsum;
+			SGGX& s = bases[parent];
+			s.xx = s1.xx * lw + s2.xx * rw;
+			s.xy = s1.xy * lw + s2.xy * rw;
+			s.xz = s1.xz * lw + s2.xz * rw;
+			s.yy = s1.yy * lw + s2.yy * rw;
+			s.yz = s1.yz * lw + s2.yz * rw;
+			s.zz = s1.zz * lw + s2.zz * rw;
+			EncodeSGGX(s, _output[parent]);
+			parent = parents[parent];
+		}
+	}, 64);
+}
@@ -0,0 +1,341 @@
+﻿#include "dynamic.hpp"
+#include "../../gpugi/utilities/assert.hpp"
+#include <queue>
+
+using namespace ε;
+
+static bool IsLeafNode( const BVHBuilder::Node& _node )
+{
+	return (_node.left & 0x80000000) != 0;
+}
+
+static uint32 CountTriangles( const FileDecl::Leaf& _leaf )
+{
+	uint32 count = 0;
+	while( count < FileDecl::Leaf::NUM_PRIMITIVES && FileDecl::IsTriangleValid(_leaf.triangles[count]) )
+		++count;
+	return count;
+}
+
+// Replace the child _old of _parent by _new
+static void ReplaceChild( BVHBuilder::Node& _parent, uint32 _old, uint32 _new )
+{
+	if( _parent.left == _old ) _parent.left = _new;
+	else _parent.right = _new;
+}
+
+TriangleKey::TriangleKey( const FileDecl::Triangle& _triangle )
+{
+	vertices[0] = _triangle.vertices[0];
+	vertices[1] = _triangle.vertices[1];
+	vertices[2] = _triangle.vertices[2];
+}
+
+bool TriangleKey::operator == (const TriangleKey& _rhs) const
+{
+	return vertices[0] == _rhs.vertices[0] && vertices[1] == _rhs.vertices[1] && vertices[2] == _rhs.vertices[2];
+}
+
+size_t std::hash<TriangleKey>::operator()(const TriangleKey& _x) const
+{
+	uint64 h = 14695981039346656037ull;
+	for( int i = 0; i < 3; ++i )
+		h = (h ^ _x.vertices[i]) * 1099511628211ull;
+	h ^= h >> 33;
+	return size_t(h);
+}
+
+const uint32 DynamicUpdates::INVALID;
+
+DynamicUpdates::DynamicUpdates( BVHBuilder* _builder ) :
+	m_builder(_builder),
+	m_root(0)
+{
+	uint32 numNodes = _builder->GetNumNodes();
+	m_parents.assign( numNodes, INVALID );
+	m_boxes.resize( numNodes );
+	m_dirty.assign( numNodes, false );
+	m_leafNodes.assign( _builder->GetNumLeaves(), INVALID );
+	for( uint32 i = 0; i < numNodes; ++i )
+	{
+		const BVHBuilder::Node& node = _builder->GetNode(i);
+		if( IsLeafNode(node) )
+		{
+			uint32 leaf = node.left & 0x7fffffff;
+			m_leafNodes[leaf] = i;
+			const FileDecl::Leaf& triangles = _builder->GetLeaf(leaf);
+			for( uint32 t = 0; t < CountTriangles(triangles); ++t )
+				m_triangleLeaves.emplace( TriangleKey(triangles.triangles[t]), leaf );
+		} else
+			m_parents[node.left] = m_parents[node.right] = i;
+	}
+
+	// Children come after their parents in preorder
+	for( uint32 i = numNodes; i-- > 0; )
+	{
+		const BVHBuilder::Node& node = _builder->GetNode(i);
+		if( IsLeafNode(node) )
+		{
+			const FileDecl::Leaf& leaf = _builder->GetLeaf(node.left & 0x7fffffff);
+			m_boxes[i] = Box(_builder->GetTriangle(leaf.triangles[0]));
+			for( uint32 t = 1; t < CountTriangles(leaf); ++t )
+				m_boxes[i] = Box(m_boxes[i], Box(_builder->GetTriangle(leaf.triangles[t])));
+		} else
+			m_boxes[i] = Box(m_boxes[node.left], m_boxes[node.right]);
+	}
+}
+
+uint32 DynamicUpdates::NewNode()
+{
+	uint32 index;
+	if( !m_freeNodes.empty() )
+	{
+		index = m_freeNodes.back();
+		m_freeNodes.pop_back();
+	} else {
+		index = m_builder->GetNewNode();
+		m_parents.resize( index + 1, INVALID );
+		m_boxes.resize( index + 1 );
+		m_dirty.resize( index + 1, false );
+	}
+	return index;
+}
+
+uint32 DynamicUpdates::NewLeaf()
+{
+	uint32 index;
+	if( !m_freeLeaves.empty() )
+	{
+		index = m_freeLeaves.back();
+		m_freeLeaves.pop_back();
+	} else {
+		index = m_builder->GetNewLeaf();
+		m_leafNodes.resize( index + 1, INVALID );
+	}
+	FileDecl::Leaf& leaf = m_builder->GetLeaf(index);
+	for( uint32 i = 0; i < FileDecl::Leaf::NUM_PRIMITIVES; ++i )
+		leaf.triangles[i] = FileDecl::INVALID_TRIANGLE;
+	return index;
+}
+
+uint32 DynamicUpdates::FindBestSibling( const Box& _box ) const
+{
+	// The cost of a sibling is the surface of the new parent plus the
+	// increase of all ancestors. The increase inherited from the ancestors
+	// plus the surface of the new box is a lower bound for the subtree.
+	float newSurface = surface(_box);
+	uint32 best = m_root;
+	float bestCost = surface(Box(m_boxes[m_root], _box));
+	typedef std::pair<float, uint32> Candidate;
+	std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> queue;
+	queue.push( Candidate(0.0f, m_root) );
+	while( !queue.empty() )
+	{
+		Candidate candidate = queue.top(); queue.pop();
+		if( candidate.first + newSurface >= bestCost )
+			break;
+		uint32 index = candidate.second;
+		float direct = surface(Box(m_boxes[index], _box));
+		if( direct + candidate.first < bestCost )
+		{
+			best = index;
+			bestCost = direct + candidate.first;
+		}
+		const BVHBuilder::Node& node = m_builder->GetNode(index);
+		float inherited = candidate.first + direct - surface(m_boxes[index]);
+		if( !IsLeafNode(node) && inherited + newSurface < bestCost )
+		{
+			queue.push( Candidate(inherited, node.left) );
+			queue.push( Candidate(inherited, node.right) );
+		}
+	}
+	return best;
+}
+
+void DynamicUpdates::UpdateBox( uint32 _node )
+{
+	const BVHBuilder::Node& node = m_builder->GetNode(_node);
+	if( IsLeafNode(node) )
+	{
+		const FileDecl::Leaf& leaf = m_builder->GetLeaf(node.left & 0x7fffffff);
+		m_boxes[_node] = Box(m_builder->GetTriangle(leaf.triangles[0]));
+		for( uint32 t = 1; t < CountTriangles(leaf); ++t )
+			m_boxes[_node] = Box(m_boxes[_node], Box(m_builder->GetTriangle(leaf.triangles[t])));
+	} else
+		m_boxes[_node] = Box(m_boxes[node.left], m_boxes[node.right]);
+	m_dirty[_node] = true;
+}
+
+void DynamicUpdates::FitBoundingVolumes()
+{
+	// Children before parents. All ancestors of a changed node are changed
+	// too, so the walk can stop at unchanged subtrees.
+	std::vector<std::pair<uint32, bool>> stack;
+	if( m_dirty[m_root] )
+		stack.push_back( std::make_pair(m_root, false) );
+	while( !stack.empty() )
+	{
+		uint32 index = stack.back().first;
+		const BVHBuilder::Node& node = m_builder->GetNode(index);
+		if( !IsLeafNode(node) && !stack.back().second )
+		{
+			stack.back().second = true;
+			if( m_dirty[node.left] ) stack.push_back( std::make_pair(node.left, false) );
+			if( m_dirty[node.right] ) stack.push_back( std::make_pair(node.right, false) );
+			continue;
+		}
+		stack.pop_back();
+		if( IsLeafNode(node) )
+		{
+			FileDecl::Leaf& leaf = m_builder->GetLeaf(node.left & 0x7fffffff);
+			(*m_builder->GetFitMethod())( leaf.triangles, CountTriangles(leaf), index );
+		} else
+			(*m_builder->GetFitMethod())( node.left, node.right, index );
+		m_dirty[index] = false;
+	}
+}
+
+void DynamicUpdates::Rotate( uint32 _node )
+{
+	// Try to swap each child with each child of its sibling. Only the
+	// surface of the sibling changes.
+	uint32 bestChild = INVALID, bestGrandchild = INVALID, bestSibling = INVALID;
+	float bestGain = 0.0f;
+	const BVHBuilder::Node& node = m_builder->GetNode(_node);
+	uint32 children[2] = {node.left, node.right};
+	for( int c = 0; c < 2; ++c )
+	{
+		uint32 sibling = children[1-c];
+		const BVHBuilder::Node& siblingNode = m_builder->GetNode(sibling);
+		if( IsLeafNode(siblingNode) ) continue;
+		float siblingSurface = surface(m_boxes[sibling]);
+		float gainLeft = siblingSurface - surface(Box(m_boxes[children[c]], m_boxes[siblingNode.right]));
+		float gainRight = siblingSurface - surface(Box(m_boxes[children[c]], m_boxes[siblingNode.left]));
+		if( gainLeft > bestGain )
+		{
+			bestGain = gainLeft;
+			bestChild = children[c]; bestGrandchild = siblingNode.left; bestSibling = sibling;
+		}
+		if( gainRight > bestGain )
+		{
+			bestGain = gainRight;
+			bestChild = children[c]; bestGrandchild = siblingNode.right; bestSibling = sibling;
+		}
+	}
+	if( bestChild == INVALID )
+		return;
+
+	ReplaceChild( m_builder->GetNode(_node), bestChild, bestGrandchild );
+	ReplaceChild( m_builder->GetNode(bestSibling), bestGrandchild, bestChild );
+	m_parents[bestGrandchild] = _node;
+	m_parents[bestChild] = bestSibling;
+	UpdateBox( bestSibling );
+}
+
+void DynamicUpdates::RefitAncestors( uint32 _node )
+{
+	for( uint32 index = _node; index != INVALID; index = m_parents[index] )
+	{
+		if( !IsLeafNode(m_builder->GetNode(index)) )
+			Rotate( index );
+		UpdateBox( index );
+	}
+}
+
+void DynamicUpdates::Insert( const FileDecl::Triangle& _triangle )
+{
+	uint32 sibling = FindBestSibling( Box(m_builder->GetTriangle(_triangle)) );
+
+	// Fill up the sibling if it is a leaf with a free slot
+	if( IsLeafNode(m_builder->GetNode(sibling)) )
+	{
+		uint32 leaf = m_builder->GetNode(sibling).left & 0x7fffffff;
+		uint32 count = CountTriangles(m_builder->GetLeaf(leaf));
+		if( count < FileDecl::Leaf::NUM_PRIMITIVES )
+		{
+			m_builder->GetLeaf(leaf).triangles[count] = _triangle;
+			m_triangleLeaves.emplace( TriangleKey(_triangle), leaf );
+			RefitAncestors( sibling );
+			return;
+		}
+	}
+
+	// Otherwise create a new leaf and a new parent for both
+	uint32 leaf = NewLeaf();
+	m_builder->GetLeaf(leaf).triangles[0] = _triangle;
+	m_triangleLeaves.emplace( TriangleKey(_triangle), leaf );
+	uint32 leafNode = NewNode();
+	m_builder->GetNode(leafNode).left = 0x80000000 | leaf;
+	m_builder->GetNode(leafNode).right = 0;
+	m_leafNodes[leaf] = leafNode;
+	uint32 parent = NewNode();
+	m_builder->GetNode(parent).left = sibling;
+	m_builder->GetNode(parent).right = leafNode;
+
+	uint32 oldParent = m_parents[sibling];
+	if( oldParent == INVALID )
+		m_root = parent;
+	else
+		ReplaceChild( m_builder->GetNode(oldParent), sibling, parent );
+	m_parents[parent] = oldParent;
+	m_parents[sibling] = m_parents[leafNode] = parent;
+	UpdateBox( leafNode );
+	RefitAncestors( parent );
+}
+
+bool DynamicUpdates::Remove( const FileDecl::Triangle& _triangle )
+{
+	// Spatial splits reference a triangle from several leaves. The tree must
+	// keep at least one triangle.
+	TriangleKey key(_triangle);
+	size_t numReferences = m_triangleLeaves.count( key );
+	if( numReferences == 0 || numReferences == m_triangleLeaves.size() )
+		return false;
+
+	for( auto it = m_triangleLeaves.find( key ); it != m_triangleLeaves.end(); it = m_triangleLeaves.find( key ) )
+	{
+		uint32 leaf = it->second;
+		m_triangleLeaves.erase( it );
+		RemoveFromLeaf( leaf, key );
+	}
+	return true;
+}
+
+void DynamicUpdates::RemoveFromLeaf( uint32 _leaf, const TriangleKey& _key )
+{
+	uint32 node = m_leafNodes[_leaf];
+	FileDecl::Leaf& triangles = m_builder->GetLeaf(_leaf);
+	uint32 count = CountTriangles(triangles);
+
+	// Keep the valid triangles at the front
+	uint32 slot = 0;
+	while( slot < count && !(TriangleKey(triangles.triangles[slot]) == _key) )
+		++slot;
+	Assert( slot < count, "Triangle is not in its leaf!" );
+	triangles.triangles[slot] = triangles.triangles[count - 1];
+	triangles.triangles[count - 1] = FileDecl::INVALID_TRIANGLE;
+	if( count > 1 )
+	{
+		RefitAncestors( node );
+		return;
+	}
+
+	// The leaf is empty, its sibling replaces the parent. Remove() never
+	// empties the root.
+	uint32 parent = m_parents[node];
+	const BVHBuilder::Node& parentNode = m_builder->GetNode(parent);
+	uint32 sibling = parentNode.left == node ? parentNode.right : parentNode.left;
+	uint32 grandparent = m_parents[parent];
+	if( grandparent == INVALID )
+		m_root = sibling;
+	else
+		ReplaceChild( m_builder->GetNode(grandparent), parent, sibling );
+	m_parents[sibling] = grandparent;
+	m_parents[node] = m_parents[parent] = INVALID;
+	m_leafNodes[_leaf] = INVALID;
+	m_freeNodes.push_back( node );
+	m_freeNodes.push_back( parent );
+	m_freeLeaves.push_back( _leaf );
+	if( grandparent != INVALID )
+		RefitAncestors( grandparent );
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "bvhmake.hpp"
+#include <vector>
+
+/// \brief Key of a triangle by its vertex indices for the removal lookup.
+struct TriangleKey
+{
+	uint32 vertices[3];
+
+	explicit TriangleKey( const FileDecl::Triangle& _triangle );
+	bool operator == (const TriangleKey& _rhs) const;
+};
+namespace std {
+	template <> struct hash<TriangleKey>
+	{
+		size_t operator()(const TriangleKey& _x) const;
+	};
+}
+
+/// \brief Insert and remove single triangles of a finished hierarchy.
+/// \details Insertion searches the sibling with the smallest SAH cost by
+///		branch and bound (Bittner et al. 2012). The triangle is appended to
+///		that leaf if it has a free slot, otherwise it gets a new leaf next
+///		to it. Removed triangles are swapped with the last one of their leaf
+///		and empty leaves are dropped together with their parent. All
+///		ancestors of a change are refitted and rotated (a child swapped with
+///		a grandchild) if this reduces the surface area. Only the boxes are
+///		updated immediately, the bounding volumes of the fit method are
+///		computed for all changed nodes at once by FitBoundingVolumes().
+///		Freed nodes and leaves are reused, so the indices are not in
+///		preorder anymore. The builder compacts the tree before the export.
+class DynamicUpdates
+{
+public:
+	/// \brief Compute the parents and boxes of the current tree (preorder
+	///		with the root at 0).
+	DynamicUpdates( BVHBuilder* _builder );
+
+	/// \brief Add a triangle. Up to two inner nodes and one leaf are taken
+	///		from the freed ones or appended to the builder.
+	void Insert( const FileDecl::Triangle& _triangle );
+
+	/// \brief Remove all references to triangles with the same vertex indices.
+	/// \returns false if the triangle is not in the tree or nothing else is.
+	///		Otherwise all references are removed.
+	bool Remove( const FileDecl::Triangle& _triangle );
+
+	/// \brief Compute the bounding volumes of all nodes changed since the
+	///		last call with the fit method of the builder.
+	void FitBoundingVolumes();
+
+	uint32 GetRoot() const { return m_root; }
+
+private:
+	static const uint32 INVALID = 0xffffffff;
+
+	BVHBuilder* m_builder;
+	uint32 m_root;
+	std::vector<uint32> m_parents;		///< Per node, INVALID for the root
+	std::vector<ε::Box> m_boxes;		///< Per node, used for the heuristic independent of the fit method
+	std::vector<bool> m_dirty;			///< Per node, bounding volume must be fitted again
+	std::vector<uint32> m_leafNodes;	///< Node which references a leaf
+	std::vector<uint32> m_freeNodes;
+	std::vector<uint32> m_freeLeaves;
+	std::unordered_multimap<TriangleKey, uint32> m_triangleLeaves;
+
+	uint32 NewNode();
+	uint32 NewLeaf();
+
+	/// \brief Find the node with the smallest cost to become the sibling of _box.
+	uint32 FindBestSibling( const ε::Box& _box ) const;
+
+	/// \brief Recompute the boxes from _node to the root and rotate each
+	///		inner node on the way.
+	void RefitAncestors( uint32 _node );
+
+	/// \brief Remove one reference from a leaf. Empty leaves are dropped
+	///		together with their parent.
+	void RemoveFromLeaf( uint32 _leaf, const TriangleKey& _key );
+
+	/// \brief Swap a child with a grandchild if this reduces the surface area.
+	void Rotate( uint32 _node );
+
+	/// \brief Box of a single node from its children or triangles.
+	void UpdateBox( uint32 _node );
+};
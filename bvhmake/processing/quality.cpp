@@ -0,0 +1,305 @@
+﻿#include "quality.hpp"
+#include "widebvh.hpp"
+#include "../parallel.hpp"
+#include "../../gpugi/utilities/assert.hpp"
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <cmath>
+
+using namespace ε;
+
+// Relative cost of a triangle test (see COST_INNER)
+const float COST_TRIANGLE = 1.0f;
+
+static bool IsLeafNode( const BVHBuilder::Node& _node )
+{
+	return (_node.left & 0x80000000) != 0;
+}
+
+static uint32 GetLeafTriangleCount( const FileDecl::Leaf& _leaf )
+{
+	uint32 count = 1;
+	while( count < FileDecl::Leaf::NUM_PRIMITIVES && IsTriangleValid(_leaf.triangles[count]) )
+		++count;
+	return count;
+}
+
+static float NodeSurface( const BVHBuilder* _bvhBuilder, uint32 _index )
+{
+	switch(_bvhBuilder->GetFitMethod()->Type())
+	{
+	case FitMethod::BVType::AABOX: return surface(_bvhBuilder->GetBoundingVolume<Box>(_index));
+	case FitMethod::BVType::SPHERE: return surface(_bvhBuilder->GetBoundingVolume<Sphere>(_index));
+	case FitMethod::BVType::AAELLIPSOID: return surface(_bvhBuilder->GetBoundingVolume<Ellipsoid>(_index));
+	case FitMethod::BVType::OBOX: return surface(_bvhBuilder->GetBoundingVolume<OBox>(_index));
+	default: Assert( false, "Unknown bounding volume type!" ); return 0.0f;
+	}
+}
+
+static bool Overlaps( const Box& _a, const Box& _b )
+{
+	return all(_a.min <= _b.max) && all(_b.min <= _a.max);
+}
+
+// Volume of the intersection of two boxes (0 if disjoint)
+static float OverlapVolume( const Box& _a, const Box& _b )
+{
+	Vec3 lo = max(_a.min, _b.min);
+	Vec3 hi = min(_a.max, _b.max);
+	if( !all(lo <= hi) ) return 0.0f;
+	return (hi.x - lo.x) * (hi.y - lo.y) * (hi.z - lo.z);
+}
+
+// Area of the part of a triangle inside a box (Sutherland-Hodgman clipping
+// against the six planes).
+static float ClippedArea( const Triangle& _triangle, const Box& _box )
+{
+	Vec3 poly[9], clipped[9];
+	int n = 3;
+	poly[0] = _triangle.v0; poly[1] = _triangle.v1; poly[2] = _triangle.v2;
+	for( int plane = 0; plane < 6 && n > 0; ++plane )
+	{
+		int dim = plane % 3;
+		float sign = plane < 3 ? 1.0f : -1.0f;
+		float bound = plane < 3 ? _box.min[dim] : _box.max[dim];
+		int m = 0;
+		for( int i = 0; i < n; ++i )
+		{
+			const Vec3& a = poly[i];
+			const Vec3& b = poly[(i + 1) % n];
+			float da = sign * (a[dim] - bound);
+			float db = sign * (b[dim] - bound);
+			if( da >= 0.0f ) clipped[m++] = a;
+			if( (da >= 0.0f) != (db >= 0.0f) )
+				clipped[m++] = a + (b - a) * (da / (da - db));
+		}
+		n = m;
+		for( int i = 0; i < n; ++i ) poly[i] = clipped[i];
+	}
+	Vec3 areaVec(0.0f);
+	for( int i = 2; i < n; ++i )
+		areaVec += cross(poly[i-1] - poly[0], poly[i] - poly[0]);
+	return len(areaVec) * 0.5f;
+}
+
+// Slab test. Returns the entry distance or -1 if the box is missed.
+static float IntersectBox( const Vec3& _origin, const Vec3& _invDir, const Box& _box, float _maxDist )
+{
+	float tmin = 0.0f, tmax = _maxDist;
+	for( int d = 0; d < 3; ++d )
+	{
+		float t0 = (_box.min[d] - _origin[d]) * _invDir[d];
+		float t1 = (_box.max[d] - _origin[d]) * _invDir[d];
+		if( t0 > t1 ) std::swap(t0, t1);
+		tmin = t0 > tmin ? t0 : tmin;
+		tmax = t1 < tmax ? t1 : tmax;
+	}
+	return tmin <= tmax ? tmin : -1.0f;
+}
+
+// Moeller-Trumbore. Returns the hit distance or -1.
+static float IntersectTriangle( const Vec3& _origin, const Vec3& _dir, const Triangle& _triangle )
+{
+	Vec3 e1 = _triangle.v1 - _triangle.v0;
+	Vec3 e2 = _triangle.v2 - _triangle.v0;
+	Vec3 p = cross(_dir, e2);
+	float det = dot(e1, p);
+	if( std::abs(det) < 1e-12f ) return -1.0f;
+	Vec3 s = _origin - _triangle.v0;
+	float u = dot(s, p) / det;
+	if( u < 0.0f || u > 1.0f ) return -1.0f;
+	Vec3 q = cross(s, e1);
+	float v = dot(_dir, q) / det;
+	if( v < 0.0f || u + v > 1.0f ) return -1.0f;
+	return dot(e2, q) / det;
+}
+
+bool WriteQualityReport(const BVHBuilder* _bvhBuilder, const std::string& _fileName,
+	const std::string& _buildMethod, const std::string& _fitMethod, uint32 _numRays)
+{
+	uint32 numNodes = _bvhBuilder->GetNumNodes();
+	std::vector<Box> boxes;
+	ComputeNodeBoxes( _bvhBuilder, boxes );
+
+	// Subtree of node i is [i, subtreeEnd[i]) in preorder. Also get depths,
+	// histograms, SAH and sibling overlap in one pass.
+	std::vector<uint32> subtreeEnd(numNodes);
+	std::vector<uint32> depth(numNodes, 0);
+	std::vector<uint32> leafFill(FileDecl::Leaf::NUM_PRIMITIVES + 1, 0);
+	std::vector<uint32> depthHistogram;
+	uint32 numLeaves = 0, numReferences = 0;
+	double sah = 0.0, siblingOverlap = 0.0;
+	for( uint32 i = 0; i < numNodes; ++i )
+	{
+		const BVHBuilder::Node& node = _bvhBuilder->GetNode(i);
+		if( IsLeafNode(node) )
+		{
+			uint32 count = GetLeafTriangleCount(_bvhBuilder->GetLeaf(node.left & 0x7fffffff));
+			++leafFill[count];
+			++numLeaves;
+			numReferences += count;
+			if( depthHistogram.size() <= depth[i] ) depthHistogram.resize(depth[i] + 1, 0);
+			++depthHistogram[depth[i]];
+			sah += COST_TRIANGLE * count * NodeSurface(_bvhBuilder, i);
+		} else {
+			depth[node.left] = depth[node.right] = depth[i] + 1;
+			sah += COST_INNER * NodeSurface(_bvhBuilder, i);
+			siblingOverlap += OverlapVolume(boxes[node.left], boxes[node.right]);
+		}
+	}
+	for( uint32 i = numNodes; i-- > 0; )
+	{
+		const BVHBuilder::Node& node = _bvhBuilder->GetNode(i);
+		subtreeEnd[i] = IsLeafNode(node) ? i + 1 : subtreeEnd[node.right];
+	}
+	sah /= NodeSurface(_bvhBuilder, 0);
+	Vec3 rootSize = boxes[0].max - boxes[0].min;
+	double rootVolume = rootSize.x * rootSize.y * rootSize.z;
+
+	// EPO (Aila et al. 2013): the cost weighted area of the triangles which
+	// intersect a node's box without belonging to its subtree. References of
+	// split triangles count separately.
+	std::vector<double> epoPerThread(GetNumThreads(), 0.0);
+	std::vector<double> areaPerThread(GetNumThreads(), 0.0);
+	ParallelRange( numNodes, [&](uint32 _thread, uint32 _begin, uint32 _end)
+	{
+		std::vector<uint32> stack;
+		for( uint32 n = _begin; n < _end; ++n )
+		{
+			const BVHBuilder::Node& node = _bvhBuilder->GetNode(n);
+			float weight = COST_INNER;
+			if( IsLeafNode(node) )
+			{
+				const FileDecl::Leaf& leaf = _bvhBuilder->GetLeaf(node.left & 0x7fffffff);
+				uint32 count = GetLeafTriangleCount(leaf);
+				weight = COST_TRIANGLE * count;
+				for( uint32 t = 0; t < count; ++t )
+					areaPerThread[_thread] += surface(_bvhBuilder->GetTriangle(leaf.triangles[t]));
+			}
+			double outsideArea = 0.0;
+			stack.push_back(0);
+			while( !stack.empty() )
+			{
+				uint32 m = stack.back(); stack.pop_back();
+				if( m >= n && m < subtreeEnd[n] ) continue;
+				if( !Overlaps(boxes[m], boxes[n]) ) continue;
+				const BVHBuilder::Node& other = _bvhBuilder->GetNode(m);
+				if( IsLeafNode(other) )
+				{
+					const FileDecl::Leaf& leaf = _bvhBuilder->GetLeaf(other.left & 0x7fffffff);
+					uint32 count = GetLeafTriangleCount(leaf);
+					for( uint32 t = 0; t < count; ++t )
+						outsideArea += ClippedArea(_bvhBuilder->GetTriangle(leaf.triangles[t]), boxes[n]);
+				} else {
+					stack.push_back(other.left);
+					stack.push_back(other.right);
+				}
+			}
+			epoPerThread[_thread] += weight * outsideArea;
+		}
+	}, 64 );
+	double epo = 0.0, totalArea = 0.0;
+	for( size_t t = 0; t < epoPerThread.size(); ++t )
+	{
+		epo += epoPerThread[t];
+		totalArea += areaPerThread[t];
+	}
+	epo = totalArea > 0.0 ? epo / totalArea : 0.0;
+
+	// Closest hit traversal of random rays between two points on the
+	// bounding sphere of the scene. Near children are visited first.
+	std::vector<uint64> nodeStepsPerThread(GetNumThreads(), 0);
+	std::vector<uint64> triangleTestsPerThread(GetNumThreads(), 0);
+	std::vector<uint32> hitsPerThread(GetNumThreads(), 0);
+	Vec3 center = (boxes[0].min + boxes[0].max) * 0.5f;
+	float radius = len(rootSize) * 0.5f;
+	ParallelRange( _numRays, [&](uint32 _thread, uint32 _begin, uint32 _end)
+	{
+		std::mt19937 rng(_begin);
+		std::normal_distribution<float> normal;
+		std::vector<uint32> stack;
+		for( uint32 r = _begin; r < _end; ++r )
+		{
+			Vec3 a(normal(rng), normal(rng), normal(rng));
+			Vec3 b(normal(rng), normal(rng), normal(rng));
+			Vec3 origin = center + normalize(a) * radius;
+			Vec3 dir = center + normalize(b) * radius - origin;
+			float maxDist = len(dir);
+			if( maxDist <= 0.0f ) continue;
+			dir /= maxDist;
+			Vec3 invDir(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+			float closest = maxDist;
+			bool hit = false;
+			stack.push_back(0);
+			while( !stack.empty() )
+			{
+				uint32 n = stack.back(); stack.pop_back();
+				++nodeStepsPerThread[_thread];
+				if( IntersectBox(origin, invDir, boxes[n], closest) < 0.0f ) continue;
+				const BVHBuilder::Node& node = _bvhBuilder->GetNode(n);
+				if( IsLeafNode(node) )
+				{
+					const FileDecl::Leaf& leaf = _bvhBuilder->GetLeaf(node.left & 0x7fffffff);
+					uint32 count = GetLeafTriangleCount(leaf);
+					triangleTestsPerThread[_thread] += count;
+					for( uint32 t = 0; t < count; ++t )
+					{
+						float d = IntersectTriangle(origin, dir, _bvhBuilder->GetTriangle(leaf.triangles[t]));
+						if( d >= 0.0f && d < closest ) { closest = d; hit = true; }
+					}
+				} else {
+					float dl = IntersectBox(origin, invDir, boxes[node.left], closest);
+					float dr = IntersectBox(origin, invDir, boxes[node.right], closest);
+					// Push the far child first
+					if( dl > dr ) { stack.push_back(node.left); stack.push_back(node.right); }
+					else { stack.push_back(node.right); stack.push_back(node.left); }
+				}
+			}
+			if( hit ) ++hitsPerThread[_thread];
+		}
+	}, 256 );
+	uint64 nodeSteps = 0, triangleTests = 0;
+	uint32 hits = 0;
+	for( size_t t = 0; t < nodeStepsPerThread.size(); ++t )
+	{
+		nodeSteps += nodeStepsPerThread[t];
+		triangleTests += triangleTestsPerThread[t];
+		hits += hitsPerThread[t];
+	}
+	double invNumRays = _numRays > 0 ? 1.0 / _numRays : 0.0;
+
+	std::ofstream file( _fileName );
+	if( !file ) return false;
+	file << "{\n";
+	file << "\t\"build_method\": \"" << _buildMethod << "\",\n";
+	file << "\t\"fit_method\": \"" << _fitMethod << "\",\n";
+	file << "\t\"triangles\": " << _bvhBuilder->GetTriangleCount() << ",\n";
+	file << "\t\"triangle_references\": " << numReferences << ",\n";
+	file << "\t\"nodes\": " << numNodes << ",\n";
+	file << "\t\"leaves\": " << numLeaves << ",\n";
+	file << "\t\"sah_cost\": " << sah << ",\n";
+	file << "\t\"epo\": " << epo << ",\n";
+	file << "\t\"sibling_overlap_volume\": " << siblingOverlap << ",\n";
+	file << "\t\"sibling_overlap_relative\": " << (rootVolume > 0.0 ? siblingOverlap / rootVolume : 0.0) << ",\n";
+	file << "\t\"leaf_fill_histogram\": [";
+	for( uint32 i = 1; i < leafFill.size(); ++i )
+		file << leafFill[i] << (i + 1 < leafFill.size() ? ", " : "");
+	file << "],\n";
+	file << "\t\"leaf_depth_histogram\": [";
+	for( size_t i = 0; i < depthHistogram.size(); ++i )
+		file << depthHistogram[i] << (i + 1 < depthHistogram.size() ? ", " : "");
+	file << "],\n";
+	file << "\t\"random_rays\": {\n";
+	file << "\t\t\"count\": " << _numRays << ",\n";
+	file << "\t\t\"hit_ratio\": " << hits * invNumRays << ",\n";
+	file << "\t\t\"node_steps\": " << nodeSteps * invNumRays << ",\n";
+	file << "\t\t\"triangle_tests\": " << triangleTests * invNumRays << "\n";
+	file << "\t}\n";
+	file << "}\n";
+
+	std::cerr << "  SAH cost " << sah << ", EPO " << epo << ", " << nodeSteps * invNumRays
+		<< " nodes and " << triangleTests * invNumRays << " triangles per random ray.\n";
+	return true;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "bvhmake.hpp"
+
+#include <string>
+
+/// \brief SAH cost of an inner node relative to a triangle test. Shared by
+///		the report and the treelet optimization (treelet.cpp).
+const float COST_INNER = 1.2f;
+
+/// \brief Analyze the finished hierarchy and write the results as JSON.
+/// \details The report contains the SAH cost (with the bounding volumes of
+///		the current fit method), the end-point overlap (EPO) and the sibling
+///		overlap volume of the node boxes, histograms of the leaf fill and
+///		the leaf depths and the average number of traversal steps for
+///		random rays through the scene.
+///		Expects the nodes in preorder.
+/// \param [in] _buildMethod Name of the build method for the report.
+/// \param [in] _fitMethod Name of the fit method for the report.
+/// \param [in] _numRays Number of random rays to estimate traversal steps.
+/// \returns false if the file could not be written.
+bool WriteQualityReport(const BVHBuilder* _bvhBuilder, const std::string& _fileName,
+	const std::string& _buildMethod, const std::string& _fitMethod, uint32 _numRays);
@@ -1,5 +1,7 @@
 ﻿#include "tesselate.hpp"
 #include "bvhmake.hpp"
+#include "../parallel.hpp"
+#include <unordered_map>
 
 void TesselateNone(const FileDecl::Triangle& _triangle, BVHBuilder* _manager)
 {
@@ -17,91 +19,236 @@ static FileDecl::Vertex AvgVertex(const BVHBuilder* _manager, uint32 i0, uint32
 	return v;
 }
 
-void TesselateSimple(const FileDecl::Triangle& _triangle, BVHBuilder* _manager, float _maxEdgeLen)
+/// \brief Sides to split and the squared edge lengths used for the decision.
+struct SplitDecision
+{
+	float e0, e1, e2;
+	bool s0, s1, s2;
+
+	bool Any() const { return s0 || s1 || s2; }
+};
+
+static SplitDecision DecideSplit(const ε::Triangle& _tr, float _maxEdgeLen)
 {
 	// Get edges which violate the threshold
-	ε::Triangle tr = _manager->GetTriangle(_triangle);
-	float e0 = lensq(tr.v2 - tr.v1);
-	float e1 = lensq(tr.v0 - tr.v2);
-	float e2 = lensq(tr.v0 - tr.v1);
+	SplitDecision d;
+	d.e0 = lensq(_tr.v2 - _tr.v1);
+	d.e1 = lensq(_tr.v0 - _tr.v2);
+	d.e2 = lensq(_tr.v0 - _tr.v1);
 	float thresholdSq = _maxEdgeLen * _maxEdgeLen;
-	bool s0 = e0 > thresholdSq;
-	bool s1 = e1 > thresholdSq;
-	bool s2 = e2 > thresholdSq;
-	if(!s0 && !s1 && !s2)
-	{
-		// Stop recursion and add final small triangle
-		_manager->AddTriangle(_triangle);
-		return;
-	}
+	d.s0 = d.e0 > thresholdSq;
+	d.s1 = d.e1 > thresholdSq;
+	d.s2 = d.e2 > thresholdSq;
+	if(!d.Any()) return d;
 	// Find out which sides to tesselate for an optimal regular refined triangle.
 	// The smaller the ratio the faster a triangle counts as extreme. It must be larger than
 	// sqrt(2) (otherwise the triangle gets worse) and smaller 2 (can never be reached due to
 	// the triangle equation a+b>c).
 	const float RATIO = 1.45f; 
 	// If one side is much larger then the others split only this.
-	if(e0 > e1 * RATIO && e0 > e2 * RATIO) s1 = s2 = false;
-	if(e1 > e0 * RATIO && e1 > e2 * RATIO) s0 = s2 = false;
-	if(e2 > e0 * RATIO && e2 > e1 * RATIO) s0 = s1 = false;
+	if(d.e0 > d.e1 * RATIO && d.e0 > d.e2 * RATIO) d.s1 = d.s2 = false;
+	if(d.e1 > d.e0 * RATIO && d.e1 > d.e2 * RATIO) d.s0 = d.s2 = false;
+	if(d.e2 > d.e0 * RATIO && d.e2 > d.e1 * RATIO) d.s0 = d.s1 = false;
 	// If one side is significantly shorter then all others don't split it
-	if(e0 * 1.8f < e1 && e0 * 1.8f < e2) s0 = false;
-	if(e1 * 1.8f < e0 && e1 * 1.8f < e2) s1 = false;
-	if(e2 * 1.8f < e0 && e2 * 1.8f < e1) s2 = false;
-
-	// Create new vertices
-	uint32 i0 = 0, i1 = 0, i2 = 0;
-	if(s0) i0 = _manager->AddVertex(AvgVertex(_manager, _triangle.vertices[1], _triangle.vertices[2]));
-	if(s1) i1 = _manager->AddVertex(AvgVertex(_manager, _triangle.vertices[0], _triangle.vertices[2]));
-	if(s2) i2 = _manager->AddVertex(AvgVertex(_manager, _triangle.vertices[0], _triangle.vertices[1]));
+	if(d.e0 * 1.8f < d.e1 && d.e0 * 1.8f < d.e2) d.s0 = false;
+	if(d.e1 * 1.8f < d.e0 && d.e1 * 1.8f < d.e2) d.s1 = false;
+	if(d.e2 * 1.8f < d.e0 && d.e2 * 1.8f < d.e1) d.s2 = false;
+	return d;
+}
 
+/// \brief Create the child triangles for a decision with the new vertices
+///		i0, i1, i2 on the sides 0, 1, 2.
+/// \return Number of children written to _children (2 to 4).
+static int SplitTriangle(const FileDecl::Triangle& _triangle, const SplitDecision& _d, uint32 i0, uint32 i1, uint32 i2, FileDecl::Triangle* _children)
+{
+	uint32 v0 = _triangle.vertices[0];
+	uint32 v1 = _triangle.vertices[1];
+	uint32 v2 = _triangle.vertices[2];
+	uint32 m = _triangle.material;
 	// Split by pattern
-	if(s0 && s1 && s2)
+	if(_d.s0 && _d.s1 && _d.s2)
 	{
-		TesselateSimple(FileDecl::Triangle({_triangle.vertices[0], i2, i1, _triangle.material}), _manager, _maxEdgeLen);
-		TesselateSimple(FileDecl::Triangle({_triangle.vertices[1], i0, i2, _triangle.material}), _manager, _maxEdgeLen);
-		TesselateSimple(FileDecl::Triangle({_triangle.vertices[2], i1, i0, _triangle.material}), _manager, _maxEdgeLen);
-		TesselateSimple(FileDecl::Triangle({i0, i1, i2, _triangle.material}), _manager, _maxEdgeLen);
-	} else if(s0 && s1)
+		_children[0] = FileDecl::Triangle({v0, i2, i1, m});
+		_children[1] = FileDecl::Triangle({v1, i0, i2, m});
+		_children[2] = FileDecl::Triangle({v2, i1, i0, m});
+		_children[3] = FileDecl::Triangle({i0, i1, i2, m});
+		return 4;
+	} else if(_d.s0 && _d.s1)
 	{
-		TesselateSimple(FileDecl::Triangle({_triangle.vertices[2], i1, i0, _triangle.material}), _manager, _maxEdgeLen);
-		if(e0 > e1)
+		_children[0] = FileDecl::Triangle({v2, i1, i0, m});
+		if(_d.e0 > _d.e1)
 		{
-			TesselateSimple(FileDecl::Triangle({_triangle.vertices[0], _triangle.vertices[1], i0, _triangle.material}), _manager, _maxEdgeLen);
-			TesselateSimple(FileDecl::Triangle({_triangle.vertices[0], i0, i1, _triangle.material}), _manager, _maxEdgeLen);
+			_children[1] = FileDecl::Triangle({v0, v1, i0, m});
+			_children[2] = FileDecl::Triangle({v0, i0, i1, m});
 		} else {
-			TesselateSimple(FileDecl::Triangle({_triangle.vertices[0], _triangle.vertices[1], i1, _triangle.material}), _manager, _maxEdgeLen);
-			TesselateSimple(FileDecl::Triangle({_triangle.vertices[1], i0, i1, _triangle.material}), _manager, _maxEdgeLen);
+			_children[1] = FileDecl::Triangle({v0, v1, i1, m});
+			_children[2] = FileDecl::Triangle({v1, i0, i1, m});
 		}
-	} else if(s0 && s2)
+		return 3;
+	} else if(_d.s0 && _d.s2)
 	{
-		TesselateSimple(FileDecl::Triangle({_triangle.vertices[1], i0, i2, _triangle.material}), _manager, _maxEdgeLen);
-		if(e0 > e2)
+		_children[0] = FileDecl::Triangle({v1, i0, i2, m});
+		if(_d.e0 > _d.e2)
 		{
-			TesselateSimple(FileDecl::Triangle({_triangle.vertices[2], _triangle.vertices[0], i0, _triangle.material}), _manager, _maxEdgeLen);
-			TesselateSimple(FileDecl::Triangle({_triangle.vertices[0], i2, i0, _triangle.material}), _manager, _maxEdgeLen);
+			_children[1] = FileDecl::Triangle({v2, v0, i0, m});
+			_children[2] = FileDecl::Triangle({v0, i2, i0, m});
 		} else {
-			TesselateSimple(FileDecl::Triangle({_triangle.vertices[2], _triangle.vertices[0], i2, _triangle.material}), _manager, _maxEdgeLen);
-			TesselateSimple(FileDecl::Triangle({_triangle.vertices[2], i2, i0, _triangle.material}), _manager, _maxEdgeLen);
+			_children[1] = FileDecl::Triangle({v2, v0, i2, m});
+			_children[2] = FileDecl::Triangle({v2, i2, i0, m});
 		}
-	} else if(s1 && s2)
+		return 3;
+	} else if(_d.s1 && _d.s2)
 	{
-		TesselateSimple(FileDecl::Triangle({_triangle.vertices[0], i2, i1, _triangle.material}), _manager, _maxEdgeLen);
-		if(e1 > e2)
+		_children[0] = FileDecl::Triangle({v0, i2, i1, m});
+		if(_d.e1 > _d.e2)
 		{
-			TesselateSimple(FileDecl::Triangle({_triangle.vertices[1], _triangle.vertices[2], i1, _triangle.material}), _manager, _maxEdgeLen);
-			TesselateSimple(FileDecl::Triangle({_triangle.vertices[1], i1, i2, _triangle.material}), _manager, _maxEdgeLen);
+			_children[1] = FileDecl::Triangle({v1, v2, i1, m});
+			_children[2] = FileDecl::Triangle({v1, i1, i2, m});
 		} else {
-			TesselateSimple(FileDecl::Triangle({_triangle.vertices[1], _triangle.vertices[2], i2, _triangle.material}), _manager, _maxEdgeLen);
-			TesselateSimple(FileDecl::Triangle({_triangle.vertices[2], i1, i2, _triangle.material}), _manager, _maxEdgeLen);
+			_children[1] = FileDecl::Triangle({v1, v2, i2, m});
+			_children[2] = FileDecl::Triangle({v2, i1, i2, m});
+		}
+		return 3;
+	} else if(_d.s0) {
+		_children[0] = FileDecl::Triangle({v0, v1, i0, m});
+		_children[1] = FileDecl::Triangle({v2, v0, i0, m});
+		return 2;
+	} else if(_d.s1) {
+		_children[0] = FileDecl::Triangle({v0, v1, i1, m});
+		_children[1] = FileDecl::Triangle({v1, v2, i1, m});
+		return 2;
+	} else if(_d.s2) {
+		_children[0] = FileDecl::Triangle({v2, v0, i2, m});
+		_children[1] = FileDecl::Triangle({v1, v2, i2, m});
+		return 2;
+	}
+	Assert(false, "Impossible condition - at least one side must be split.");
+	return 0;
+}
+
+void TesselateSimple(const FileDecl::Triangle& _triangle, BVHBuilder* _manager, float _maxEdgeLen)
+{
+	SplitDecision d = DecideSplit(_manager->GetTriangle(_triangle), _maxEdgeLen);
+	if(!d.Any())
+	{
+		// Stop recursion and add final small triangle
+		_manager->AddTriangle(_triangle);
+		return;
+	}
+
+	// Create new vertices
+	uint32 i0 = 0, i1 = 0, i2 = 0;
+	if(d.s0) i0 = _manager->AddVertex(AvgVertex(_manager, _triangle.vertices[1], _triangle.vertices[2]));
+	if(d.s1) i1 = _manager->AddVertex(AvgVertex(_manager, _triangle.vertices[0], _triangle.vertices[2]));
+	if(d.s2) i2 = _manager->AddVertex(AvgVertex(_manager, _triangle.vertices[0], _triangle.vertices[1]));
+
+	FileDecl::Triangle children[4];
+	int numChildren = SplitTriangle(_triangle, d, i0, i1, i2, children);
+	for(int i = 0; i < numChildren; ++i)
+		TesselateSimple(children[i], _manager, _maxEdgeLen);
+}
+
+// Undirected edge between two vertex indices
+static uint64 EdgeKey(uint32 _a, uint32 _b)
+{
+	return _a < _b ? ((uint64)_a << 32) | _b : ((uint64)_b << 32) | _a;
+}
+
+// Edge opposite to vertex _side (same numbering as the split sides)
+static uint64 SideKey(const FileDecl::Triangle& _triangle, uint32 _side)
+{
+	return EdgeKey(_triangle.vertices[(_side + 1) % 3], _triangle.vertices[(_side + 2) % 3]);
+}
+
+static const uint32 NUM_EDGE_SHARDS = 64;
+static uint32 GetEdgeShard(uint64 _key)
+{
+	return uint32((_key * 0x9E3779B97F4A7C15ull) >> 58);
+}
+
+void TesselateParallel(const std::vector<FileDecl::Triangle>& _triangles, BVHBuilder* _manager, float _maxEdgeLen)
+{
+	// Midpoint vertex for each split edge. The cache lives over all rounds
+	// because a neighbour may split a shared edge one round later.
+	std::unordered_map<uint64, uint32> edgeCache[NUM_EDGE_SHARDS];
+	uint32 numThreads = GetNumThreads();
+
+	std::vector<FileDecl::Triangle> current = _triangles;
+	std::vector<FileDecl::Triangle> next;
+	std::vector<SplitDecision> decisions;
+	while(!current.empty())
+	{
+		uint32 num = (uint32)current.size();
+		decisions.resize(num);
+
+		// Decide for all triangles and distribute the split edges to the
+		// shards (per thread lists to stay deterministic). An edge is
+		// referenced by triangle * 3 + side.
+		std::vector<std::vector<uint32>> shardLists(numThreads * NUM_EDGE_SHARDS);
+		ParallelRange(num, [&](uint32 _thread, uint32 _begin, uint32 _end)
+		{
+			for(uint32 i = _begin; i < _end; ++i)
+			{
+				decisions[i] = DecideSplit(_manager->GetTriangle(current[i]), _maxEdgeLen);
+				bool split[3] = {decisions[i].s0, decisions[i].s1, decisions[i].s2};
+				for(uint32 k = 0; k < 3; ++k)
+					if(split[k]) shardLists[_thread * NUM_EDGE_SHARDS + GetEdgeShard(SideKey(current[i], k))].push_back(i * 3 + k);
+			}
+		});
+
+		// Look up all split edges once and remember where their midpoint
+		// index is stored. Map values do not move on rehashing.
+		std::vector<uint32*> midpointSlots(num * 3);
+		std::vector<std::pair<uint64, uint32*>> newEdges[NUM_EDGE_SHARDS];
+		ParallelFor(NUM_EDGE_SHARDS, [&](uint32 _shard)
+		{
+			for(uint32 t = 0; t < numThreads; ++t)
+				for(uint32 side : shardLists[t * NUM_EDGE_SHARDS + _shard])
+				{
+					uint64 key = SideKey(current[side / 3], side % 3);
+					auto it = edgeCache[_shard].emplace(key, 0);
+					midpointSlots[side] = &it.first->second;
+					if(it.second) newEdges[_shard].push_back(std::make_pair(key, &it.first->second));
+				}
+		}, 1);
+
+		// Create the midpoints of new edges in one batch. They are not welded,
+		// the edge cache already joins the midpoints of shared edges.
+		std::vector<uint32> shardOffsets(NUM_EDGE_SHARDS + 1, 0);
+		for(uint32 s = 0; s < NUM_EDGE_SHARDS; ++s)
+			shardOffsets[s+1] = shardOffsets[s] + (uint32)newEdges[s].size();
+		std::vector<FileDecl::Vertex> midpoints(shardOffsets.back());
+		uint32 firstMidpoint = _manager->GetVertexCount();
+		ParallelFor(NUM_EDGE_SHARDS, [&](uint32 _shard)
+		{
+			for(uint32 j = 0; j < newEdges[_shard].size(); ++j)
+			{
+				uint64 key = newEdges[_shard][j].first;
+				midpoints[shardOffsets[_shard] + j] = AvgVertex(_manager, uint32(key >> 32), uint32(key));
+				*newEdges[_shard][j].second = firstMidpoint + shardOffsets[_shard] + j;
+			}
+		}, 1);
+		_manager->AppendVertices(midpoints.data(), (uint32)midpoints.size());
+
+		// Output the final triangles and split the others into the next round
+		std::vector<uint32> childOffsets(num + 1, 0);
+		for(uint32 i = 0; i < num; ++i)
+		{
+			const SplitDecision& d = decisions[i];
+			int numSplits = d.s0 + d.s1 + d.s2;
+			childOffsets[i+1] = childOffsets[i] + (numSplits ? numSplits + 1 : 0);
+			if(!numSplits) _manager->AddTriangle(current[i]);
 		}
-	} else if(s0) {
-		TesselateSimple(FileDecl::Triangle({_triangle.vertices[0], _triangle.vertices[1], i0, _triangle.material}), _manager, _maxEdgeLen);
-		TesselateSimple(FileDecl::Triangle({_triangle.vertices[2], _triangle.vertices[0], i0, _triangle.material}), _manager, _maxEdgeLen);
-	} else if(s1) {
-		TesselateSimple(FileDecl::Triangle({_triangle.vertices[0], _triangle.vertices[1], i1, _triangle.material}), _manager, _maxEdgeLen);
-		TesselateSimple(FileDecl::Triangle({_triangle.vertices[1], _triangle.vertices[2], i1, _triangle.material}), _manager, _maxEdgeLen);
-	} else if(s2) {
-		TesselateSimple(FileDecl::Triangle({_triangle.vertices[2], _triangle.vertices[0], i2, _triangle.material}), _manager, _maxEdgeLen);
-		TesselateSimple(FileDecl::Triangle({_triangle.vertices[1], _triangle.vertices[2], i2, _triangle.material}), _manager, _maxEdgeLen);
-	} else Assert(false, "Impossible condition - at least one side must be split.");
-}
\ No newline at end of file
+		next.resize(childOffsets.back());
+		ParallelFor(num, [&](uint32 _i)
+		{
+			const SplitDecision& d = decisions[_i];
+			if(!d.Any()) return;
+			uint32 i0 = d.s0 ? *midpointSlots[_i * 3    ] : 0;
+			uint32 i1 = d.s1 ? *midpointSlots[_i * 3 + 1] : 0;
+			uint32 i2 = d.s2 ? *midpointSlots[_i * 3 + 2] : 0;
+			SplitTriangle(current[_i], d, i0, i1, i2, &next[childOffsets[_i]]);
+		});
+		std::swap(current, next);
+	}
+}
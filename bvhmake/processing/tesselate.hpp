@@ -1,6 +1,7 @@
 #pragma once
 
 #include "filedef.hpp" 
+#include <vector>
 
 /// Fallback method: Simply add the triangle without tesselation.
 void TesselateNone(const FileDecl::Triangle& _triangle, class BVHBuilder* _manager);
@@ -14,4 +15,22 @@ void TesselateNone(const FileDecl::Triangle& _triangle, class BVHBuilder* _manag
 ///		addVertex and addTriangle methods)
 // TODO: addVertex which returns an index and checks for uniqueness
 // TODO: addTriangle which simply adds 3 indices
-void TesselateSimple(const FileDecl::Triangle& _triangle, class BVHBuilder* _manager, float _maxEdgeLen);
\ No newline at end of file
+void TesselateSimple(const FileDecl::Triangle& _triangle, class BVHBuilder* _manager, float _maxEdgeLen);
+
+/// Split many triangles in parallel with the same split decisions as TesselateSimple.
+/// \details Works in rounds over the whole triangle list: each round adds
+///		the triangles which need no split and splits the others into the
+///		list of the next round. The midpoints of split edges are kept in a
+///		cache keyed by the two vertex indices of the edge, so adjacent
+///		triangles share the same vertex and each midpoint is created once.
+///		The midpoints of a round are appended with AppendVertices() and are
+///		not welded with other vertices of equal data (TesselateSimple uses
+///		AddVertex()).
+///
+///		The output triangles have the same positions as the ones of
+///		TesselateSimple, but they are added round by round instead of depth
+///		first and the new vertices are numbered differently. The result does
+///		not depend on the number of threads.
+/// \param [in] _triangles The triangles to be tesselated.
+/// \param [out] _manager The manager to stream output the results.
+void TesselateParallel(const std::vector<FileDecl::Triangle>& _triangles, class BVHBuilder* _manager, float _maxEdgeLen);
\ No newline at end of file
@@ -0,0 +1,62 @@
+﻿#include "toplevel.hpp"
+#include <algorithm>
+#include <limits>
+
+using namespace ε;
+
+static uint32 BuildRecursive(const std::vector<Box>& _boxes, uint32* _ids, uint32 _num, std::vector<BVHBuilder::Node>& _nodes)
+{
+	if(_num == 1) return 0x80000000 | _ids[0];
+
+	// Sort along each axis and sweep from both sides
+	std::vector<uint32> sorted[3];
+	std::vector<float> prefix(_num);
+	float bestCost = std::numeric_limits<float>::infinity();
+	int bestAxis = 0;
+	uint32 bestSplit = 1;
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		sorted[axis].assign(_ids, _ids + _num);
+		std::sort(sorted[axis].begin(), sorted[axis].end(), [&](uint32 _a, uint32 _b) {
+			return _boxes[_a].min[axis] + _boxes[_a].max[axis] < _boxes[_b].min[axis] + _boxes[_b].max[axis];
+		});
+		Box box = _boxes[sorted[axis][0]];
+		for(uint32 i = 0; i < _num; ++i)
+		{
+			box = Box(min(box.min, _boxes[sorted[axis][i]].min), max(box.max, _boxes[sorted[axis][i]].max));
+			prefix[i] = surface(box);
+		}
+		box = _boxes[sorted[axis][_num-1]];
+		for(uint32 i = _num - 1; i > 0; --i)
+		{
+			box = Box(min(box.min, _boxes[sorted[axis][i]].min), max(box.max, _boxes[sorted[axis][i]].max));
+			float cost = prefix[i-1] * i + surface(box) * (_num - i);
+			if(cost < bestCost)
+			{
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = i;
+			}
+		}
+	}
+	std::copy(sorted[bestAxis].begin(), sorted[bestAxis].end(), _ids);
+
+	// Allocate in preorder
+	uint32 index = (uint32)_nodes.size();
+	_nodes.push_back(BVHBuilder::Node());
+	uint32 left = BuildRecursive(_boxes, _ids, bestSplit, _nodes);
+	uint32 right = BuildRecursive(_boxes, _ids + bestSplit, _num - bestSplit, _nodes);
+	_nodes[index].left = left;
+	_nodes[index].right = right;
+	return index;
+}
+
+void BuildTopLevelTree(const std::vector<Box>& _boxes, std::vector<BVHBuilder::Node>& _nodes)
+{
+	std::vector<uint32> ids(_boxes.size());
+	for(uint32 i = 0; i < ids.size(); ++i)
+		ids[i] = i;
+	_nodes.clear();
+	_nodes.reserve(_boxes.size() - 1);
+	BuildRecursive(_boxes, ids.data(), (uint32)ids.size(), _nodes);
+}
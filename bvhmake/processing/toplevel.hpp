@@ -0,0 +1,12 @@
+#pragma once
+
+#include "bvhmake.hpp"
+
+/// \brief Build a binary tree over boxes with a full sweep SAH.
+/// \details Used to join independently built hierarchies (one per mesh).
+///		The boxes are only used for the heuristic, the bounding volumes of the
+///		new nodes are computed by the caller.
+/// \param [in] _boxes At least two boxes.
+/// \param [out] _nodes Inner nodes in preorder with the root at 0. A child
+///		code with the first bit set references the box _code & 0x7fffffff.
+void BuildTopLevelTree(const std::vector<ε::Box>& _boxes, std::vector<BVHBuilder::Node>& _nodes);
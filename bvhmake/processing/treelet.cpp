@@ -0,0 +1,201 @@
+﻿#include "treelet.hpp"
+#include "quality.hpp"
+#include "../parallel.hpp"
+#include "../../gpugi/utilities/assert.hpp"
+#include <vector>
+#include <atomic>
+#include <iostream>
+
+using namespace ε;
+
+// Maximum number of subtrees in a treelet
+const int TREELET_SIZE = 7;
+// Relative cost of a leaf (block of triangles), see COST_INNER
+const float COST_LEAF = 1.0f;
+
+// Axis aligned boxes and costs of all nodes and the parent relation. The
+// restructuring uses boxes for the heuristic independent of the fit method.
+struct TreeletContext
+{
+	BVHBuilder* builder;
+	std::vector<Box> bounds;
+	std::vector<float> costs;
+	std::vector<uint32> parents;
+};
+
+static bool IsLeafNode( const BVHBuilder::Node& _node )
+{
+	return (_node.left & 0x80000000) != 0;
+}
+
+// Find the optimal topology for the treelet rooted at _root and apply it if
+// it is better than the current one.
+// Returns true if the treelet was changed.
+static bool RestructureTreelet( TreeletContext& _context, uint32 _root )
+{
+	BVHBuilder* builder = _context.builder;
+
+	// Grow the treelet by expanding the subtree with the largest surface
+	uint32 leaves[TREELET_SIZE];
+	uint32 inner[TREELET_SIZE - 1];
+	int numLeaves = 2, numInner = 1;
+	inner[0] = _root;
+	leaves[0] = builder->GetNode(_root).left;
+	leaves[1] = builder->GetNode(_root).right;
+	while( numLeaves < TREELET_SIZE )
+	{
+		int best = -1;
+		float bestSurface = -1.0f;
+		for( int i = 0; i < numLeaves; ++i )
+			if( !IsLeafNode(builder->GetNode(leaves[i])) && surface(_context.bounds[leaves[i]]) > bestSurface )
+			{
+				best = i;
+				bestSurface = surface(_context.bounds[leaves[i]]);
+			}
+		if( best < 0 ) break;
+		uint32 expand = leaves[best];
+		inner[numInner++] = expand;
+		leaves[best] = builder->GetNode(expand).left;
+		leaves[numLeaves++] = builder->GetNode(expand).right;
+	}
+	if( numLeaves < 3 ) return false;
+
+	// Dynamic programming over all subsets of the treelet leaves
+	const uint32 numSubsets = 1 << numLeaves;
+	Box subsetBounds[1 << TREELET_SIZE];
+	float subsetCost[1 << TREELET_SIZE];
+	uint32 subsetSplit[1 << TREELET_SIZE];
+	for( uint32 s = 1; s < numSubsets; ++s )
+	{
+		int first = 0;
+		while( !(s & (1 << first)) ) ++first;
+		if( s == (1u << first) )
+		{
+			subsetBounds[s] = _context.bounds[leaves[first]];
+			subsetCost[s] = _context.costs[leaves[first]];
+			continue;
+		}
+		subsetBounds[s] = Box(subsetBounds[s & ~(1u << first)], _context.bounds[leaves[first]]);
+		// Try all partitions (each only once: the first element is always
+		// on the left side).
+		float bestCost = std::numeric_limits<float>::infinity();
+		uint32 rest = s & ~(1u << first);
+		for( uint32 p = rest; ; p = (p - 1) & rest )
+		{
+			uint32 left = p | (1u << first);
+			if( left != s )
+			{
+				float cost = subsetCost[left] + subsetCost[s & ~left];
+				if( cost < bestCost )
+				{
+					bestCost = cost;
+					subsetSplit[s] = left;
+				}
+			}
+			if( p == 0 ) break;
+		}
+		subsetCost[s] = COST_INNER * surface(subsetBounds[s]) + bestCost;
+	}
+
+	if( subsetCost[numSubsets - 1] >= _context.costs[_root] * 0.9999f )
+		return false;
+
+	// Reconnect the nodes. The root keeps its index and the other inner nodes
+	// are reused in arbitrary order.
+	auto fit = builder->GetFitMethod();
+	int nextInner = 1;
+	std::function<uint32(uint32, uint32)> emit = [&](uint32 _subset, uint32 _nodeIdx) -> uint32 {
+		uint32 children[2] = { subsetSplit[_subset], _subset & ~subsetSplit[_subset] };
+		for( int c = 0; c < 2; ++c )
+		{
+			uint32 child;
+			if( (children[c] & (children[c] - 1)) == 0 )
+			{
+				int i = 0;
+				while( children[c] != (1u << i) ) ++i;
+				child = leaves[i];
+			} else child = emit( children[c], inner[nextInner++] );
+			_context.parents[child] = _nodeIdx;
+			if( c == 0 ) builder->GetNode(_nodeIdx).left = child;
+			else builder->GetNode(_nodeIdx).right = child;
+		}
+		_context.bounds[_nodeIdx] = subsetBounds[_subset];
+		_context.costs[_nodeIdx] = subsetCost[_subset];
+		(*fit)( builder->GetNode(_nodeIdx).left, builder->GetNode(_nodeIdx).right, _nodeIdx );
+		return _nodeIdx;
+	};
+	emit( numSubsets - 1, _root );
+	Assert( nextInner == numInner, "All inner nodes of a treelet must be reused." );
+	return true;
+}
+
+void OptimizeTreelets(BVHBuilder* _bvhBuilder, int _numPasses)
+{
+	uint32 numNodes = _bvhBuilder->GetNumNodes();
+	TreeletContext context;
+	context.builder = _bvhBuilder;
+	context.bounds.resize(numNodes);
+	context.costs.resize(numNodes);
+	context.parents.assign(numNodes, 0xffffffff);
+	std::vector<uint32> leafNodes;
+	for( uint32 i = 0; i < numNodes; ++i )
+	{
+		const BVHBuilder::Node& node = _bvhBuilder->GetNode(i);
+		if( IsLeafNode(node) ) leafNodes.push_back(i);
+		else context.parents[node.left] = context.parents[node.right] = i;
+	}
+
+	// Initial boxes and costs bottom up
+	auto fit = _bvhBuilder->GetFitMethod();
+	bool useBoxes = fit->Type() == FitMethod::BVType::AABOX;
+	std::unique_ptr<std::atomic<uint32>[]> visits(new std::atomic<uint32>[numNodes]);
+	for( uint32 i = 0; i < numNodes; ++i ) visits[i] = 0;
+	ParallelFor((uint32)leafNodes.size(), [&](uint32 i) {
+		uint32 nodeIdx = leafNodes[i];
+		if( useBoxes )
+			// Boxes might be clipped (SBVH)
+			context.bounds[nodeIdx] = _bvhBuilder->GetBoundingVolume<Box>(nodeIdx);
+		else {
+			const FileDecl::Leaf& leaf = _bvhBuilder->GetLeaf(_bvhBuilder->GetNode(nodeIdx).left & 0x7fffffff);
+			Box box( _bvhBuilder->GetTriangle(leaf.triangles[0]) );
+			for( uint32 t = 1; t < FileDecl::Leaf::NUM_PRIMITIVES && IsTriangleValid(leaf.triangles[t]); ++t )
+				box = Box(box, Box(_bvhBuilder->GetTriangle(leaf.triangles[t])));
+			context.bounds[nodeIdx] = box;
+		}
+		context.costs[nodeIdx] = COST_LEAF * surface(context.bounds[nodeIdx]);
+
+		uint32 parent = context.parents[nodeIdx];
+		while( parent != 0xffffffff && visits[parent]++ == 1 )
+		{
+			const BVHBuilder::Node& node = _bvhBuilder->GetNode(parent);
+			context.bounds[parent] = Box(context.bounds[node.left], context.bounds[node.right]);
+			context.costs[parent] = COST_INNER * surface(context.bounds[parent]) + context.costs[node.left] + context.costs[node.right];
+			parent = context.parents[parent];
+		}
+	}, 256);
+	float initialCost = context.costs[0];
+
+	for( int pass = 0; pass < _numPasses; ++pass )
+	{
+		// The second thread arriving at a node restructures the treelet below.
+		// All nodes of this treelet are finished and not accessed by others.
+		for( uint32 i = 0; i < numNodes; ++i ) visits[i] = 0;
+		ParallelFor((uint32)leafNodes.size(), [&](uint32 i) {
+			uint32 parent = context.parents[leafNodes[i]];
+			while( parent != 0xffffffff && visits[parent]++ == 1 )
+			{
+				// The subtrees might have changed
+				const BVHBuilder::Node& node = _bvhBuilder->GetNode(parent);
+				context.costs[parent] = COST_INNER * surface(context.bounds[parent]) + context.costs[node.left] + context.costs[node.right];
+				if( !RestructureTreelet( context, parent ) )
+					(*fit)( node.left, node.right, parent );
+				parent = context.parents[parent];
+			}
+		}, 256);
+	}
+
+	std::cerr << "  Treelet optimization reduced the SAH cost by "
+		<< (100.0f * (1.0f - context.costs[0] / initialCost)) << "%." << std::endl;
+
+	_bvhBuilder->SortNodesPreorder( 0 );
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "bvhmake.hpp"
+
+/// \brief Improve a finished hierarchy by treelet restructuring (TRBVH,
+///		Karras and Aila 2013).
+/// \details Treelets of up to 7 subtrees are formed bottom up at each inner
+///		node and replaced by the topology with minimal surface area cost.
+///		Independent subtrees are processed in parallel. Leaves are not
+///		changed and the bounding volumes of the reorganized nodes are
+///		recomputed with the current fit method. Afterwards the nodes are in
+///		preorder again.
+/// \param [in] _numPasses Number of bottom up optimization passes.
+void OptimizeTreelets(BVHBuilder* _bvhBuilder, int _numPasses);
@@ -0,0 +1,103 @@
+﻿#include "widebvh.hpp"
+#include "../../gpugi/utilities/assert.hpp"
+#include <vector>
+
+using namespace ε;
+
+void ComputeNodeBoxes(const BVHBuilder* _bvhBuilder, std::vector<Box>& _output)
+{
+	uint32 numNodes = _bvhBuilder->GetNumNodes();
+	_output.resize(numNodes);
+	bool useBoxes = _bvhBuilder->GetFitMethod()->Type() == FitMethod::BVType::AABOX;
+	// Children have larger indices than their parents in preorder.
+	for( uint32 i = numNodes; i-- > 0; )
+	{
+		const BVHBuilder::Node& node = _bvhBuilder->GetNode(i);
+		if( useBoxes )
+			_output[i] = _bvhBuilder->GetBoundingVolume<Box>(i);
+		else if( node.left & 0x80000000 )
+		{
+			const FileDecl::Leaf& leaf = _bvhBuilder->GetLeaf(node.left & 0x7fffffff);
+			_output[i] = Box( _bvhBuilder->GetTriangle(leaf.triangles[0]) );
+			for( uint32 t = 1; t < FileDecl::Leaf::NUM_PRIMITIVES && IsTriangleValid(leaf.triangles[t]); ++t )
+				_output[i] = Box(_output[i], Box(_bvhBuilder->GetTriangle(leaf.triangles[t])));
+		} else
+			_output[i] = Box(_output[node.left], _output[node.right]);
+	}
+}
+
+template<uint N>
+void CollapseHierarchy(const BVHBuilder* _bvhBuilder, std::vector<FileDecl::WideNode<N>>& _output)
+{
+	std::vector<Box> bounds;
+	ComputeNodeBoxes(_bvhBuilder, bounds);
+
+	// Binary nodes which become a wide node and the slot in their parent
+	struct Task
+	{
+		uint32 node;
+		uint32 parent;
+		uint32 slot;
+	};
+	std::vector<Task> stack;
+	stack.push_back( Task{0, FileDecl::WideNode<N>::INVALID_CHILD, 0} );
+	_output.clear();
+	while( !stack.empty() )
+	{
+		Task task = stack.back(); stack.pop_back();
+		uint32 wideIdx = (uint32)_output.size();
+		if( task.parent != FileDecl::WideNode<N>::INVALID_CHILD )
+			_output[task.parent].children[task.slot] = wideIdx;
+		_output.emplace_back();
+
+		// Replace the largest inner child by its children as long as
+		// there is space.
+		uint32 children[N];
+		uint32 num = 1;
+		children[0] = task.node;
+		while( num < N )
+		{
+			int best = -1;
+			float bestSurface = -1.0f;
+			for( uint32 i = 0; i < num; ++i )
+				if( !(_bvhBuilder->GetNode(children[i]).left & 0x80000000) && surface(bounds[children[i]]) > bestSurface )
+				{
+					best = i;
+					bestSurface = surface(bounds[children[i]]);
+				}
+			if( best < 0 ) break;
+			const BVHBuilder::Node& node = _bvhBuilder->GetNode(children[best]);
+			for( uint32 i = num; i > uint32(best) + 1; --i )
+				children[i] = children[i-1];
+			children[best] = node.left;
+			children[best+1] = node.right;
+			++num;
+		}
+
+		FileDecl::WideNode<N>& wideNode = _output[wideIdx];
+		for( uint32 i = 0; i < N; ++i )
+		{
+			if( i < num )
+			{
+				const Box& box = bounds[children[i]];
+				wideNode.minX[i] = box.min.x; wideNode.minY[i] = box.min.y; wideNode.minZ[i] = box.min.z;
+				wideNode.maxX[i] = box.max.x; wideNode.maxY[i] = box.max.y; wideNode.maxZ[i] = box.max.z;
+				const BVHBuilder::Node& node = _bvhBuilder->GetNode(children[i]);
+				// Leaves are referenced directly, the index of inner nodes is
+				// set when they are created.
+				wideNode.children[i] = (node.left & 0x80000000) ? _bvhBuilder->GetExportChildCode(node.left) : FileDecl::WideNode<N>::INVALID_CHILD;
+			} else {
+				wideNode.minX[i] = wideNode.minY[i] = wideNode.minZ[i] = std::numeric_limits<float>::infinity();
+				wideNode.maxX[i] = wideNode.maxY[i] = wideNode.maxZ[i] = -std::numeric_limits<float>::infinity();
+				wideNode.children[i] = FileDecl::WideNode<N>::INVALID_CHILD;
+			}
+		}
+		// Reverse order to get the first child first
+		for( uint32 i = num; i-- > 0; )
+			if( !(_bvhBuilder->GetNode(children[i]).left & 0x80000000) )
+				stack.push_back( Task{children[i], wideIdx, i} );
+	}
+}
+
+template void CollapseHierarchy<4>(const BVHBuilder*, std::vector<FileDecl::WideNode<4>>&);
+template void CollapseHierarchy<8>(const BVHBuilder*, std::vector<FileDecl::WideNode<8>>&);
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "bvhmake.hpp"
+
+/// \brief Compute axis aligned boxes for all nodes independent of the fit
+///		method.
+/// \details Expects the nodes in preorder. For boxes the bounding volumes
+///		are copied, otherwise the boxes are computed from the leaf triangles.
+void ComputeNodeBoxes(const BVHBuilder* _bvhBuilder, std::vector<ε::Box>& _output);
+
+/// \brief Collapse the binary hierarchy into an N-ary one.
+/// \details Each wide node greedily pulls up the children with the largest
+///		surface until it has N children. The output is in preorder.
+template<uint N>
+void CollapseHierarchy(const BVHBuilder* _bvhBuilder, std::vector<FileDecl::WideNode<N>>& _output);
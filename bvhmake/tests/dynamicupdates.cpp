@@ -0,0 +1,148 @@
+﻿#include "../bvhmake.hpp"
+#include "../exportbuffer.hpp"
+#include "../../gpugi/utilities/loggerinit.hpp"
+#include <iostream>
+#include <fstream>
+#include <random>
+#include <algorithm>
+#include <array>
+#include <map>
+
+// Checks the incremental updates of finished hierarchies: triangles are
+// removed and inserted again with RemoveTriangle() and InsertTriangle()
+// and the tree is exported after each step (which compacts it by
+// CommitUpdates()). Exits with 1 if any check fails.
+
+typedef std::array<uint32, 3> TriangleKey;
+typedef std::map<TriangleKey, uint32> ReferenceCounts;
+
+static TriangleKey GetKey( const FileDecl::Triangle& _triangle )
+{
+	return TriangleKey{{_triangle.vertices[0], _triangle.vertices[1], _triangle.vertices[2]}};
+}
+
+// Random small triangles with a few long ones, such that spatial splits
+// duplicate references.
+static void AddRandomTriangles( BVHBuilder& _builder, uint32 _num )
+{
+	std::minstd_rand rng(1);
+	std::uniform_real_distribution<float> position(0.0f, 100.0f), offset(-1.0f, 1.0f);
+	for( uint32 i = 0; i < _num; ++i )
+	{
+		ε::Vec3 center( position(rng), position(rng) * 0.3f, position(rng) );
+		float size = i % 50 == 0 ? 20.0f : 1.0f;
+		FileDecl::Triangle triangle;
+		for( int j = 0; j < 3; ++j )
+		{
+			FileDecl::Vertex vertex;
+			vertex.position = center + ε::Vec3(offset(rng), offset(rng), offset(rng)) * size;
+			vertex.normal = ε::Vec3(0.0f, 1.0f, 0.0f);
+			vertex.texcoord = ε::Vec2(0.0f);
+			triangle.vertices[j] = _builder.AddVertex( vertex );
+		}
+		triangle.material = 0;
+		_builder.AddTriangle( triangle );
+	}
+}
+
+// Export the tree and check that it is in preorder, that all boxes contain
+// their children and count the references of each triangle.
+static int ExportAndValidate( BVHBuilder& _builder, ReferenceCounts& _references )
+{
+	{
+		std::ofstream file( "dynamicupdates.bim", std::ofstream::binary );
+		ExportBuffer buffer( file );
+		_builder.ExportBVH( buffer );
+	}
+
+	int errors = 0;
+	_references.clear();
+	std::vector<uint32> stack( 1, 0 );
+	uint32 next = 0;
+	while( !stack.empty() )
+	{
+		uint32 index = stack.back(); stack.pop_back();
+		if( index != next++ )
+			++errors;
+		const BVHBuilder::Node& node = _builder.GetNode( index );
+		const ε::Box& box = _builder.GetBoundingVolume<ε::Box>( index );
+		if( node.left & 0x80000000 )
+		{
+			const FileDecl::Leaf& leaf = _builder.GetLeaf( node.left & 0x7fffffff );
+			if( !FileDecl::IsTriangleValid(leaf.triangles[0]) )
+				++errors;
+			for( uint32 i = 0; i < FileDecl::Leaf::NUM_PRIMITIVES && FileDecl::IsTriangleValid(leaf.triangles[i]); ++i )
+			{
+				ε::Box triangleBox( _builder.GetTriangle(leaf.triangles[i]) );
+				if( !ε::all(box.min <= triangleBox.max) || !ε::all(triangleBox.min <= box.max) )
+					++errors;
+				++_references[GetKey(leaf.triangles[i])];
+			}
+		} else {
+			for( uint32 child : {node.left, node.right} )
+			{
+				const ε::Box& childBox = _builder.GetBoundingVolume<ε::Box>( child );
+				if( !ε::all(box.min <= childBox.min) || !ε::all(childBox.max <= box.max) )
+					++errors;
+			}
+			stack.push_back( node.right );
+			stack.push_back( node.left );
+		}
+	}
+	if( next != _builder.GetNumNodes() )
+		++errors;
+	return errors;
+}
+
+static int TestMethod( const char* _buildMethod )
+{
+	BVHBuilder builder;
+	builder.SetBuildMethod( _buildMethod );
+	builder.SetGeometryType( "aabox" );
+	AddRandomTriangles( builder, 20000 );
+	builder.BuildBVH();
+
+	std::vector<FileDecl::Triangle> triangles( builder.GetTriangleCount() );
+	for( uint32 i = 0; i < triangles.size(); ++i )
+		triangles[i] = builder.GetTriangleIdx( i );
+	std::shuffle( triangles.begin(), triangles.end(), std::minstd_rand(2) );
+	triangles.resize( triangles.size() / 5 );
+
+	ReferenceCounts references;
+	int errors = ExportAndValidate( builder, references );
+	size_t numTriangles = references.size();
+
+	for( const FileDecl::Triangle& triangle : triangles )
+	{
+		if( !builder.RemoveTriangle( triangle ) )
+			++errors;
+		if( builder.RemoveTriangle( triangle ) )
+			++errors;
+	}
+	errors += ExportAndValidate( builder, references );
+	for( const FileDecl::Triangle& triangle : triangles )
+		if( references.count( GetKey(triangle) ) )
+			++errors;
+
+	for( const FileDecl::Triangle& triangle : triangles )
+		builder.InsertTriangle( triangle );
+	errors += ExportAndValidate( builder, references );
+	for( const FileDecl::Triangle& triangle : triangles )
+		if( references[GetKey(triangle)] != 1 )
+			++errors;
+	if( references.size() != numTriangles )
+		++errors;
+
+	std::cerr << _buildMethod << ": " << errors << " errors" << std::endl;
+	return errors;
+}
+
+int main()
+{
+	Logger::g_logger.Initialize( new Logger::FilePolicy("log.txt") );
+
+	int errors = 0;
+	for( const char* buildMethod : {"sweep", "kdtree", "sbvh"} )
+		errors += TestMethod( buildMethod );
+	return errors == 0 ? 0 : 1;
+}
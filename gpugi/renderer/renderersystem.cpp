@@ -137,14 +137,27 @@ void RendererSystem::SetScene(std::shared_ptr<Scene> _scene)
 	// Bind buffer
 	m_triangleBuffer = std::make_unique<gl::TextureBufferView>(m_scene->GetTriangleBuffer(), gl::TextureBufferFormat::RGBA32I);
 	m_vertexPositionBuffer = std::make_unique<gl::TextureBufferView>(m_scene->GetVertexPositionBuffer(), gl::TextureBufferFormat::RGB32F);
-	m_vertexInfoBuffer = std::make_unique<gl::TextureBufferView>(m_scene->GetVertexInfoBuffer(), gl::TextureBufferFormat::RGBA32F);
+	m_vertexInfoBuffer = std::make_unique<gl::TextureBufferView>(m_scene->GetVertexInfoBuffer(),
+		m_scene->HasPackedVertexInfo() ? gl::TextureBufferFormat::RGBA16F : gl::TextureBufferFormat::RGBA32F);
 	m_hierarchyBuffer = std::make_unique<gl::TextureBufferView>(m_scene->GetHierarchyBuffer(), gl::TextureBufferFormat::RGBA32F);
+	m_instanceHierarchyBuffer.reset();
+	m_instanceBuffer.reset();
+	if(m_scene->IsInstanced())
+	{
+		m_instanceHierarchyBuffer = std::make_unique<gl::TextureBufferView>(m_scene->GetInstanceHierarchyBuffer(), gl::TextureBufferFormat::RGBA32F);
+		m_instanceBuffer = std::make_unique<gl::TextureBufferView>(m_scene->GetInstanceBuffer(), gl::TextureBufferFormat::RGBA32F);
+	}
 
 	// Bind after creation of all, because bindings are overwritten during construction
 	m_triangleBuffer->BindBuffer((int)TextureBufferBindings::TRIANGLES);
 	m_vertexPositionBuffer->BindBuffer((int)TextureBufferBindings::VERTEX_POSITIONS);
 	m_vertexInfoBuffer->BindBuffer((int)TextureBufferBindings::VERTEX_INFO);
 	m_hierarchyBuffer->BindBuffer((int)TextureBufferBindings::HIERARCHY);
+	if(m_instanceHierarchyBuffer)
+	{
+		m_instanceHierarchyBuffer->BindBuffer((int)TextureBufferBindings::INSTANCE_HIERARCHY);
+		m_instanceBuffer->BindBuffer((int)TextureBufferBindings::INSTANCES);
+	}
 
 	// Upload materials / set textures
 	char* materialUBOData = static_cast<char*>(m_materialUBO->Map(gl::Buffer::MapType::WRITE, gl::Buffer::MapWriteFlag::INVALIDATE_BUFFER));
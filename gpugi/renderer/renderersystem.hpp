@@ -160,7 +160,9 @@ private:
 		VERTEX_POSITIONS = 2,
 		VERTEX_INFO = 3,
 		HIERARCHY = 4,
-		INITIAL_LIGHTSAMPLES = 5
+		INITIAL_LIGHTSAMPLES = 5,
+		INSTANCE_HIERARCHY = 14,
+		INSTANCES = 15
 	};
 
 	/// Defines default constant buffer binding assignment.
@@ -190,6 +192,8 @@ private:
 	std::unique_ptr<gl::TextureBufferView> m_vertexPositionBuffer;
 	std::unique_ptr<gl::TextureBufferView> m_vertexInfoBuffer;
 	std::unique_ptr<gl::TextureBufferView> m_triangleBuffer;
+	std::unique_ptr<gl::TextureBufferView> m_instanceHierarchyBuffer;	///< Only for instanced scenes
+	std::unique_ptr<gl::TextureBufferView> m_instanceBuffer;
 
 	std::unique_ptr<gl::Buffer> m_globalConstUBO;
 	gl::UniformBufferMetaInfo m_globalConstUBOInfo;
@@ -6,9 +6,13 @@
 #include "../utilities/assert.hpp"
 #include "../utilities/flagoperators.hpp"
 #include "../dependencies/glhelper/glhelper/utils/pathutils.hpp"
+#include "../../bvhmake/parallel.hpp"
 #include <ei/3dtypes.hpp>
 
 #include <fstream>
+#include <cstring>
+#include <array>
+#include <set>
 
 using namespace bim;
 
@@ -21,7 +25,10 @@ Scene::Scene( const std::string& _file, ε::Types3D _bvhType ) :
 	)) ),
 	m_totalPointLightFlux( 0.0f ),
 	m_totalAreaLightFlux( 0.0f ),
-	m_lightAreaSum( 0.0f )
+	m_lightAreaSum( 0.0f ),
+	m_quantizationBits( 0 ),
+	m_packedVertexInfo( false ),
+	m_numLeafTriangles( 0 )
 {
 	m_sourceDirectory = PathUtils::GetDirectory(_file);
 	m_bvhType = _bvhType;
@@ -35,6 +42,10 @@ Scene::Scene( const std::string& _file, ε::Types3D _bvhType ) :
 		case ε::Types3D::BOX: bvhProp = Property::AABOX_BVH; break;
 		case ε::Types3D::OBOX: bvhProp = Property::OBOX_BVH; break;
 	}
+	LoadSections(_file);
+	// Quantised boxes replace the full precision ones
+	if(m_quantizationBits)
+		bvhProp = Property::Val(0);
 	if(!m_model.load(_file.c_str(),
 		Property::Val(Property::NORMAL | Property::TEXCOORD0 | bvhProp | Property::HIERARCHY | Property::TRIANGLE_MAT),
 		Property::NDF_SGGX))
@@ -48,6 +59,9 @@ Scene::Scene( const std::string& _file, ε::Types3D _bvhType ) :
 	// The scene is loaded now, but must be mapped to GPU
 	UploadGeometry();
 	UploadHierarchy(_bvhType);
+	if(IsInstanced())
+		UploadInstances();
+	m_boundingBox = IsInstanced() ? m_instanceBoxes[0] : m_model.getBoundingBox();
 	for(uint i = 0; i < m_model.getNumUsedMaterials(); ++i)
 		LoadMaterial(*m_model.getMaterial(i));
 
@@ -63,30 +77,146 @@ Scene::~Scene()
 	}
 }
 
-const char* Scene::GetBvhTypeDefineString() const
+std::string Scene::GetBvhTypeDefineString() const
 {
+	std::string defines;
 	switch(m_bvhType) {
-		case ε::Types3D::BOX: return "#define AABOX_BVH\n";
-		case ε::Types3D::OBOX: return "#define OBOX_BVH\n";
+		case ε::Types3D::BOX: defines = "#define AABOX_BVH\n"; break;
+		case ε::Types3D::OBOX: defines = "#define OBOX_BVH\n"; break;
 	}
-	return nullptr;
+	if(IsInstanced())
+		defines += "#define INSTANCED_BVH\n";
+	if(HasPackedVertexInfo())
+		defines += "#define PACKED_VERTEX_INFO\n";
+	if(!m_compressedLeaves.empty())
+		defines += "#define COMPRESSED_LEAVES\n";
+	return defines;
 }
 
 void Scene::UploadGeometry()
 {
-	std::vector<VertexInfo> infoData;
-	infoData.resize(m_sceneChunk->getNumVertices());
-	for(uint v = 0; v < m_sceneChunk->getNumVertices(); ++v)
+	// Allocate and upload directly (immutable resources are faster, but need the data on setup)
+	m_vertexPositionBuffer = std::make_shared<gl::Buffer>(static_cast<std::uint32_t>(sizeof(ei::Vec3) * m_sceneChunk->getNumVertices()), gl::Buffer::MAP_WRITE, m_sceneChunk->getPositions());
+	if(m_packedVertexInfos.size() == m_sceneChunk->getNumVertices())
 	{
-		infoData[v].normalAngles.x = atan2(m_sceneChunk->getNormals()[v].y, m_sceneChunk->getNormals()[v].x);
-		infoData[v].normalAngles.y = m_sceneChunk->getNormals()[v].z;
-		infoData[v].texcoord = m_sceneChunk->getTexCoords0()[v];
+		// Already in the GPU format
+		m_vertexInfoBuffer = std::make_shared<gl::Buffer>(static_cast<std::uint32_t>(sizeof(FileDecl::PackedVertexInfo) * m_sceneChunk->getNumVertices()), gl::Buffer::IMMUTABLE, m_packedVertexInfos.data());
+		m_packedVertexInfo = true;
+	} else {
+		if(!m_packedVertexInfos.empty())
+			LOG_ERROR("Number of packed vertex infos and vertices differ, the packed ones are ignored.");
+		std::vector<VertexInfo> infoData;
+		infoData.resize(m_sceneChunk->getNumVertices());
+		for(uint v = 0; v < m_sceneChunk->getNumVertices(); ++v)
+		{
+			infoData[v].normalAngles.x = atan2(m_sceneChunk->getNormals()[v].y, m_sceneChunk->getNormals()[v].x);
+			infoData[v].normalAngles.y = m_sceneChunk->getNormals()[v].z;
+			infoData[v].texcoord = m_sceneChunk->getTexCoords0()[v];
+		}
+		m_vertexInfoBuffer = std::make_shared<gl::Buffer>(static_cast<std::uint32_t>(sizeof(VertexInfo) * m_sceneChunk->getNumVertices()), gl::Buffer::IMMUTABLE, infoData.data());
 	}
+	std::vector<FileDecl::PackedVertexInfo>().swap(m_packedVertexInfos);
 
-	// Allocate and upload directly (immutable resources are faster, but need the data on setup)
-	m_vertexPositionBuffer = std::make_shared<gl::Buffer>(static_cast<std::uint32_t>(sizeof(ei::Vec3) * m_sceneChunk->getNumVertices()), gl::Buffer::IMMUTABLE, m_sceneChunk->getPositions());
-	m_vertexInfoBuffer = std::make_shared<gl::Buffer>(static_cast<std::uint32_t>(sizeof(VertexInfo) * m_sceneChunk->getNumVertices()), gl::Buffer::IMMUTABLE, infoData.data());
-	m_triangleBuffer = std::make_shared<gl::Buffer>( uint32(m_model.getNumTrianglesPerLeaf() * sizeof(ei::UVec4) * m_sceneChunk->getNumLeafNodes()), gl::Buffer::IMMUTABLE, m_sceneChunk->getLeafNodes() );
+	if(!m_compressedLeaves.empty())
+	{
+		UploadCompressedLeaves();
+		return;
+	}
+
+	// Strip the padding from the fixed size leaf blocks. Each leaf becomes an
+	// (offset, count) range in a compact triangle array which is encoded in
+	// the child code. Scenes with a single triangle per leaf (e.g. bvhmake c=1)
+	// are compact already and their child codes are used as they are.
+	uint32 numPerLeaf = GetNumTrianglesPerLeaf();
+	uint32 numLeaves = GetNumLeafBlocks();
+	const Triangle* leafBlocks = reinterpret_cast<const Triangle*>(m_sceneChunk->getLeafNodes());
+	std::vector<Triangle> triangles;
+	if(numPerLeaf > 1)
+	{
+		triangles.resize(numPerLeaf * numLeaves);
+		m_leafCodes.resize(numLeaves);
+		uint32 offset = 0;
+		for(uint32 l = 0; l < numLeaves; ++l)
+		{
+			uint32 count = GetLeafTriangles(0x80000000 | l, &triangles[offset]);
+			Assert(count >= 1 && count <= 8 && offset <= 0x0FFFFFFF, "Leaf cannot be encoded as (offset, count)!");
+			m_leafCodes[l] = 0x80000000 | ((count - 1) << 28) | offset;
+			offset += count;
+		}
+		leafBlocks = triangles.data();
+		m_numLeafTriangles = offset;
+	} else m_numLeafTriangles = numLeaves;
+	m_triangleBuffer = std::make_shared<gl::Buffer>( uint32(sizeof(Triangle) * m_numLeafTriangles), gl::Buffer::IMMUTABLE, leafBlocks );
+}
+
+void Scene::UploadCompressedLeaves()
+{
+	// One RGBA32I buffer: two texels per leaf, then one texel per full
+	// triangle and four materials per texel. The offsets of the leaves into
+	// the two side arrays are rebased to indices into this buffer.
+	uint32 numLeaves = uint32(m_compressedLeaves.size());
+	uint32 triangleBase = numLeaves * 2;
+	uint32 materialBase = (triangleBase + uint32(m_fullLeafTriangles.size())) * 4;
+	Assert(uint64(materialBase) + m_leafMaterials.size() <= 0x7FFFFFFF && numLeaves * FileDecl::Leaf::NUM_PRIMITIVES <= 0x0FFFFFFF, "Too many compressed leaves!");
+	std::vector<uint32> data((materialBase + m_leafMaterials.size() + 3) & ~size_t(3), 0);
+	FileDecl::CompressedLeaf* leaves = reinterpret_cast<FileDecl::CompressedLeaf*>(data.data());
+	memcpy(leaves, m_compressedLeaves.data(), sizeof(FileDecl::CompressedLeaf) * numLeaves);
+	if(!m_fullLeafTriangles.empty())
+		memcpy(&data[triangleBase * 4], m_fullLeafTriangles.data(), sizeof(FileDecl::Triangle) * m_fullLeafTriangles.size());
+	if(!m_leafMaterials.empty())
+		memcpy(&data[materialBase], m_leafMaterials.data(), sizeof(uint32) * m_leafMaterials.size());
+
+	// Leaf codes address the slots of the leaves: leaf * NUM_PRIMITIVES + slot
+	Triangle triangles[FileDecl::Leaf::NUM_PRIMITIVES];
+	m_leafCodes.resize(numLeaves);
+	for(uint32 l = 0; l < numLeaves; ++l)
+	{
+		if(leaves[l].firstVertex & FileDecl::CompressedLeaf::FULL_TRIANGLES)
+			leaves[l].firstVertex += triangleBase;
+		if(leaves[l].material & FileDecl::CompressedLeaf::MIXED_MATERIALS)
+			leaves[l].material += materialBase;
+		uint32 count = GetLeafTriangles(0x80000000 | l, triangles);
+		Assert(count >= 1, "Empty leaf cannot be encoded as (offset, count)!");
+		m_leafCodes[l] = 0x80000000 | ((count - 1) << 28) | (l * FileDecl::Leaf::NUM_PRIMITIVES);
+	}
+	m_numLeafTriangles = numLeaves * FileDecl::Leaf::NUM_PRIMITIVES;
+	m_triangleBuffer = std::make_shared<gl::Buffer>( uint32(sizeof(uint32) * data.size()), gl::Buffer::IMMUTABLE, data.data() );
+}
+
+uint32 Scene::GetNumLeafBlocks() const
+{
+	if(!m_compressedLeaves.empty())
+		return uint32(m_compressedLeaves.size());
+	return m_sceneChunk->getNumLeafNodes();
+}
+
+uint32 Scene::GetLeafTriangles( uint32 _childCode, Triangle* _triangles ) const
+{
+	uint32 numPerLeaf = GetNumTrianglesPerLeaf();
+	uint32 count = 0;
+	if(!m_compressedLeaves.empty())
+	{
+		FileDecl::DecompressLeaf(m_compressedLeaves[_childCode & 0x7FFFFFFF], m_leafMaterials.data(), m_fullLeafTriangles.data(), reinterpret_cast<FileDecl::Triangle*>(_triangles));
+		while(count < numPerLeaf && _triangles[count].vertices[0] != _triangles[count].vertices[1]) ++count;
+	} else if(numPerLeaf > 1)
+	{
+		const Triangle* block = reinterpret_cast<const Triangle*>(m_sceneChunk->getLeafNodes()) + (_childCode & 0x7FFFFFFF) * numPerLeaf;
+		// There are invalid triangles for padding reasons
+		for(; count < numPerLeaf && block[count].vertices[0] != block[count].vertices[1]; ++count)
+			_triangles[count] = block[count];
+	} else {
+		// Compact files contain (offset, count) codes already
+		count = ((_childCode >> 28) & 7) + 1;
+		memcpy(_triangles, reinterpret_cast<const Triangle*>(m_sceneChunk->getLeafNodes()) + (_childCode & 0x0FFFFFFF), sizeof(Triangle) * count);
+	}
+	return count;
+}
+
+uint32 Scene::GetChildCode( uint32 _firstChild ) const
+{
+	if( (_firstChild & 0x80000000) && !m_leafCodes.empty() )
+		return m_leafCodes[_firstChild & 0x7FFFFFFF];
+	return _firstChild;
 }
 
 void Scene::UploadHierarchy(ε::Types3D _bvhType)
@@ -95,14 +225,20 @@ void Scene::UploadHierarchy(ε::Types3D _bvhType)
 	std::vector<char> hierarchy;
 	if(_bvhType == ε::Types3D::BOX)
 	{
+		const ε::Box* boxes = m_sceneChunk->getHierarchyAABoxes();
+		std::vector<ε::Box> decodedBoxes;
+		if(m_quantizationBits == 8) DecodeQuantizedBoxes<uint8>(decodedBoxes);
+		else if(m_quantizationBits == 16) DecodeQuantizedBoxes<uint16>(decodedBoxes);
+		if(!decodedBoxes.empty()) boxes = decodedBoxes.data();
+
 		hierarchy.reserve(sizeof(TreeNode<ε::Box>) * m_sceneChunk->getNumNodes());
 		TreeNode<ε::Box>* hierarchyData = reinterpret_cast<TreeNode<ε::Box>*>(hierarchy.data());
 		for(uint i = 0; i < m_sceneChunk->getNumNodes(); ++i)
 		{
-			hierarchyData[i].min = m_sceneChunk->getHierarchyAABoxes()[i].min;
-			hierarchyData[i].max = m_sceneChunk->getHierarchyAABoxes()[i].max;
+			hierarchyData[i].min = boxes[i].min;
+			hierarchyData[i].max = boxes[i].max;
 			hierarchyData[i].escape = m_sceneChunk->getHierarchy()[i].escape;
-			hierarchyData[i].firstChild = m_sceneChunk->getHierarchy()[i].firstChild;
+			hierarchyData[i].firstChild = GetChildCode(m_sceneChunk->getHierarchy()[i].firstChild);
 		}
 	} else if(_bvhType == ε::Types3D::OBOX)
 	{
@@ -114,12 +250,13 @@ void Scene::UploadHierarchy(ε::Types3D _bvhType)
 			hierarchyData[i].sidesHalf = m_sceneChunk->getHierarchyOBoxes()[i].halfSides;
 			hierarchyData[i].rotationInv = conjugate(m_sceneChunk->getHierarchyOBoxes()[i].orientation);
 			hierarchyData[i].escape = m_sceneChunk->getHierarchy()[i].escape;
-			hierarchyData[i].firstChild = m_sceneChunk->getHierarchy()[i].firstChild;
+			hierarchyData[i].firstChild = GetChildCode(m_sceneChunk->getHierarchy()[i].firstChild);
 		}
 	}
 	// Allocate and upload
+	// Box hierarchies can be refitted
 	if(_bvhType == ε::Types3D::BOX)
-		m_hierarchyBuffer = std::make_shared<gl::Buffer>(uint32(sizeof(TreeNode<ε::Box>) * m_sceneChunk->getNumNodes()), gl::Buffer::IMMUTABLE, hierarchy.data());
+		m_hierarchyBuffer = std::make_shared<gl::Buffer>(uint32(sizeof(TreeNode<ε::Box>) * m_sceneChunk->getNumNodes()), gl::Buffer::MAP_WRITE, hierarchy.data());
 	else if(_bvhType == ε::Types3D::OBOX)
 		m_hierarchyBuffer = std::make_shared<gl::Buffer>(uint32(sizeof(TreeNode<ε::OBox>) * m_sceneChunk->getNumNodes()), gl::Buffer::IMMUTABLE, hierarchy.data());
 	m_parentBuffer = std::make_shared<gl::Buffer>(uint32(4 * m_sceneChunk->getNumNodes()), gl::Buffer::IMMUTABLE, m_sceneChunk->getHierarchyParents());
@@ -129,6 +266,228 @@ void Scene::UploadHierarchy(ε::Types3D _bvhType)
 		m_sggxBuffer = std::make_shared<gl::Buffer>(sizeof(bim::SGGX) * m_sceneChunk->getNumNodes(), gl::Buffer::IMMUTABLE, m_sceneChunk->getNodeNDFs());
 }
 
+void Scene::LoadSections( const std::string& _file )
+{
+	// The json names the binary file relative to its own directory
+	Jo::Files::HDDFile jsonFile( _file );
+	Jo::Files::MetaFileWrapper json( jsonFile );
+	Jo::Files::MetaFileWrapper::Node* sceneName;
+	if( !json.RootNode.HasChild("scene", &sceneName) )
+	{
+		LOG_ERROR("No binary scene file given in " + _file);
+		return;
+	}
+	std::string binaryFile = PathUtils::AppendPath( m_sourceDirectory, std::string(*sceneName) );
+	std::ifstream file( binaryFile, std::ifstream::binary );
+	if( !file ) return;
+
+	bool hasRoot = false;
+	FileDecl::NamedArray header;
+	while( file.read( (char*)&header, sizeof(FileDecl::NamedArray) ) )
+	{
+		size_t size = size_t(header.numElements) * header.elementSize;
+		auto isSection = [&header]( const char* _name ) { return strncmp( header.name, _name, sizeof(header.name) ) == 0; };
+		if( m_bvhType == ε::Types3D::BOX && isSection("bounding_aabox_root") && header.elementSize == sizeof(ε::Box) )
+		{
+			file.read( (char*)&m_quantizationRoot, sizeof(ε::Box) );
+			file.seekg( size - sizeof(ε::Box), std::ifstream::cur );
+			hasRoot = true;
+		} else if( m_bvhType == ε::Types3D::BOX && (isSection("bounding_aabox_q8") || isSection("bounding_aabox_q16")) )
+		{
+			m_quantizationBits = header.elementSize == sizeof(FileDecl::QuantizedBox<uint8>) ? 8 : 16;
+			m_quantizedBoxes.resize( size );
+			file.read( m_quantizedBoxes.data(), size );
+		} else if( isSection("instances") && header.elementSize == sizeof(FileDecl::Instance) )
+		{
+			m_instances.resize( header.numElements );
+			file.read( (char*)m_instances.data(), size );
+		} else if( isSection("instance_meshes") && header.elementSize == sizeof(FileDecl::InstancedMesh) )
+		{
+			m_instancedMeshes.resize( header.numElements );
+			file.read( (char*)m_instancedMeshes.data(), size );
+		} else if( isSection("instance_hierarchy") && header.elementSize == sizeof(FileDecl::Node) )
+		{
+			m_instanceNodes.resize( header.numElements );
+			file.read( (char*)m_instanceNodes.data(), size );
+		} else if( isSection("instance_bounding_aabox") && header.elementSize == sizeof(ε::Box) )
+		{
+			m_instanceBoxes.resize( header.numElements );
+			file.read( (char*)m_instanceBoxes.data(), size );
+		} else if( isSection("leaves_compressed") && header.elementSize == sizeof(FileDecl::CompressedLeaf) )
+		{
+			m_compressedLeaves.resize( header.numElements );
+			file.read( (char*)m_compressedLeaves.data(), size );
+		} else if( isSection("leaf_materials") && header.elementSize == sizeof(uint32) )
+		{
+			m_leafMaterials.resize( header.numElements );
+			file.read( (char*)m_leafMaterials.data(), size );
+		} else if( isSection("leaf_triangles") && header.elementSize == sizeof(FileDecl::Triangle) )
+		{
+			m_fullLeafTriangles.resize( header.numElements );
+			file.read( (char*)m_fullLeafTriangles.data(), size );
+		} else if( isSection("vertex_info_packed") && header.elementSize == sizeof(FileDecl::PackedVertexInfo) )
+		{
+			m_packedVertexInfos.resize( header.numElements );
+			file.read( (char*)m_packedVertexInfos.data(), size );
+		} else
+			file.seekg( size, std::ifstream::cur );
+	}
+
+	if( m_quantizationBits && !hasRoot )
+	{
+		LOG_ERROR("Quantised boxes without reference box in " + binaryFile);
+		m_quantizationBits = 0;
+	}
+	if( !m_instances.empty() && (m_instanceNodes.empty() || m_instanceNodes.size() != m_instanceBoxes.size()) )
+	{
+		LOG_ERROR("Instances without a valid instance hierarchy in " + binaryFile);
+		m_instances.clear();
+	}
+}
+
+void Scene::UploadInstances()
+{
+	std::vector<TreeNode<ε::Box>> hierarchy(m_instanceNodes.size());
+	for(size_t i = 0; i < m_instanceNodes.size(); ++i)
+	{
+		hierarchy[i].min = m_instanceBoxes[i].min;
+		hierarchy[i].max = m_instanceBoxes[i].max;
+		hierarchy[i].escape = m_instanceNodes[i].escape;
+		hierarchy[i].firstChild = m_instanceNodes[i].firstChild;
+	}
+	m_instanceHierarchyBuffer = std::make_shared<gl::Buffer>(uint32(sizeof(TreeNode<ε::Box>) * hierarchy.size()), gl::Buffer::MAP_WRITE, hierarchy.data());
+
+	// The inverse of the affine transformation (A|t) is (A^-1|-A^-1 t)
+	std::vector<ε::Vec4> instanceData(m_instances.size() * 4);
+	for(size_t i = 0; i < m_instances.size(); ++i)
+	{
+		const ε::Mat3x4& objectToWorld = m_instances[i].transformation;
+		ε::Mat3x3 rotation(objectToWorld(0,0), objectToWorld(0,1), objectToWorld(0,2),
+						   objectToWorld(1,0), objectToWorld(1,1), objectToWorld(1,2),
+						   objectToWorld(2,0), objectToWorld(2,1), objectToWorld(2,2));
+		ε::Mat3x3 invRotation = invert(rotation);
+		ε::Vec3 invTranslation = -(invRotation * ε::Vec3(objectToWorld(0,3), objectToWorld(1,3), objectToWorld(2,3)));
+		for(int r = 0; r < 3; ++r)
+			instanceData[i * 4 + r] = ε::Vec4(invRotation(r,0), invRotation(r,1), invRotation(r,2), invTranslation[r]);
+		uint32 rootNode = m_instancedMeshes[m_instances[i].mesh].rootNode;
+		instanceData[i * 4 + 3] = ε::Vec4(0.0f);
+		memcpy(&instanceData[i * 4 + 3].x, &rootNode, sizeof(uint32));
+	}
+	m_instanceBuffer = std::make_shared<gl::Buffer>(uint32(sizeof(ε::Vec4) * instanceData.size()), gl::Buffer::IMMUTABLE, instanceData.data());
+}
+
+bool Scene::Refit( const ε::Vec3* _positions )
+{
+	if( m_bvhType != ε::Types3D::BOX || !m_hierarchyBuffer )
+	{
+		LOG_ERROR("Only box hierarchies can be refitted.");
+		return false;
+	}
+
+	uint32 numVertices = m_sceneChunk->getNumVertices();
+	memcpy( m_vertexPositionBuffer->Map(gl::Buffer::MapType::WRITE, gl::Buffer::MapWriteFlag::INVALIDATE_BUFFER), _positions, sizeof(ε::Vec3) * numVertices );
+	m_vertexPositionBuffer->Unmap();
+
+	// Sort the nodes by depth. The nodes are in preorder, so each parent is
+	// before its children. Roots are their own parents.
+	uint32 numNodes = m_sceneChunk->getNumNodes();
+	const bim::Node* nodes = m_sceneChunk->getHierarchy();
+	const uint32* parents = m_sceneChunk->getHierarchyParents();
+	std::vector<uint32> depth(numNodes, 0);
+	uint32 maxDepth = 0;
+	for(uint32 i = 0; i < numNodes; ++i)
+	{
+		if(parents[i] != i) depth[i] = depth[parents[i]] + 1;
+		maxDepth = ε::max(maxDepth, depth[i]);
+	}
+	std::vector<uint32> levelOffsets(maxDepth + 2, 0);
+	for(uint32 i = 0; i < numNodes; ++i)
+		++levelOffsets[depth[i] + 1];
+	for(uint32 l = 0; l <= maxDepth; ++l)
+		levelOffsets[l+1] += levelOffsets[l];
+	std::vector<uint32> levelNodes(numNodes);
+	std::vector<uint32> cursor(levelOffsets.begin(), levelOffsets.end() - 1);
+	for(uint32 i = 0; i < numNodes; ++i)
+		levelNodes[cursor[depth[i]]++] = i;
+
+	// Fit bottom up, the nodes of one level are independent.
+	std::vector<ε::Box> boxes(numNodes);
+	for(int l = int(maxDepth); l >= 0; --l)
+	{
+		ParallelFor(levelOffsets[l+1] - levelOffsets[l], [&](uint32 _i)
+		{
+			uint32 index = levelNodes[levelOffsets[l] + _i];
+			uint32 firstChild = nodes[index].firstChild;
+			if(firstChild & 0x80000000)
+			{
+				Triangle triangles[FileDecl::Leaf::NUM_PRIMITIVES];
+				uint32 count = GetLeafTriangles(firstChild, triangles);
+				for(uint32 t = 0; t < count; ++t)
+				{
+					const Triangle& triangle = triangles[t];
+					ε::Box triangleBox(ε::Triangle(_positions[triangle.vertices[0]], _positions[triangle.vertices[1]], _positions[triangle.vertices[2]]));
+					boxes[index] = t == 0 ? triangleBox : ε::Box(boxes[index], triangleBox);
+				}
+			} else {
+				boxes[index] = boxes[firstChild];
+				for(uint32 c = nodes[firstChild].escape; c != 0 && parents[c] == index; c = nodes[c].escape)
+					boxes[index] = ε::Box(boxes[index], boxes[c]);
+			}
+		}, 256);
+	}
+
+	// Only the boxes change, the child codes stay as they are
+	TreeNode<ε::Box>* hierarchyData = static_cast<TreeNode<ε::Box>*>(m_hierarchyBuffer->Map(gl::Buffer::MapType::WRITE, gl::Buffer::MapWriteFlag::NONE));
+	for(uint32 i = 0; i < numNodes; ++i)
+	{
+		hierarchyData[i].min = boxes[i].min;
+		hierarchyData[i].max = boxes[i].max;
+	}
+	m_hierarchyBuffer->Unmap();
+
+	if(IsInstanced())
+	{
+		// The instance tree is small, refit it sequentially (children after parents)
+		for(uint32 i = uint32(m_instanceNodes.size()); i-- > 0; )
+		{
+			uint32 firstChild = m_instanceNodes[i].firstChild;
+			if(firstChild & 0x80000000)
+			{
+				const FileDecl::Instance& instance = m_instances[firstChild & 0x7FFFFFFF];
+				m_instanceBoxes[i] = FileDecl::TransformBox(boxes[m_instancedMeshes[instance.mesh].rootNode], instance.transformation);
+			} else {
+				m_instanceBoxes[i] = m_instanceBoxes[firstChild];
+				for(uint32 c = m_instanceNodes[firstChild].escape; c != 0 && m_instanceNodes[c].parent == i; c = m_instanceNodes[c].escape)
+					m_instanceBoxes[i] = ε::Box(m_instanceBoxes[i], m_instanceBoxes[c]);
+			}
+		}
+		TreeNode<ε::Box>* instanceData = static_cast<TreeNode<ε::Box>*>(m_instanceHierarchyBuffer->Map(gl::Buffer::MapType::WRITE, gl::Buffer::MapWriteFlag::NONE));
+		for(size_t i = 0; i < m_instanceNodes.size(); ++i)
+		{
+			instanceData[i].min = m_instanceBoxes[i].min;
+			instanceData[i].max = m_instanceBoxes[i].max;
+		}
+		m_instanceHierarchyBuffer->Unmap();
+		m_boundingBox = m_instanceBoxes[0];
+	} else
+		m_boundingBox = boxes[0];
+	return true;
+}
+
+template<typename T>
+void Scene::DecodeQuantizedBoxes( std::vector<ε::Box>& _boxes ) const
+{
+	uint32 numNodes = m_sceneChunk->getNumNodes();
+	Assert( m_quantizedBoxes.size() == numNodes * sizeof(FileDecl::QuantizedBox<T>), "Number of quantised boxes and nodes differ!" );
+	const FileDecl::QuantizedBox<T>* quantized = reinterpret_cast<const FileDecl::QuantizedBox<T>*>(m_quantizedBoxes.data());
+	const uint32* parents = m_sceneChunk->getHierarchyParents();
+	_boxes.resize(numNodes);
+	_boxes[0] = FileDecl::DequantizeBox(quantized[0], m_quantizationRoot);
+	// Nodes are in preorder, so each parent is decoded before its children.
+	for(uint32 i = 1; i < numNodes; ++i)
+		_boxes[i] = FileDecl::DequantizeBox(quantized[i], _boxes[parents[i]]);
+}
+
 void Scene::LoadMaterial( const bim::Material& _material )
 {
 	Material mat;
@@ -245,34 +604,96 @@ void Scene::LoadLightSources()
 {
 	m_totalAreaLightFlux = 0.0f;
 	float sum = 0.0f;
-	// Read the buffers with SubDataGets (still faster than a second file read pass)
-	for(uint32_t i = 0; i < m_sceneChunk->getNumTriangles(); ++i)
+	auto addLightTriangle = [&](const LightTriangle& _lightSource)
+	{
+		m_lightTriangles.push_back(_lightSource);
+
+		// Flux
+		float area = ε::surface(_lightSource.triangle);
+		m_totalAreaLightFlux += dot(ε::Vec3(0.2126f, 0.7152f, 0.0722f), _lightSource.luminance) * area * ε::π; // π is the integral over all solid angles of the cosine lobe
+
+		// Compute the area
+		sum += area;
+		m_lightSummedArea.push_back(sum);
+	};
+
+	// Spatial splits (bvhmake b=sbvh) reference a triangle from several
+	// leaves. Each light must be counted once, or it gets too much flux.
+	typedef std::array<uint32, 3> VertexTriple;
+
+	// Light triangles of a range of leaf blocks (object space for instances)
+	auto collectLeafLights = [&](uint32 _firstLeaf, uint32 _numLeaves)
+	{
+		std::vector<LightTriangle> lights;
+		std::set<VertexTriple> added;
+		Triangle triangles[FileDecl::Leaf::NUM_PRIMITIVES];
+		for(uint32 l = _firstLeaf; l < _firstLeaf + _numLeaves; ++l)
+		{
+			uint32 count = GetLeafTriangles(0x80000000 | l, triangles);
+			for(uint32 i = 0; i < count; ++i)
+			{
+				const Triangle& tri = triangles[i];
+				if( m_emissivity[tri.material] == ε::Vec3(0.0f)
+					|| !added.insert(VertexTriple{{tri.vertices[0], tri.vertices[1], tri.vertices[2]}}).second )
+					continue;
+				LightTriangle lightSource;
+				lightSource.luminance = m_emissivity[tri.material];
+				lightSource.triangle.v0 = m_sceneChunk->getPositions()[tri.vertices[0]];
+				lightSource.triangle.v1 = m_sceneChunk->getPositions()[tri.vertices[1]];
+				lightSource.triangle.v2 = m_sceneChunk->getPositions()[tri.vertices[2]];
+				lights.push_back(lightSource);
+			}
+		}
+		return lights;
+	};
+
+	if(IsInstanced())
+	{
+		// Search each mesh once. Each instance of an emissive mesh is a
+		// separate light in world space.
+		std::vector<std::vector<LightTriangle>> meshLights(m_instancedMeshes.size());
+		for(size_t m = 0; m < m_instancedMeshes.size(); ++m)
+			meshLights[m] = collectLeafLights(m_instancedMeshes[m].firstLeaf, m_instancedMeshes[m].numLeaves);
+		for(const FileDecl::Instance& instance : m_instances)
+		{
+			for(LightTriangle lightSource : meshLights[instance.mesh])
+			{
+				ε::Vec3* vertices[3] = {&lightSource.triangle.v0, &lightSource.triangle.v1, &lightSource.triangle.v2};
+				for(int j = 0; j < 3; ++j)
+				{
+					const ε::Vec3 p = *vertices[j];
+					*vertices[j] = instance.transformation * ε::Vec4(p.x, p.y, p.z, 1.0f);
+				}
+				addLightTriangle(lightSource);
+			}
+		}
+	} else if(!m_compressedLeaves.empty())
 	{
-		const ε::UVec3& tri = m_sceneChunk->getTriangles()[i];
-		// Is this a valid light source triangle?
-		if( tri[0] != tri[1]
-			&& (m_emissivity[m_sceneChunk->getTriangleMaterials()[i]] != ε::Vec3(0.0f)) )
+		// Compressed scenes have no plain triangle array
+		for(const LightTriangle& lightSource : collectLeafLights(0, GetNumLeafBlocks()))
+			addLightTriangle(lightSource);
+	} else {
+		// Read the buffers with SubDataGets (still faster than a second file read pass)
+		std::set<VertexTriple> added;
+		for(uint32_t i = 0; i < m_sceneChunk->getNumTriangles(); ++i)
 		{
-			LightTriangle lightSource;
-			lightSource.luminance = m_emissivity[m_sceneChunk->getTriangleMaterials()[i]];
-			//lightSource.emissivityTexHandle = m_materials[_triangles[i].material].emissivityTexHandle;
-			// Get the 3 vertices from vertex buffer
-			//for(int j = 0; j < 3; ++j)
-			//	lightSource.texcoord[j] = _vertices[_triangles[i].vertices[j]].texcoord;
-			lightSource.triangle.v0 = m_sceneChunk->getPositions()[tri[0]];
-			lightSource.triangle.v1 = m_sceneChunk->getPositions()[tri[1]];
-			lightSource.triangle.v2 = m_sceneChunk->getPositions()[tri[2]];
-			m_lightTriangles.push_back(lightSource);
-
-			// Flux
-			float area = ε::surface(lightSource.triangle);
-			m_totalAreaLightFlux += dot(ε::Vec3(0.2126f, 0.7152f, 0.0722f), lightSource.luminance) * area * ε::π; // π is the integral over all solid angles of the cosine lobe
-			// Assume average luminance of 0.5
-			//m_totalAreaLightFlux += 0.5f * area * ε::π;
-
-			// Compute the area
-			sum += area;
-			m_lightSummedArea.push_back(sum);
+			const ε::UVec3& tri = m_sceneChunk->getTriangles()[i];
+			// Is this a valid light source triangle?
+			if( tri[0] != tri[1]
+				&& (m_emissivity[m_sceneChunk->getTriangleMaterials()[i]] != ε::Vec3(0.0f))
+				&& added.insert(VertexTriple{{tri[0], tri[1], tri[2]}}).second )
+			{
+				LightTriangle lightSource;
+				lightSource.luminance = m_emissivity[m_sceneChunk->getTriangleMaterials()[i]];
+				//lightSource.emissivityTexHandle = m_materials[_triangles[i].material].emissivityTexHandle;
+				// Get the 3 vertices from vertex buffer
+				//for(int j = 0; j < 3; ++j)
+				//	lightSource.texcoord[j] = _vertices[_triangles[i].vertices[j]].texcoord;
+				lightSource.triangle.v0 = m_sceneChunk->getPositions()[tri[0]];
+				lightSource.triangle.v1 = m_sceneChunk->getPositions()[tri[1]];
+				lightSource.triangle.v2 = m_sceneChunk->getPositions()[tri[2]];
+				addLightTriangle(lightSource);
+			}
 		}
 	}
 
@@ -68,6 +68,8 @@ public:
 	};
 
 	/// GPU representation of non-position vertex part (not as frequently needed)
+	/// \details Scenes with packed vertex infos (bvhmake v=1) upload
+	///		FileDecl::PackedVertexInfo instead (see HasPackedVertexInfo()).
 	struct VertexInfo
 	{
         ε::Vec2 normalAngles; // atan2(normal.y, normal.x), normal.z
@@ -123,8 +125,11 @@ public:
 	/// The bvh uses ε:: geometries. Which one can change with the files (well currently not).
 	ε::Types3D GetBoundingVolumeType() const	{ return ei::Types3D::BOX; }
 
-	uint32 GetNumTrianglesPerLeaf() const		{ return m_model.getNumTrianglesPerLeaf(); }
-	uint32 GetNumLeafTriangles() const			{ return m_sceneChunk->getNumLeafNodes() * m_model.getNumTrianglesPerLeaf(); }
+	uint32 GetNumTrianglesPerLeaf() const		{ return m_compressedLeaves.empty() ? m_model.getNumTrianglesPerLeaf() : FileDecl::Leaf::NUM_PRIMITIVES; }
+	/// Number of triangle indices the leaf codes address. This is the size of
+	/// the compact (unpadded) triangle buffer or, with compressed leaves,
+	/// GetNumTrianglesPerLeaf() slots per leaf including the unused ones.
+	uint32 GetNumLeafTriangles() const			{ return m_numLeafTriangles; }
 	uint32 GetNumInnerNodes() const				{ return m_sceneChunk->getNumNodes(); }
 	uint32 GetNumMaterials() const				{ return m_model.getNumUsedMaterials(); }
 	uint32 GetNumVertices() const				{ return m_sceneChunk->getNumVertices(); }
@@ -138,7 +143,18 @@ public:
 	float GetLightAreaSum() const				{ return m_lightAreaSum; }
 	float GetTotalAreaLightFlux() const			{ return m_totalAreaLightFlux; }
 	float GetTotalPointLightFlux() const		{ return m_totalPointLightFlux; }
-	const ε::Box& GetBoundingBox() const		{ return m_model.getBoundingBox(); }
+	const ε::Box& GetBoundingBox() const		{ return m_boundingBox; }
+
+	/// True if the file contains instances (bvhmake i=1). The hierarchy buffer
+	/// contains one tree per unique mesh in the space of the mesh then.
+	bool IsInstanced() const					{ return !m_instances.empty(); }
+	uint32 GetNumInstances() const				{ return static_cast<uint32>(m_instances.size()); }
+	/// Tree over the world space boxes of all instances in TreeNode<ε::Box> layout.
+	/// Leaf child codes are instance indices.
+	std::shared_ptr<gl::Buffer> GetInstanceHierarchyBuffer() const	{ return m_instanceHierarchyBuffer; }
+	/// 4 Vec4 per instance: the 3 rows of the world to object transformation
+	/// and the root node of the instanced mesh (as uint32 in x).
+	std::shared_ptr<gl::Buffer> GetInstanceBuffer() const			{ return m_instanceBuffer; }
 
 	// Add a new point light source to the scene
 	void AddPointLight(const PointLight& _light) { m_pointLights.push_back(_light); ComputePointLightTable(); }
@@ -146,8 +162,23 @@ public:
 	bool SetPointLight(size_t _index, const PointLight& _light) { if(_index >= m_pointLights.size()) return false; m_pointLights[_index] = _light; return true; ComputePointLightTable(); }
 //	bool RemovePointLight(size_t _index) { if(_index >= m_pointLights.size()) return false; m_pointLights[_index] = m_pointLights.back(); m_pointLights.pop_back(); return true; }
 
+	/// Move the vertices and recompute the hierarchy boxes without changing
+	/// the tree (deforming geometry).
+	/// \details The nodes of one tree level are fitted in parallel from the
+	///		deepest level up to the root(s) and the instance tree is updated too.
+	///		Only box hierarchies can be refitted. Normals and light sources are
+	///		not changed.
+	/// \param [in] _positions One new position for each vertex (GetNumVertices()).
+	/// \returns false if the hierarchy cannot be refitted.
+	bool Refit( const ε::Vec3* _positions );
+
+	/// True if the vertex info buffer contains FileDecl::PackedVertexInfo
+	/// (RGBA16F with an octahedral normal) instead of VertexInfo.
+	bool HasPackedVertexInfo() const			{ return m_packedVertexInfo; }
+
 	ε::Types3D GetBvhType() const	{ return m_bvhType; }
-	const char* GetBvhTypeDefineString() const;
+	/// Shader defines for the hierarchy type, instancing and the vertex info format.
+	std::string GetBvhTypeDefineString() const;
 private:
 	bim::BinaryModel m_model;
 	bim::Chunk* m_sceneChunk;
@@ -176,9 +207,50 @@ private:
 
 	std::string m_sourceDirectory;
 	ε::Types3D m_bvhType;
+	ε::Box m_boundingBox;
+
+	int m_quantizationBits;					///< 8 or 16 if the scene contains quantised boxes (bvhmake q=8/16), 0 otherwise
+	ε::Box m_quantizationRoot;				///< Reference box for the root node
+	std::vector<char> m_quantizedBoxes;		///< FileDecl::QuantizedBox<uint8/uint16> per node (decoded in UploadHierarchy)
+
+	std::vector<FileDecl::Instance> m_instances;
+	std::vector<FileDecl::InstancedMesh> m_instancedMeshes;
+	std::vector<FileDecl::Node> m_instanceNodes;
+	std::vector<ε::Box> m_instanceBoxes;	///< World space box per node in m_instanceNodes
+	std::shared_ptr<gl::Buffer> m_instanceHierarchyBuffer;
+	std::shared_ptr<gl::Buffer> m_instanceBuffer;
+
+	std::vector<uint32> m_leafCodes;		///< (offset, count) child code per leaf block of the file, empty if the file is compact already
+	std::vector<FileDecl::CompressedLeaf> m_compressedLeaves;	///< "leaves_compressed" (bvhmake l=1), empty otherwise
+	std::vector<uint32> m_leafMaterials;					///< "leaf_materials" of the compressed leaves
+	std::vector<FileDecl::Triangle> m_fullLeafTriangles;	///< "leaf_triangles" of the compressed leaves
+	std::vector<FileDecl::PackedVertexInfo> m_packedVertexInfos;	///< "vertex_info_packed" (bvhmake v=1) until the upload
+	bool m_packedVertexInfo;
+	uint32 m_numLeafTriangles;
 
 	void UploadGeometry();
+	/// Upload the compressed leaves as they are together with their full
+	/// triangles and materials (see FetchTriangle() in scenedata.glsl).
+	void UploadCompressedLeaves();
+	uint32 GetNumLeafBlocks() const;
+	/// Triangles of the leaf with the child code _childCode of the file
+	/// without the padding.
+	/// \returns The number of triangles written to _triangles (at most
+	///		FileDecl::Leaf::NUM_PRIMITIVES).
+	uint32 GetLeafTriangles( uint32 _childCode, Triangle* _triangles ) const;
+	/// Replace leaf indices of the file by the (offset, count) codes of the
+	/// compact triangle buffer. Inner node indices are returned unchanged.
+	uint32 GetChildCode( uint32 _firstChild ) const;
 	void UploadHierarchy(ε::Types3D _bvhType);
+	/// Read the arrays which the bim library does not know (quantised boxes,
+	/// instances, compressed leaves, packed vertex infos) in one pass through
+	/// the binary file the json _file refers to.
+	void LoadSections( const std::string& _file );
+	/// Upload the top level tree and the transformations of the instances.
+	void UploadInstances();
+	/// Decode the boxes of all nodes top down (parents must be decoded first).
+	template<typename T>
+	void DecodeQuantizedBoxes( std::vector<ε::Box>& _boxes ) const;
 	/*void LoadMatRef( std::ifstream& _file, const Jo::Files::MetaFileWrapper::Node& _materials, const FileDecl::NamedArray& _header );
 	void LoadBoundingVolumes( std::ifstream& _file, const FileDecl::NamedArray& _header );
 	void LoadHierarchyApproximation( std::ifstream& _file, const FileDecl::NamedArray& _header );*/
@@ -46,6 +46,16 @@ vec3 UnpackNormal(float packedNormal0, float packedNormal1)
 	return vec3(cos(packedNormal0)*sinPhi, sin(packedNormal0)*sinPhi, packedNormal1);
 }
 
+// Expects: a normal folded onto the octahedron and unfolded into [-1,1]^2
+// (see FileDecl::EncodeOctahedral in bvhmake/filedef.hpp)
+vec3 UnpackNormalOctahedral(in vec2 packedNormal)
+{
+	vec3 normal = vec3(packedNormal, 1.0 - abs(packedNormal.x) - abs(packedNormal.y));
+	if(normal.z < 0.0)
+		normal.xy = (1.0 - abs(normal.yx)) * vec2(normal.x >= 0.0 ? 1.0 : -1.0, normal.y >= 0.0 ? 1.0 : -1.0);
+	return normalize(normal);
+}
+
 // Returns: vec2(atan(normal.y, normal.x), normal.z)
 // Attention: return.x ranges [-PI;+PI]
 vec2 PackNormal(in vec3 normal)
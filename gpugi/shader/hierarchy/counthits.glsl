@@ -2,6 +2,7 @@ void TraceRayCountHits(in Ray _ray, in float _rayLength, in float _pathImportanc
 {
 	int currentNodeIndex = 0;
 	int currentLeafIndex = 0;
+	int currentLeafEnd = 0;
 	vec3 invRayDir = 1.0 / _ray.Direction;
 	bool nextIsLeafNode = false;
 
@@ -26,7 +27,8 @@ void TraceRayCountHits(in Ray _ray, in float _rayLength, in float _pathImportanc
 				// If yes, we go into leave mode...
 				if(nextIsLeafNode)
 				{
-					currentLeafIndex = int(TRIANGLES_PER_LEAF * currentNodeIndex);
+					currentLeafIndex = GetLeafTriangleOffset(childCode);
+					currentLeafEnd = currentLeafIndex + GetLeafTriangleCount(childCode);
 					currentNodeIndex = escape;
 				}
 			}
@@ -42,29 +44,24 @@ void TraceRayCountHits(in Ray _ray, in float _rayLength, in float _pathImportanc
 		if(nextIsLeafNode)
 		{
 			// Load triangle.
-			Triangle triangle = texelFetch(TriangleBuffer, currentLeafIndex);
-			if(triangle.x == triangle.y) // Last check if this is condition helps perf: 05.11 (testscene.txt), GK104
-			{
-				nextIsLeafNode = false;
-			} else {
-				// Load vertex positions
-				vec3 positions[3];
-				positions[0] = texelFetch(VertexPositionBuffer, triangle.x).xyz;
-				positions[1] = texelFetch(VertexPositionBuffer, triangle.y).xyz;
-				positions[2] = texelFetch(VertexPositionBuffer, triangle.z).xyz;
-
-				// Check hit.
-				vec3 newTriangleNormal;
-				float newHit; vec3 newBarycentricCoord;
-				if(IntersectTriangle(_ray, positions[0], positions[1], positions[2], newHit, newBarycentricCoord, newTriangleNormal)
-					&& newHit <= _rayLength)
-				{
-					atomicAdd(HierarchyImportance[NumInnerNodes + currentLeafIndex].x, _pathImportance);
-				}
+			Triangle triangle = FetchTriangle(currentLeafIndex);
+			// Load vertex positions
+			vec3 positions[3];
+			positions[0] = texelFetch(VertexPositionBuffer, triangle.x).xyz;
+			positions[1] = texelFetch(VertexPositionBuffer, triangle.y).xyz;
+			positions[2] = texelFetch(VertexPositionBuffer, triangle.z).xyz;
 
-				++currentLeafIndex;
-				nextIsLeafNode = (currentLeafIndex % TRIANGLES_PER_LEAF) != 0;
+			// Check hit.
+			vec3 newTriangleNormal;
+			float newHit; vec3 newBarycentricCoord;
+			if(IntersectTriangle(_ray, positions[0], positions[1], positions[2], newHit, newBarycentricCoord, newTriangleNormal)
+				&& newHit <= _rayLength)
+			{
+				atomicAdd(HierarchyImportance[NumInnerNodes + currentLeafIndex].x, _pathImportance);
 			}
+
+			++currentLeafIndex;
+			nextIsLeafNode = currentLeafIndex < currentLeafEnd;
 		}
 
 	} while(currentNodeIndex != 0 || nextIsLeafNode);
@@ -110,6 +110,20 @@ bool FetchIntersectBoxNode(vec3 rayOrigin, vec3 invRayDir, int nodeIdx, out floa
 	return IntersectBox(rayOrigin, invRayDir, bbMin, bbMax, firstHit, lastHit);
 }
 
+#ifdef INSTANCED_BVH
+// Fetch and intersect a node of the top level tree over the instances
+bool FetchIntersectInstanceNode(vec3 rayOrigin, vec3 invRayDir, int nodeIdx, out float firstHit, out float lastHit, out uint childCode, out int escape)
+{
+	vec4 fetch = texelFetch(InstanceHierarchyBuffer, nodeIdx * 2);
+	vec3 bbMin = fetch.xyz;
+	childCode = floatBitsToUint(fetch.w);
+	fetch = texelFetch(InstanceHierarchyBuffer, nodeIdx * 2 + 1);
+	vec3 bbMax = fetch.xyz;
+	escape = floatBitsToInt(fetch.w);
+	return IntersectBox(rayOrigin, invRayDir, bbMin, bbMax, firstHit, lastHit);
+}
+#endif
+
 // Fetch and intersect an oriented box
 bool FetchIntersectOBoxNode(vec3 rayOrigin, vec3 rayDir, int nodeIdx, out float firstHit, out float lastHit, out uint childCode, out int escape, out float nodeSizeSq)
 {
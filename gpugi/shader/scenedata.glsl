@@ -2,7 +2,14 @@
 //#define NODE_TYPE_SPHERE 1
 #define NODE_TYPE NODE_TYPE_BOX
 
-#define TRIANGLES_PER_LEAF 2
+// Maximum number of triangles in a leaf.
+#define TRIANGLES_PER_LEAF 8
+
+// Leaf child codes have the most significant bit set. The lower 28 bits are the
+// offset of the first triangle in the TriangleBuffer and bits 28-30 contain the
+// number of triangles - 1 (see Scene::UploadGeometry).
+int GetLeafTriangleOffset(uint _childCode) { return int(_childCode & 0x0FFFFFFFu); }
+int GetLeafTriangleCount(uint _childCode) { return int((_childCode >> 28) & 7u) + 1; }
 
 // Theoretically GL_ARB_enhanced_layouts allows explicit memory layout.
 // Reality: Such qualifiers are not allowed for structs which means that it is not possible to align arrays properly without these helper constructs.
@@ -30,9 +37,51 @@ struct Leaf
 	Triangle triangles[TRIANGLES_PER_LEAF];
 };*/
 
+#ifdef COMPRESSED_LEAVES
+// The TriangleBuffer contains FileDecl::CompressedLeaf with two texels per leaf
+// followed by the full triangles and four materials per texel. Their offsets in
+// the leaves are indices into the TriangleBuffer (see Scene::UploadCompressedLeaves).
+// Triangle indices are leaf * TRIANGLES_PER_LEAF + slot.
+Triangle FetchTriangle(int _index)
+{
+	int leaf = _index / TRIANGLES_PER_LEAF;
+	int slot = _index % TRIANGLES_PER_LEAF;
+	ivec4 header = texelFetch(TriangleBuffer, leaf * 2);
+	Triangle triangle;
+	// Most significant bit of firstVertex: FULL_TRIANGLES
+	if(header.x < 0)
+		triangle = texelFetch(TriangleBuffer, (header.x & 0x7FFFFFFF) + slot);
+	else
+	{
+		// 8 bit local indices, 3 per slot in the last 24 bytes
+		ivec4 indices = texelFetch(TriangleBuffer, leaf * 2 + 1);
+		uint words[6] = uint[6](uint(header.z), uint(header.w), uint(indices.x), uint(indices.y), uint(indices.z), uint(indices.w));
+		for(int j = 0; j < 3; ++j)
+		{
+			int byteIndex = slot * 3 + j;
+			triangle[j] = header.x + int((words[byteIndex >> 2] >> ((byteIndex & 3) * 8)) & 0xFFu);
+		}
+	}
+	// Most significant bit of material: MIXED_MATERIALS
+	if(header.y < 0)
+	{
+		int materialIndex = (header.y & 0x7FFFFFFF) + slot;
+		triangle.w = texelFetch(TriangleBuffer, materialIndex / 4)[materialIndex % 4];
+	} else triangle.w = header.y;
+	return triangle;
+}
+#else
+Triangle FetchTriangle(int _index)
+{
+	return texelFetch(TriangleBuffer, _index);
+}
+#endif
+
 
 layout(binding=2) uniform samplerBuffer VertexPositionBuffer;
 
+// xy is the normal and zw the texture coordinate. The normal is either
+// (atan(normal.y, normal.x), normal.z) or octahedral (PACKED_VERTEX_INFO).
 layout(binding=3) uniform samplerBuffer VertexInfoBuffer;
 
 layout(binding=4) uniform samplerBuffer HierachyBuffer;
@@ -48,6 +97,17 @@ struct Node
 	#error "No node type defined"
 #endif */
 
+#ifdef INSTANCED_BVH
+// Tree over the world space boxes of all instances with the same layout as
+// HierachyBuffer. Leaf child codes are instance indices.
+layout(binding=14) uniform samplerBuffer InstanceHierarchyBuffer;
+// 4 texels per instance: the rows of the world to object transformation and
+// the root node of the instanced mesh in x (see Scene::LoadInstances).
+layout(binding=15) uniform samplerBuffer InstanceBuffer;
+// Instance of the last hit of TraceRay.
+int HitInstance = 0;
+#endif
+
 layout(binding=5) uniform samplerBuffer InitialLightSampleBuffer;
 /*struct LightSample
 {
@@ -91,14 +151,29 @@ struct Material
 };
 
 
+vec3 GetVertexNormal(vec4 vertexInfo)
+{
+#ifdef PACKED_VERTEX_INFO
+	return UnpackNormalOctahedral(vertexInfo.xy);
+#else
+	return UnpackNormal(vertexInfo.xy);
+#endif
+}
+
 void GetTriangleHitInfo(Triangle triangle, vec3 barycentricCoord, out vec3 normal, out vec2 texcoord)
 {
 	vec4 vdata0 = texelFetch(VertexInfoBuffer, triangle.x);
 	vec4 vdata1 = texelFetch(VertexInfoBuffer, triangle.y);
 	vec4 vdata2 = texelFetch(VertexInfoBuffer, triangle.z);
-	normal = normalize(UnpackNormal(vdata0.xy) * barycentricCoord.x +
-					   UnpackNormal(vdata1.xy) * barycentricCoord.y +
-					   UnpackNormal(vdata2.xy) * barycentricCoord.z);
+	normal = normalize(GetVertexNormal(vdata0) * barycentricCoord.x +
+					   GetVertexNormal(vdata1) * barycentricCoord.y +
+					   GetVertexNormal(vdata2) * barycentricCoord.z);
+#ifdef INSTANCED_BVH
+	// Transposed world to object transformation brings the normal to world space
+	normal = normalize(texelFetch(InstanceBuffer, HitInstance * 4).xyz * normal.x +
+					   texelFetch(InstanceBuffer, HitInstance * 4 + 1).xyz * normal.y +
+					   texelFetch(InstanceBuffer, HitInstance * 4 + 2).xyz * normal.z);
+#endif
 	texcoord = vdata0.zw * barycentricCoord.x +
 				vdata1.zw * barycentricCoord.y +
 				vdata2.zw * barycentricCoord.z;
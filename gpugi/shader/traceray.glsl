@@ -9,6 +9,14 @@
 
 // TRINORMAL_OUTPUT: Attention! triangleNormal is not normalized
 
+// INSTANCED_BVH: The traversal starts in the tree over the instances and
+// continues with the transformed ray in the hierarchy of the hit instance.
+// The ray parameter is the same in both spaces. _hitIndex refers to the
+// hierarchy of the instance (HitInstance).
+#if defined(INSTANCED_BVH) && defined(TRACERAY_IMPORTANCE_BREAK)
+	#error "The importance break is not supported for instanced scenes."
+#endif
+
 /// \param [inout] _hitIndex Node and triangle index of the final hit position. The triangle index
 ///		might not be defined if TRACERAY_IMPORTANCE_BREAK is enabled. The index is 0xFFFFFFFF then.
 ///		As input parameter this can be used to mask the intersection with a certain node or triangle
@@ -40,6 +48,7 @@
 {
 	int currentNodeIndex = 0;
 	int currentLeafIndex = 0; // For highly arcane, currently unknown reasons an initial value gives a distinct performance improvement: 10ms!!
+	int currentLeafEnd = 0;
 	#if defined(HIT_INDEX_OUTPUT) && !defined(ANY_HIT)
 		_hitIndex.x = 0xFFFFFFFF;
 		_hitIndex.y = 0xFFFFFFFF;
@@ -53,7 +62,49 @@
 	vec3 invRayDir = 1.0 / ray.Direction;
 	bool nextIsLeafNode = false;
 
+	#ifdef INSTANCED_BVH
+		bool inInstance = false;
+		int currentInstance = 0;
+		int instanceEscape = 0;
+		vec3 worldRayOrigin = ray.Origin;
+		vec3 worldRayDirection = ray.Direction;
+		vec3 worldInvRayDir = invRayDir;
+		vec4 worldToObject[3];
+	#endif
+
 	do {
+		#ifdef INSTANCED_BVH
+		if(!inInstance)
+		{
+			float newHit, exitDist;
+			uint childCode;
+			int escape;
+			if(FetchIntersectInstanceNode(ray.Origin, invRayDir, currentNodeIndex, newHit, exitDist, childCode, escape) && newHit <= rayLength)
+			{
+				if((childCode & 0x80000000u) != 0u)
+				{
+					// Continue in the hierarchy of the instance with the ray in object space
+					currentInstance = int(childCode & 0x7FFFFFFFu);
+					instanceEscape = escape;
+					worldToObject[0] = texelFetch(InstanceBuffer, currentInstance * 4);
+					worldToObject[1] = texelFetch(InstanceBuffer, currentInstance * 4 + 1);
+					worldToObject[2] = texelFetch(InstanceBuffer, currentInstance * 4 + 2);
+					ray.Origin = vec3(dot(worldToObject[0].xyz, worldRayOrigin) + worldToObject[0].w,
+									  dot(worldToObject[1].xyz, worldRayOrigin) + worldToObject[1].w,
+									  dot(worldToObject[2].xyz, worldRayOrigin) + worldToObject[2].w);
+					ray.Direction = vec3(dot(worldToObject[0].xyz, worldRayDirection),
+										 dot(worldToObject[1].xyz, worldRayDirection),
+										 dot(worldToObject[2].xyz, worldRayDirection));
+					invRayDir = 1.0 / ray.Direction;
+					currentNodeIndex = floatBitsToInt(texelFetch(InstanceBuffer, currentInstance * 4 + 3).x);
+					inInstance = true;
+				} else currentNodeIndex = int(childCode);
+			}
+			else currentNodeIndex = escape;
+			continue;
+		}
+		#endif
+
 		if(!nextIsLeafNode)
 		{
 			#ifdef TRACERAY_DEBUG_VARS
@@ -104,7 +155,8 @@
 				// If yes, we go into leave mode...
 				if(nextIsLeafNode)
 				{
-					currentLeafIndex = int(TRIANGLES_PER_LEAF * currentNodeIndex);
+					currentLeafIndex = GetLeafTriangleOffset(childCode);
+					currentLeafEnd = currentLeafIndex + GetLeafTriangleCount(childCode);
 					currentNodeIndex = escape;
 				}
 				#ifdef TRACERAY_IMPORTANCE_BREAK
@@ -123,56 +175,77 @@
 		if(nextIsLeafNode)
 		{
 			// Load triangle.
-			Triangle triangle = texelFetch(TriangleBuffer, currentLeafIndex);
-			if(triangle.x == triangle.y) // Last check if this is condition helps perf: 05.11 (testscene.txt), GK104
+			Triangle triangle = FetchTriangle(currentLeafIndex);
+			#ifdef TRACERAY_DEBUG_VARS
+				++numTrianglesVisited;
+			#endif
+
+			// Load vertex positions
+			vec3 positions[3];
+			positions[0] = texelFetch(VertexPositionBuffer, triangle.x).xyz;
+			positions[1] = texelFetch(VertexPositionBuffer, triangle.y).xyz;
+			positions[2] = texelFetch(VertexPositionBuffer, triangle.z).xyz;
+
+			// Check hit.
+			vec3 newTriangleNormal;
+			float newHit; vec3 newBarycentricCoord;
+			if(IntersectTriangle(ray, positions[0], positions[1], positions[2], newHit, newBarycentricCoord, newTriangleNormal)
+				&& newHit < rayLength)
 			{
-				nextIsLeafNode = false;
-			} else {
-				#ifdef TRACERAY_DEBUG_VARS
-					++numTrianglesVisited;
-				#endif
+				#ifdef ANY_HIT
+					return true;
+				#else
+					rayLength = newHit;
+					outTriangle = triangle;
+					outBarycentricCoord = newBarycentricCoord;
+					#ifdef HIT_INDEX_OUTPUT
+						_hitIndex.x = lastNodeIndex;
+						_hitIndex.y = currentLeafIndex;
+					#endif
+					#ifdef TRACERAY_IMPORTANCE_BREAK
+						_nodeImportance = lastNodeImportance;
+						_nodeSizeSq = lastNodeSizeSq;
+					#endif
 
-				// Load vertex positions
-				vec3 positions[3];
-				positions[0] = texelFetch(VertexPositionBuffer, triangle.x).xyz;
-				positions[1] = texelFetch(VertexPositionBuffer, triangle.y).xyz;
-				positions[2] = texelFetch(VertexPositionBuffer, triangle.z).xyz;
-
-				// Check hit.
-				vec3 newTriangleNormal;
-				float newHit; vec3 newBarycentricCoord;
-				if(IntersectTriangle(ray, positions[0], positions[1], positions[2], newHit, newBarycentricCoord, newTriangleNormal)
-					&& newHit < rayLength)
-				{
-					#ifdef ANY_HIT
-						return true;
+				#ifdef TRINORMAL_OUTPUT
+					#ifdef INSTANCED_BVH
+						triangleNormal = worldToObject[0].xyz * newTriangleNormal.x +
+										 worldToObject[1].xyz * newTriangleNormal.y +
+										 worldToObject[2].xyz * newTriangleNormal.z;
 					#else
-						rayLength = newHit;
-						outTriangle = triangle;
-						outBarycentricCoord = newBarycentricCoord;
-						#ifdef HIT_INDEX_OUTPUT
-							_hitIndex.x = lastNodeIndex;
-							_hitIndex.y = currentLeafIndex;
-						#endif
-						#ifdef TRACERAY_IMPORTANCE_BREAK
-							_nodeImportance = lastNodeImportance;
-							_nodeSizeSq = lastNodeSizeSq;
-						#endif
-
-					#ifdef TRINORMAL_OUTPUT
 						triangleNormal = newTriangleNormal;
 					#endif
+				#endif
+				#ifdef INSTANCED_BVH
+					HitInstance = currentInstance;
+				#endif
 
-						// Cannot return yet, there might be a triangle that is hit before this one!
-					#endif
-				}
-
-				++currentLeafIndex;
-				nextIsLeafNode = (currentLeafIndex % TRIANGLES_PER_LEAF) != 0;
+					// Cannot return yet, there might be a triangle that is hit before this one!
+				#endif
 			}
+
+			++currentLeafIndex;
+			nextIsLeafNode = currentLeafIndex < currentLeafEnd;
 		}
 
+		#ifdef INSTANCED_BVH
+			// The escape 0 leaves the hierarchy of the instance (the root of
+			// an instanced mesh is never reached by an escape).
+			if(currentNodeIndex == 0 && !nextIsLeafNode)
+			{
+				ray.Origin = worldRayOrigin;
+				ray.Direction = worldRayDirection;
+				invRayDir = worldInvRayDir;
+				currentNodeIndex = instanceEscape;
+				inInstance = false;
+			}
+		#endif
+
+	#ifdef INSTANCED_BVH
+	} while(currentNodeIndex != 0 || nextIsLeafNode || inInstance);
+	#else
 	} while(currentNodeIndex != 0 || nextIsLeafNode);
+	#endif
 
 #ifdef ANY_HIT
 	return false;